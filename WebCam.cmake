@@ -16,4 +16,10 @@ IF(HAVE_LIBV4LCONVERT)
 	#	SET(LIBWEBCAM_LIBS "${LIBWEBCAM_LIBS};v4lconvert")
 ENDIF()
 
-ADD_LIBRARY(webcam v4l2.c libv4l2.c libwebcam.h)
+# shm_open() is in librt with older glibc
+CHECK_LIBRARY_EXISTS(rt shm_open "sys/mman.h" HAVE_LIBRT)
+IF(HAVE_LIBRT)
+	SET(LIBWEBCAM_LIBS "${LIBWEBCAM_LIBS};rt")
+ENDIF()
+
+ADD_LIBRARY(webcam v4l2.c libv4l2.c shm.c libwebcam.h)
@@ -33,6 +33,14 @@ typedef enum webcam_controls {
 	WEBCAM_GAMMA
 } webcam_controls_t;
 
+/* Pixel formats of the frames passed to webcam_wait_frame_cb(). YUV formats use BT.601 limited range. */
+typedef enum webcam_pixel_format {
+	WEBCAM_PIX_RGB24,	/* packed R G B, converted by libv4l2 if needed (default) */
+	WEBCAM_PIX_YUYV,	/* packed Y0 U Y1 V, 4:2:2 */
+	WEBCAM_PIX_NV12,	/* Y plane followed by interleaved UV plane, 4:2:0 */
+	WEBCAM_PIX_YUV420	/* Y plane followed by U and V planes of bpl/2 bytes per line, 4:2:0 */
+} webcam_pixel_format_t;
+
 typedef struct webcam {
 	void *priv;
 
@@ -46,6 +54,9 @@ typedef struct webcam {
 	webcam_color_t *image;
 
 	/* img contains uint32_t's in form 0x00rrggbb */
+
+	/* Pixel format of the frames passed to webcam_wait_frame_cb() */
+	webcam_pixel_format_t format;
 } webcam_t;
 
 typedef void (*webcam_frame_cb)(void *ctx, webcam_t *cam, unsigned char *pixels, size_t bpl, size_t size);
@@ -59,6 +70,9 @@ char* webcam_name(int id);
 /* Try to open camera with number =num. Width and height is recomended values so you must look inside webcam_t for actual sizes. */
 webcam_t* webcam_open(int id, unsigned width, unsigned height);
 
+/* Same as webcam_open() but asks for frames in =format. Falls back to WEBCAM_PIX_RGB24 when the camera can't deliver it, so check cam->format. */
+webcam_t* webcam_open_format(int id, unsigned width, unsigned height, webcam_pixel_format_t format);
+
 /* Close device and free resources */
 void webcam_close(webcam_t *cam);
 
@@ -74,11 +88,53 @@ int webcam_wait_frame(webcam_t *cam, unsigned delay);
 /* Wait for next frame but call function with arguments with data not copy it */
 int webcam_wait_frame_cb(webcam_t *cam, webcam_frame_cb cb, void *arg, unsigned delay);
 
+/* Get the descriptor that is readable when a frame is ready, to wait for frames in your own
+ * poll/epoll loop. Don't read from it, take frames with webcam_try_frame(). */
+int webcam_get_fd(webcam_t *cam);
+
+/* Same as webcam_wait_frame_cb() but doesn't wait: returns 1 after calling =cb with a frame,
+ * 0 when none is ready and -1 on errors */
+int webcam_try_frame(webcam_t *cam, webcam_frame_cb cb, void *arg);
+
 /* Set control to camera. Value must be in interval [0-100] */
 int webcam_set_control(webcam_t *cam, webcam_controls_t id, int value);
 /* Get control from camera. Returns value in [0-100] */
 int webcam_get_control(webcam_t *cam, webcam_controls_t id);
 
+/* Shared memory publishing: every captured frame is also copied to a POSIX shared memory ring of
+ * =slots frames, so local processes can use the newest one in place. Frames are published until
+ * the camera is closed, NULL =name stops it. */
+int webcam_publish(webcam_t *cam, const char *name, unsigned slots);
+
+/* Reader of a ring published by another process */
+typedef struct webcam_shm webcam_shm_t;
+
+typedef struct webcam_shm_frame {
+	/* Pixels in the ring, they are overwritten once slots - 1 newer frames are published */
+	const unsigned char *pixels;
+	size_t size;
+	size_t bpl;
+	unsigned width, height;
+	webcam_pixel_format_t format;
+	unsigned long long number; /* frames are numbered from 1 */
+	unsigned long long time;   /* capture time in microseconds since the epoch */
+
+	/* For webcam_shm_valid() */
+	unsigned seq;
+	unsigned slot;
+} webcam_shm_frame_t;
+
+/* Map ring =name read-only. Open it again when webcam_shm_latest() returns -1. */
+webcam_shm_t* webcam_shm_open(const char *name);
+void webcam_shm_close(webcam_shm_t *shm);
+
+/* Get the newest frame without copying it or any syscall.
+ * Returns 1 with =frame filled, 0 when there is no frame yet and -1 when the publisher is gone */
+int webcam_shm_latest(webcam_shm_t *shm, webcam_shm_frame_t *frame);
+
+/* Check =frame's pixels weren't overwritten, call it after using them and drop the results if it fails */
+int webcam_shm_valid(webcam_shm_t *shm, const webcam_shm_frame_t *frame);
+
 /* extern "C" { */
 #ifdef __cplusplus
 }
@@ -0,0 +1,251 @@
+#include "shm.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Raw frames published in POSIX shared memory.
+ * The object is a header page followed by page aligned slots, each a slot header and the
+ * pixels. Every slot is guarded by a sequence counter that is odd while the writer copies a
+ * frame into it, so readers use the pixels in place and just check the counter didn't move
+ * when they are done. The writer fills slots in turn and never waits for readers. */
+
+#define SHM_MAGIC "WEBCAMS1"
+#define SHM_PAGE 4096
+#define SHM_SLOT_HEADER 64
+#define ROUND_PAGE(x) (((x) + SHM_PAGE - 1) & ~(uint64_t)(SHM_PAGE - 1))
+
+struct shm_header {
+	char magic[8];
+	uint32_t slots;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t bpl;
+	uint64_t slot_size;   /* bytes of pixels a slot holds */
+	uint64_t slot_stride; /* bytes from a slot to the next one */
+	_Atomic uint64_t latest; /* number of the newest complete frame, 0 before the first one */
+	atomic_uint closed;
+};
+
+struct shm_slot {
+	atomic_uint seq;
+	uint32_t pad;
+	_Atomic uint64_t number;
+	_Atomic uint64_t time;
+	_Atomic uint64_t size;
+};
+
+struct shm_ring {
+	char name[256];
+	unsigned char *map;
+	size_t map_size;
+	struct shm_header *hdr;
+	uint64_t number;
+};
+
+struct webcam_shm {
+	unsigned char *map;
+	size_t map_size;
+	struct shm_header *hdr;
+};
+
+/* Names are given with or without the leading slash */
+static void shm_name(char *buf, size_t len, const char *name)
+{
+	snprintf(buf, len, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+static struct shm_slot *shm_slot(struct shm_header *hdr, unsigned char *map, uint64_t number)
+{
+	return (struct shm_slot*)(map + SHM_PAGE + (number % hdr->slots) * hdr->slot_stride);
+}
+
+struct shm_ring* shm_ring_create(const char *name, unsigned slots, webcam_t *cam, size_t bpl, size_t size)
+{
+	struct shm_ring *ring;
+	uint64_t stride = ROUND_PAGE(SHM_SLOT_HEADER + size);
+	int fd;
+
+	if (slots < 2)
+		slots = 2;
+
+	ring = calloc(1, sizeof(struct shm_ring));
+	if (!ring)
+		return NULL;
+	shm_name(ring->name, sizeof(ring->name), name);
+	ring->map_size = SHM_PAGE + slots * stride;
+
+	/* Readers of an earlier ring keep it until they close it, a new one is created */
+	shm_unlink(ring->name);
+	fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		free(ring);
+		return NULL;
+	}
+	if (ftruncate(fd, ring->map_size)) {
+		close(fd);
+		shm_unlink(ring->name);
+		free(ring);
+		return NULL;
+	}
+
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring->map == MAP_FAILED) {
+		shm_unlink(ring->name);
+		free(ring);
+		return NULL;
+	}
+
+	ring->hdr = (struct shm_header*)ring->map;
+	ring->hdr->slots = slots;
+	ring->hdr->width = cam->width;
+	ring->hdr->height = cam->height;
+	ring->hdr->format = cam->format;
+	ring->hdr->bpl = bpl;
+	ring->hdr->slot_size = size;
+	ring->hdr->slot_stride = stride;
+	/* The magic goes last, readers check it before anything else */
+	atomic_thread_fence(memory_order_release);
+	memcpy(ring->hdr->magic, SHM_MAGIC, sizeof(ring->hdr->magic));
+
+	return ring;
+}
+
+void shm_ring_write(struct shm_ring *ring, const unsigned char *pixels, size_t size)
+{
+	struct shm_slot *slot;
+	struct timeval tv;
+	unsigned seq;
+
+	if (size > ring->hdr->slot_size)
+		size = ring->hdr->slot_size;
+
+	ring->number++;
+	slot = shm_slot(ring->hdr, ring->map, ring->number);
+	seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	gettimeofday(&tv, NULL);
+	memcpy((unsigned char*)slot + SHM_SLOT_HEADER, pixels, size);
+	atomic_store_explicit(&slot->number, ring->number, memory_order_relaxed);
+	atomic_store_explicit(&slot->time, (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec, memory_order_relaxed);
+	atomic_store_explicit(&slot->size, size, memory_order_relaxed);
+
+	atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+	atomic_store_explicit(&ring->hdr->latest, ring->number, memory_order_release);
+}
+
+void shm_ring_free(struct shm_ring *ring)
+{
+	if (!ring)
+		return;
+
+	atomic_store_explicit(&ring->hdr->closed, 1, memory_order_release);
+	munmap(ring->map, ring->map_size);
+	shm_unlink(ring->name);
+	free(ring);
+}
+
+webcam_shm_t* webcam_shm_open(const char *name)
+{
+	webcam_shm_t *shm;
+	struct stat st;
+	char path[256];
+	int fd;
+
+	shm_name(path, sizeof(path), name);
+	fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	shm = calloc(1, sizeof(webcam_shm_t));
+	if (!shm || fstat(fd, &st) || st.st_size < SHM_PAGE) {
+		free(shm);
+		close(fd);
+		return NULL;
+	}
+
+	shm->map_size = st.st_size;
+	shm->map = mmap(NULL, shm->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->map == MAP_FAILED) {
+		free(shm);
+		return NULL;
+	}
+
+	shm->hdr = (struct shm_header*)shm->map;
+	if (memcmp(shm->hdr->magic, SHM_MAGIC, sizeof(shm->hdr->magic)) == 0) {
+		atomic_thread_fence(memory_order_acquire);
+		if (shm->hdr->slots && SHM_PAGE + shm->hdr->slots * shm->hdr->slot_stride == shm->map_size)
+			return shm;
+	}
+
+	munmap(shm->map, shm->map_size);
+	free(shm);
+	return NULL;
+}
+
+void webcam_shm_close(webcam_shm_t *shm)
+{
+	if (!shm)
+		return;
+
+	munmap(shm->map, shm->map_size);
+	free(shm);
+}
+
+int webcam_shm_latest(webcam_shm_t *shm, webcam_shm_frame_t *frame)
+{
+	struct shm_header *hdr = shm->hdr;
+	struct shm_slot *slot;
+	uint64_t number;
+	unsigned seq;
+	int tries;
+
+	/* Only a writer lapping the whole ring meanwhile makes a try fail */
+	for (tries = 0; tries < 8; tries++) {
+		if (atomic_load_explicit(&hdr->closed, memory_order_acquire))
+			return -1;
+		number = atomic_load_explicit(&hdr->latest, memory_order_acquire);
+		if (!number)
+			return 0;
+
+		slot = shm_slot(hdr, shm->map, number);
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		frame->pixels = (const unsigned char*)slot + SHM_SLOT_HEADER;
+		frame->size = atomic_load_explicit(&slot->size, memory_order_relaxed);
+		frame->number = atomic_load_explicit(&slot->number, memory_order_relaxed);
+		frame->time = atomic_load_explicit(&slot->time, memory_order_relaxed);
+		frame->bpl = hdr->bpl;
+		frame->width = hdr->width;
+		frame->height = hdr->height;
+		frame->format = (webcam_pixel_format_t)hdr->format;
+		frame->seq = seq;
+		frame->slot = number % hdr->slots;
+
+		if (webcam_shm_valid(shm, frame))
+			return 1;
+	}
+
+	return 0;
+}
+
+int webcam_shm_valid(webcam_shm_t *shm, const webcam_shm_frame_t *frame)
+{
+	struct shm_slot *slot = shm_slot(shm->hdr, shm->map, frame->slot);
+
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&slot->seq, memory_order_relaxed) == frame->seq;
+}
@@ -0,0 +1,19 @@
+#ifndef WEBCAM_SHM_H_INC
+#define WEBCAM_SHM_H_INC
+
+#include "libwebcam.h"
+
+/* Writer side of the shared memory ring, used by the capture code */
+
+struct shm_ring;
+
+/* Creates the ring =name of =slots frames of up to =size bytes */
+struct shm_ring* shm_ring_create(const char *name, unsigned slots, webcam_t *cam, size_t bpl, size_t size);
+
+/* Copies a captured frame to the oldest slot and makes it the newest one */
+void shm_ring_write(struct shm_ring *ring, const unsigned char *pixels, size_t size);
+
+/* Tells readers there will be no more frames and removes the name */
+void shm_ring_free(struct shm_ring *ring);
+
+#endif
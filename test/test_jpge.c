@@ -0,0 +1,531 @@
+/* Checks of the bundled JPEG encoder (wwwcam/jpeg/jpge.c).
+ *
+ * jpge_check -w dir  encodes a set of test images and writes them to dir
+ * jpge_check -c dir  encodes the same images and compares them byte for byte with dir
+ *
+ * The program is built once per DCT path: without SIMD (JPGE_NO_SIMD), with SSE2 (JPGE_NO_AVX2) and with
+ * the default selection (AVX2 where the CPU has it, NEON on ARM). The build without SIMD writes the
+ * reference images the other builds must match.
+ *
+ * Every build also checks that:
+ *  - parallel encoding in bands gives the same bytes as serial encoding with the same restart interval,
+ *  - YUYV, NV12 and I420 input decode to the same picture as the equivalent RGB input, within
+ *    YUV_MEAN_DIFF on average and YUV_MAX_DIFF for any sample. The RGB input is computed from the YUV
+ *    samples and rounded, then converted back by the encoder, so both differ by a rounding step before
+ *    quantization amplifies it,
+ *  - a partial per-MCU mask decodes, leaves the unmasked MCUs as they are without a mask and codes the
+ *    masked ones with their mean only. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wwwcam/jpeg/jpge.h"
+
+#define STBI_HEADER_FILE_ONLY
+#define STBI_NO_HDR
+#include "wwwcam/jpeg/stb_image.c"
+
+/* Tolerance of YUV against RGB input, in 8 bit RGB steps */
+#define YUV_MEAN_DIFF 1.5
+#define YUV_MAX_DIFF 8
+
+struct image {
+	int width, height;
+	unsigned char *rgb;   /* width * height * 3 */
+	unsigned char *grey;  /* width * height */
+};
+
+struct encoded {
+	void *buf;
+	int size, capacity;
+};
+
+static unsigned rand_state = 12345;
+
+static unsigned next_rand(void)
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 16;
+}
+
+static int clamp(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Gradients, hard edges, saturated blocks and noise, so all coefficient magnitudes occur */
+static void image_fill(struct image *img)
+{
+	unsigned char *p = img->rgb;
+	int x, y, c, v;
+
+	for (y = 0; y < img->height; y++) {
+		for (x = 0; x < img->width; x++, p += 3) {
+			for (c = 0; c < 3; c++) {
+				if (x < img->width / 3)
+					v = (x * 7 + y * 3 + c * 40) & 255;
+				else if (x < img->width * 2 / 3)
+					v = ((x / 8 + y / 8 + c) & 1) ? 255 : 0;
+				else
+					v = next_rand() & 255;
+				p[c] = v;
+			}
+			img->grey[y * img->width + x] = (p[0] + p[1] * 2 + p[2]) >> 2;
+		}
+	}
+}
+
+static int image_new(struct image *img, int width, int height)
+{
+	img->width = width;
+	img->height = height;
+	img->rgb = malloc(width * height * 3);
+	img->grey = malloc(width * height);
+	if (!img->rgb || !img->grey)
+		return -1;
+	image_fill(img);
+	return 0;
+}
+
+static void image_free(struct image *img)
+{
+	free(img->rgb);
+	free(img->grey);
+}
+
+static int encode(struct jpeg_encoder *enc, struct encoded *out, const struct image *img, int channels,
+		  const struct jpeg_params *params)
+{
+	return jpeg_encoder_compress_to_memory(enc, &out->buf, &out->size, &out->capacity, img->width, img->height,
+					       channels, 0, channels == 1 ? img->grey : img->rgb, params);
+}
+
+/* Calls the bands last to first, any order must give the same image */
+static void run_reversed(void *ctx, void (*fn)(void *arg, int index), void *arg, int count)
+{
+	while (count--)
+		fn(arg, count);
+}
+
+/* Writes or compares the encoded image with name in dir */
+static int check_file(const char *dir, int write, const char *name, const struct encoded *out)
+{
+	char path[512];
+	unsigned char *ref;
+	long size;
+	FILE *f;
+	int rv = 0;
+
+	snprintf(path, sizeof(path), "%s/%s.jpg", dir, name);
+	f = fopen(path, write ? "wb" : "rb");
+	if (!f) {
+		fprintf(stderr, "Error: can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (write) {
+		if (fwrite(out->buf, 1, out->size, f) != (size_t)out->size)
+			rv = -1;
+		if (fclose(f))
+			rv = -1;
+		if (rv)
+			fprintf(stderr, "Error: can't write %s\n", path);
+		return rv;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	ref = malloc(size > 0 ? size : 1);
+	if (!ref || fread(ref, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "Error: can't read %s\n", path);
+		rv = -1;
+	} else if (size != out->size || memcmp(ref, out->buf, size)) {
+		fprintf(stderr, "FAIL: %s differs from the reference (%d bytes, reference %ld)\n", name, out->size, size);
+		rv = -1;
+	}
+	free(ref);
+	fclose(f);
+
+	return rv;
+}
+
+/* Images of all subsamplings, qualities and passes, compared with the reference build */
+static int check_paths(struct jpeg_encoder *enc, const struct image *img, const char *dir, int write)
+{
+	static const int qualities[] = { 10, 75, 100 };
+	struct jpeg_params params;
+	struct encoded out = { NULL, 0, 0 };
+	char name[64];
+	int s, q, two_pass, channels;
+	int failed = 0;
+
+	for (s = JPGE_Y_ONLY; s <= JPGE_H2V2; s++) {
+		for (q = 0; q < (int)(sizeof(qualities) / sizeof(qualities[0])); q++) {
+			for (two_pass = 0; two_pass < 2; two_pass++) {
+				jpeg_params_init(&params);
+				params.m_subsampling = s;
+				params.m_quality = qualities[q];
+				params.m_two_pass_flag = two_pass;
+				channels = s == JPGE_Y_ONLY ? 1 : 3;
+
+				snprintf(name, sizeof(name), "%dx%d_s%d_q%d_p%d", img->width, img->height, s,
+					 qualities[q], two_pass + 1);
+				if (!encode(enc, &out, img, channels, &params)) {
+					fprintf(stderr, "FAIL: %s can't be encoded\n", name);
+					failed++;
+				} else if (check_file(dir, write, name, &out)) {
+					failed++;
+				}
+			}
+		}
+	}
+	free(out.buf);
+
+	return failed;
+}
+
+/* Parallel bands against serial encoding with the same restart interval */
+static int check_parallel(struct jpeg_encoder *enc, const struct image *img)
+{
+	static const int restart_rows[] = { 1, 2, 5 };
+	static const int bands[] = { 2, 3, 8 };
+	struct jpeg_params params;
+	struct encoded serial = { NULL, 0, 0 }, parallel = { NULL, 0, 0 };
+	int s, r, b, channels;
+	int failed = 0;
+
+	for (s = JPGE_Y_ONLY; s <= JPGE_H2V2; s++) {
+		for (r = 0; r < (int)(sizeof(restart_rows) / sizeof(restart_rows[0])); r++) {
+			jpeg_params_init(&params);
+			params.m_subsampling = s;
+			params.m_restart_rows = restart_rows[r];
+			channels = s == JPGE_Y_ONLY ? 1 : 3;
+
+			jpeg_encoder_set_parallel(enc, NULL, NULL, 0);
+			if (!encode(enc, &serial, img, channels, &params)) {
+				fprintf(stderr, "FAIL: %dx%d s%d r%d can't be encoded serially\n", img->width,
+					img->height, s, restart_rows[r]);
+				failed++;
+				continue;
+			}
+
+			for (b = 0; b < (int)(sizeof(bands) / sizeof(bands[0])); b++) {
+				jpeg_encoder_set_parallel(enc, run_reversed, NULL, bands[b]);
+				if (!encode(enc, &parallel, img, channels, &params) || parallel.size != serial.size ||
+				    memcmp(parallel.buf, serial.buf, serial.size)) {
+					fprintf(stderr, "FAIL: %dx%d s%d r%d in %d bands differs from serial encoding\n",
+						img->width, img->height, s, restart_rows[r], bands[b]);
+					failed++;
+				}
+			}
+		}
+	}
+	jpeg_encoder_set_parallel(enc, NULL, NULL, 0);
+	free(serial.buf);
+	free(parallel.buf);
+
+	return failed;
+}
+
+/* Compares two JPEG images decoded to RGB, returns 0 when they are within the YUV tolerance */
+static int compare_decoded(const char *name, const struct encoded *a, const struct encoded *b)
+{
+	unsigned char *pa, *pb;
+	int wa, ha, wb, hb, ca, cb;
+	long i, n, sum = 0;
+	int d, max = 0;
+	double mean;
+	int rv = 0;
+
+	pa = stbi_load_from_memory(a->buf, a->size, &wa, &ha, &ca, 3);
+	pb = stbi_load_from_memory(b->buf, b->size, &wb, &hb, &cb, 3);
+	if (!pa || !pb || wa != wb || ha != hb) {
+		fprintf(stderr, "FAIL: %s can't be decoded\n", name);
+		rv = -1;
+	} else {
+		n = (long)wa * ha * 3;
+		for (i = 0; i < n; i++) {
+			d = abs(pa[i] - pb[i]);
+			sum += d;
+			if (d > max)
+				max = d;
+		}
+		mean = (double)sum / n;
+		if (mean > YUV_MEAN_DIFF || max > YUV_MAX_DIFF) {
+			fprintf(stderr, "FAIL: %s differs from RGB input by %.3f on average, %d at most\n", name,
+				mean, max);
+			rv = -1;
+		}
+	}
+	if (pa)
+		stbi_image_free(pa);
+	if (pb)
+		stbi_image_free(pb);
+
+	return rv;
+}
+
+/* Masked 8x8 MCUs of a grey image decode to their mean. The encoder takes the DC coefficient as
+ * (sum + 4) >> 3 of the level shifted samples and the quantizer is 1 at quality 100, the decoder
+ * gives back dc / 8 rounded half up. Blocks with a sum just below a multiple of 32 tell it from
+ * a truncated DC. */
+static int mask_expected(const struct image *img, int bx, int by)
+{
+	int x, y, sum = 0, dc;
+
+	for (y = by * 8; y < by * 8 + 8; y++)
+		for (x = bx * 8; x < bx * 8 + 8; x++)
+			sum += img->grey[y * img->width + x] - 128;
+	dc = (sum + 4) >> 3;
+
+	return clamp(128 + ((dc + 4) >> 3));
+}
+
+/* Encodes with a mask over a third of the MCUs and without one. For subsamplings with 8x8 MCUs the
+ * unmasked MCUs must decode to the same pixels and the masked ones must be flat, at their mean for
+ * grey images. Chroma upsampling blends neighbouring MCUs, the other subsamplings only have to decode. */
+static int check_mask(struct jpeg_encoder *enc, const struct image *img)
+{
+	struct jpeg_params params;
+	struct encoded masked = { NULL, 0, 0 }, plain = { NULL, 0, 0 };
+	unsigned char *mask, *pm = NULL, *pp = NULL, *block;
+	int s, channels, mcu_w, mcu_h, cols, rows, mx, my, x, y, c, w, h, comp;
+	int failed = 0, bad;
+	char name[64];
+
+	for (s = JPGE_Y_ONLY; s <= JPGE_H2V2; s++) {
+		channels = s == JPGE_Y_ONLY ? 1 : 3;
+		mcu_w = s >= JPGE_H2V1 ? 16 : 8;
+		mcu_h = s == JPGE_H2V2 ? 16 : 8;
+		cols = (img->width + mcu_w - 1) / mcu_w;
+		rows = (img->height + mcu_h - 1) / mcu_h;
+		snprintf(name, sizeof(name), "%dx%d s%d masked", img->width, img->height, s);
+
+		mask = malloc(cols * rows);
+		if (!mask)
+			return failed + 1;
+		for (my = 0; my < rows; my++)
+			for (mx = 0; mx < cols; mx++)
+				mask[my * cols + mx] = (mx + my) % 3 == 0;
+
+		jpeg_params_init(&params);
+		params.m_subsampling = s;
+		params.m_quality = 100;
+		if (!encode(enc, &plain, img, channels, &params)) {
+			fprintf(stderr, "FAIL: %s can't be encoded without the mask\n", name);
+			failed++;
+			free(mask);
+			continue;
+		}
+		params.m_mcu_mask = mask;
+		if (!encode(enc, &masked, img, channels, &params)) {
+			fprintf(stderr, "FAIL: %s can't be encoded\n", name);
+			failed++;
+			free(mask);
+			continue;
+		}
+
+		pm = stbi_load_from_memory(masked.buf, masked.size, &w, &h, &comp, channels);
+		pp = stbi_load_from_memory(plain.buf, plain.size, &w, &h, &comp, channels);
+		if (!pm || !pp || w != img->width || h != img->height) {
+			fprintf(stderr, "FAIL: %s can't be decoded\n", name);
+			failed++;
+		} else if (s <= JPGE_H1V1) {
+			bad = 0;
+			for (my = 0; my < rows && !bad; my++) {
+				for (mx = 0; mx < cols && !bad; mx++) {
+					block = pm + (my * 8 * w + mx * 8) * channels;
+					for (y = my * 8; y < my * 8 + 8 && y < h; y++) {
+						for (x = mx * 8; x < mx * 8 + 8 && x < w; x++) {
+							for (c = 0; c < channels; c++) {
+								long i = ((long)y * w + x) * channels + c;
+								if (!mask[my * cols + mx])
+									bad |= pm[i] != pp[i];
+								else
+									bad |= pm[i] != block[c];
+							}
+						}
+					}
+					if (bad) {
+						fprintf(stderr, "FAIL: %s MCU %d,%d is %s\n", name, mx, my,
+							mask[my * cols + mx] ? "not flat" : "changed by the mask");
+					} else if (channels == 1 && mask[my * cols + mx] && (mx + 1) * 8 <= w &&
+						   (my + 1) * 8 <= h && *block != mask_expected(img, mx, my)) {
+						fprintf(stderr, "FAIL: %s MCU %d,%d decodes to %d instead of its mean %d\n",
+							name, mx, my, *block, mask_expected(img, mx, my));
+						bad = 1;
+					}
+				}
+			}
+			failed += bad;
+		}
+		if (pm)
+			stbi_image_free(pm);
+		if (pp)
+			stbi_image_free(pp);
+		free(mask);
+	}
+	free(masked.buf);
+	free(plain.buf);
+
+	return failed;
+}
+
+/* YCbCr samples of a smooth picture with some detail, kept in the RGB gamut */
+static void yuv_sample(int x, int y, int w, int h, int *Y, int *Cb, int *Cr)
+{
+	*Y = 50 + (x * 125 / w + (((x / 4) ^ (y / 4)) & 1) * 20) % 146;
+	*Cb = 108 + ((x / 2) * 30 / w + y * 10 / h) % 41;
+	*Cr = 108 + ((y / 2) * 30 / h + x * 10 / w) % 41;
+}
+
+/* The BT.601 limited range sample of a full range one */
+static int limited(int v, int luma)
+{
+	return luma ? 16 + (v * 219 + 127) / 255 : 128 + ((v - 128) * 224 + (v < 128 ? -127 : 127)) / 255;
+}
+
+/* YUYV, NV12 and I420 input against the RGB image they stand for */
+static int check_yuv(struct jpeg_encoder *enc, int width, int height)
+{
+	static const struct {
+		enum jpge_yuv_format format;
+		enum subsampling subsampling;
+		const char *name;
+	} formats[] = {
+		{ JPGE_YUYV, JPGE_H2V1, "YUYV" },
+		{ JPGE_NV12, JPGE_H2V2, "NV12" },
+		{ JPGE_I420, JPGE_H2V2, "I420" },
+	};
+	struct jpeg_params params;
+	struct encoded from_yuv = { NULL, 0, 0 }, from_rgb = { NULL, 0, 0 };
+	unsigned char *yuv, *rgb, *p, *cb, *cr;
+	int f, lim, x, y, Y, Cb, Cr, unused, cy;
+	int failed = 0;
+	char name[64];
+
+	yuv = malloc(width * height * 2);
+	rgb = malloc(width * height * 3);
+	if (!yuv || !rgb) {
+		free(yuv);
+		free(rgb);
+		return 1;
+	}
+
+	for (f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); f++) {
+		for (lim = 0; lim < 2; lim++) {
+			/* Chroma is the same for the pixels sharing it in the source format */
+			for (y = 0; y < height; y++) {
+				for (x = 0; x < width; x++) {
+					cy = formats[f].format == JPGE_YUYV ? y : y & ~1;
+					yuv_sample(x, y, width, height, &Y, &Cb, &Cr);
+					yuv_sample(x & ~1, cy, width, height, &unused, &Cb, &Cr);
+
+					p = rgb + (y * width + x) * 3;
+					p[0] = clamp(Y + (1436 * (Cr - 128) + 512) / 1024);
+					p[1] = clamp(Y - (352 * (Cb - 128) + 731 * (Cr - 128) - 512) / 1024);
+					p[2] = clamp(Y + (1815 * (Cb - 128) + 512) / 1024);
+
+					if (lim) {
+						Y = limited(Y, 1);
+						Cb = limited(Cb, 0);
+						Cr = limited(Cr, 0);
+					}
+					switch (formats[f].format) {
+					case JPGE_YUYV:
+						p = yuv + (y * width + (x & ~1)) * 2;
+						p[(x & 1) * 2] = Y;
+						p[1] = Cb;
+						p[3] = Cr;
+						break;
+					case JPGE_NV12:
+						yuv[y * width + x] = Y;
+						cb = yuv + width * height + (y / 2) * width + (x & ~1);
+						cb[0] = Cb;
+						cb[1] = Cr;
+						break;
+					case JPGE_I420:
+						yuv[y * width + x] = Y;
+						cb = yuv + width * height + (y / 2) * (width / 2) + x / 2;
+						cr = yuv + width * height + (height / 2) * (width / 2) + (y / 2) * (width / 2) + x / 2;
+						*cb = Cb;
+						*cr = Cr;
+						break;
+					}
+				}
+			}
+
+			jpeg_params_init(&params);
+			params.m_quality = 90;
+			params.m_subsampling = formats[f].subsampling;
+			params.m_yuv_limited_range = lim;
+			snprintf(name, sizeof(name), "%dx%d %s%s", width, height, formats[f].name, lim ? " limited" : "");
+
+			if (!jpeg_encoder_compress_yuv_to_memory(enc, &from_yuv.buf, &from_yuv.size, &from_yuv.capacity,
+								 width, height, formats[f].format, 0, yuv, &params) ||
+			    !jpeg_encoder_compress_to_memory(enc, &from_rgb.buf, &from_rgb.size, &from_rgb.capacity,
+							     width, height, 3, 0, rgb, &params)) {
+				fprintf(stderr, "FAIL: %s can't be encoded\n", name);
+				failed++;
+			} else if (compare_decoded(name, &from_yuv, &from_rgb)) {
+				failed++;
+			}
+		}
+	}
+
+	free(from_yuv.buf);
+	free(from_rgb.buf);
+	free(yuv);
+	free(rgb);
+
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[][2] = { { 640, 480 }, { 203, 117 }, { 16, 16 }, { 9, 1 } };
+	struct jpeg_encoder *enc;
+	struct image img;
+	int write, i;
+	int failed = 0;
+
+	if (argc != 3 || (strcmp(argv[1], "-w") && strcmp(argv[1], "-c"))) {
+		fprintf(stderr, "Usage: %s -w|-c <reference dir>\n", argv[0]);
+		return 2;
+	}
+	write = !strcmp(argv[1], "-w");
+
+	enc = jpeg_encoder_new();
+	if (!enc) {
+		fprintf(stderr, "Error: can't create encoder\n");
+		return 1;
+	}
+
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		if (image_new(&img, sizes[i][0], sizes[i][1])) {
+			fprintf(stderr, "Error: out of memory\n");
+			return 1;
+		}
+		failed += check_paths(enc, &img, argv[2], write);
+		failed += check_parallel(enc, &img);
+		failed += check_mask(enc, &img);
+		image_free(&img);
+
+		/* The YUV pictures share chroma between pixel pairs, they are made for even sizes */
+		if (sizes[i][0] % 2 == 0 && sizes[i][1] % 2 == 0)
+			failed += check_yuv(enc, sizes[i][0], sizes[i][1]);
+	}
+
+	jpeg_encoder_free(enc);
+
+	if (failed) {
+		fprintf(stderr, "%d checks failed\n", failed);
+		return 1;
+	}
+	printf("OK\n");
+
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include "libwebcam.h"
+#include "shm.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -49,6 +50,8 @@ typedef struct webcam_private {
 	unsigned char *buf; /* read buffer */
 	size_t img_len;
 	size_t bpl;
+
+	struct shm_ring *shm; /* frames are published here too */
 } priv_t;
 
 static int init_cam(webcam_t *cam, const char *devname);
@@ -132,6 +135,11 @@ char* webcam_name(int id)
 
 /* Try to open camera with number =num. Width and height is recomended values so you must look inside webcam_t for actual sizes. */
 webcam_t* webcam_open(int id, unsigned width, unsigned height)
+{
+	return webcam_open_format(id, width, height, WEBCAM_PIX_RGB24);
+}
+
+webcam_t* webcam_open_format(int id, unsigned width, unsigned height, webcam_pixel_format_t format)
 {
 	char namebuf[128];
 	struct stat st;
@@ -163,6 +171,7 @@ webcam_t* webcam_open(int id, unsigned width, unsigned height)
 
 	res->width = width;
 	res->height = height;
+	res->format = format;
 
 	priv = res->priv = calloc(1, sizeof(priv_t));
 	if (!priv) {
@@ -231,6 +240,7 @@ void webcam_close(webcam_t *cam)
 	v4l2_close(priv->fd);
 	priv->fd = -1;
 	free(cam->image);
+	shm_ring_free(priv->shm);
 
 	free(priv);
 	free(cam);
@@ -320,7 +330,6 @@ int webcam_wait_frame(webcam_t *cam, unsigned delay)
 /* Wait for next frame for maximum =delay ms (0 = forever) */
 int webcam_wait_frame_cb(webcam_t *cam, webcam_frame_cb cb, void *arg, unsigned delay)
 {
-	struct v4l2_buffer buf;
 	priv_t *priv;
 	fd_set fds;
 	struct timeval tv;
@@ -347,14 +356,48 @@ int webcam_wait_frame_cb(webcam_t *cam, webcam_frame_cb cb, void *arg, unsigned
 		return 0;
 	}
 
+	return webcam_try_frame(cam, cb, arg);
+}
+
+/* Descriptor to wait for frames on */
+int webcam_get_fd(webcam_t *cam)
+{
+	priv_t *priv;
+
+	if (!cam || !cam->priv) {
+		log("INVAL");
+		return -1;
+	}
+	priv = cam->priv;
+
+	return priv->fd;
+}
+
+/* Pass the next frame to =cb if it is ready, the device is opened non-blocking */
+int webcam_try_frame(webcam_t *cam, webcam_frame_cb cb, void *arg)
+{
+	struct v4l2_buffer buf;
+	priv_t *priv;
+	int rv;
+
+	if (!cam || !cam->priv) {
+		return -1;
+	}
+	priv = cam->priv;
+
 	/* Read frame: */
 	if (priv->io_method == IO_METHOD_READ) {
 		REINTR(rv, v4l2_read(priv->fd, priv->buf, priv->img_len));
+		if (rv < 0 && errno == EAGAIN) {
+			return 0;
+		}
 		if (rv < 0) {
 			log("read error");
 			return -1;
 		}
 
+		if (priv->shm)
+			shm_ring_write(priv->shm, priv->buf, rv);
 		cb(arg, cam, priv->buf, priv->bpl, rv);
 
 		return 1;
@@ -364,6 +407,9 @@ int webcam_wait_frame_cb(webcam_t *cam, webcam_frame_cb cb, void *arg, unsigned
 		buf.memory = V4L2_MEMORY_MMAP;
 
 		REINTR(rv, v4l2_ioctl(priv->fd, VIDIOC_DQBUF, &buf));
+		if (rv < 0 && errno == EAGAIN) {
+			return 0;
+		}
 		if (rv < 0) {
 			log("VIDIOC_DQBUF");
 			return -1;
@@ -383,6 +429,8 @@ int webcam_wait_frame_cb(webcam_t *cam, webcam_frame_cb cb, void *arg, unsigned
 		}
 #endif
 
+		if (priv->shm)
+			shm_ring_write(priv->shm, priv->buffers[buf.index].start, priv->buffers[buf.index].len);
 		cb(arg, cam, priv->buffers[buf.index].start, priv->bpl, priv->buffers[buf.index].len);
 
 		REINTR(rv, v4l2_ioctl(priv->fd, VIDIOC_QBUF, &buf));
@@ -396,6 +444,31 @@ int webcam_wait_frame_cb(webcam_t *cam, webcam_frame_cb cb, void *arg, unsigned
 	return -1; /* Not reached */
 }
 
+/* Publish frames to shared memory ring =name */
+int webcam_publish(webcam_t *cam, const char *name, unsigned slots)
+{
+	priv_t *priv;
+
+	if (!cam || !cam->priv) {
+		log("INVAL");
+		return -1;
+	}
+	priv = cam->priv;
+
+	shm_ring_free(priv->shm);
+	priv->shm = NULL;
+	if (!name)
+		return 0;
+
+	priv->shm = shm_ring_create(name, slots, cam, priv->bpl, priv->img_len);
+	if (!priv->shm) {
+		log("Can't publish frames to `%s' (%s)", name, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 /* Set control to camera. Value must be in interval [0-100] */
 static int id_conv(int id)
 {
@@ -447,6 +520,14 @@ int webcam_get_control(webcam_t *cam, webcam_controls_t id)
 	return (v * 25) / 16384;
 }
 
+/* V4L2 formats for webcam_pixel_format_t */
+static const __u32 pix_fourcc[] = {
+	V4L2_PIX_FMT_RGB24,
+	V4L2_PIX_FMT_YUYV,
+	V4L2_PIX_FMT_NV12,
+	V4L2_PIX_FMT_YUV420
+};
+
 static int init_mmap(webcam_t *cam);
 static int init_read(webcam_t *cam);
 static int init_cam(webcam_t *cam, const char *devname)
@@ -457,6 +538,7 @@ static int init_cam(webcam_t *cam, const char *devname)
 	struct v4l2_format fmt;
 	struct v4l2_fmtdesc fmtdesc;
         unsigned min;
+	int planar;
 	priv_t *priv = cam->priv;
 	int rv;
 	unsigned i;
@@ -515,28 +597,39 @@ static int init_cam(webcam_t *cam, const char *devname)
 		}
 	}
 
-	memset(&fmt, 0, sizeof(fmt));
+	for (;;) {
+		memset(&fmt, 0, sizeof(fmt));
 
-	/* Querry for video format: */
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width = cam->width;
-	fmt.fmt.pix.height = cam->height;
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24;
-	fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+		/* Querry for video format: */
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		fmt.fmt.pix.width = cam->width;
+		fmt.fmt.pix.height = cam->height;
+		fmt.fmt.pix.pixelformat = pix_fourcc[cam->format];
+		fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
 
-	REINTR(rv, v4l2_ioctl(priv->fd, VIDIOC_S_FMT, &fmt));
-	if (rv < 0) {
-		log("video format is not supported");
-		/* TODO: try another format??? */
-		return -1;
+		REINTR(rv, v4l2_ioctl(priv->fd, VIDIOC_S_FMT, &fmt));
+		if (rv == 0 && (cam->format == WEBCAM_PIX_RGB24 || fmt.fmt.pix.pixelformat == pix_fourcc[cam->format]))
+			break;
+
+		if (cam->format == WEBCAM_PIX_RGB24) {
+			log("video format is not supported");
+			return -1;
+		}
+
+		/* libv4l2 can always convert to RGB24 */
+		log("WARN: pixel format is not supported, using RGB24");
+		cam->format = WEBCAM_PIX_RGB24;
 	}
 
 	/* Next lines had taken from capture.c. It is dark magic so we must not change them :) */
 	/* Buggy driver paranoia. */
-	min = fmt.fmt.pix.width * 2;
+	planar = cam->format == WEBCAM_PIX_NV12 || cam->format == WEBCAM_PIX_YUV420;
+	min = fmt.fmt.pix.width * (planar ? 1 : 2);
 	if (fmt.fmt.pix.bytesperline < min)
 		fmt.fmt.pix.bytesperline = min;
 	min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+	if (planar)
+		min += min / 2;
 	if (fmt.fmt.pix.sizeimage < min)
 		fmt.fmt.pix.sizeimage = min;
 
@@ -659,12 +752,67 @@ static int init_read(webcam_t *cam)
 	return 0;
 }
 
+static unsigned char clamp8(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* BT.601 limited range YUV to RGB */
+static webcam_color_t yuv_to_rgb(int y, int u, int v)
+{
+	y = 298 * (y - 16) + 128;
+	u -= 128;
+	v -= 128;
+
+	return webcam_color_rgb(clamp8((y + 409 * v) >> 8),
+			clamp8((y - 100 * u - 208 * v) >> 8),
+			clamp8((y + 516 * u) >> 8));
+}
+
+static void process_yuv_image(webcam_t *cam, unsigned char *pixels, size_t bpl)
+{
+	size_t y, x;
+	const unsigned char *py, *pu, *pv;
+	size_t y_step = 1, c_step = 1;
+	size_t c_bpl = bpl;
+
+	for (y = 0; y < cam->height; y++) {
+		py = pixels + y * bpl;
+		switch (cam->format) {
+		case WEBCAM_PIX_YUYV:
+			y_step = 2;
+			c_step = 4;
+			pu = py + 1;
+			pv = py + 3;
+			break;
+		case WEBCAM_PIX_NV12:
+			c_step = 2;
+			pu = pixels + cam->height * bpl + (y / 2) * bpl;
+			pv = pu + 1;
+			break;
+		default:
+			c_bpl = bpl / 2;
+			pu = pixels + cam->height * bpl + (y / 2) * c_bpl;
+			pv = pu + c_bpl * ((cam->height + 1) / 2);
+			break;
+		}
+
+		for (x = 0; x < cam->width; x++)
+			cam->image[y * cam->width + x] = yuv_to_rgb(py[x * y_step], pu[(x / 2) * c_step], pv[(x / 2) * c_step]);
+	}
+}
+
 static void process_image(void *ctx, webcam_t *cam, unsigned char *pixels, size_t bpl, size_t img_len)
 {
 	size_t y, x;
 	size_t off;
 	size_t c_off;
 
+	if (cam->format != WEBCAM_PIX_RGB24) {
+		process_yuv_image(cam, pixels, bpl);
+		return;
+	}
+
 	for (y = 0; y < cam->height; y++) {
 		off = bpl * y;
 		c_off = y * cam->width;
@@ -0,0 +1,292 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "history.h"
+
+/* History of encoded frames in a shared file mapping.
+ * Frames are copied to the mapping as they come and the page cache writes them back, so the
+ * history takes no heap and the frames of the last run are there after a restart.
+ * A frame is stored in one piece, one not fitting before the end of the ring starts over at
+ * the beginning. Readers copy frames without the lock and check the writer didn't get to them
+ * meanwhile. Frames pushed by capture are only queued, a thread of the history copies them so
+ * page faults on the mapping don't hold up the caller. */
+
+#define HISTORY_PAGE 4096
+/* Clock steps back up to this many microseconds are taken as jitter, the frames get the time of
+ * the newest one. After a longer step the stored frames can't be ordered with new ones and are
+ * dropped, the index must stay sorted by time for lookups. */
+#define HISTORY_STEP_BACK 1000000
+#define ROUND_PAGE(x) (((x) + HISTORY_PAGE - 1) & ~(size_t)(HISTORY_PAGE - 1))
+
+/* A file of an earlier run is used when its header agrees with itself */
+static int history_valid(struct history *hist, unsigned slots, size_t data_size)
+{
+	struct history_header *hdr = hist->hdr;
+	struct history_entry *last;
+
+	if (memcmp(hdr->magic, HISTORY_MAGIC, sizeof(hdr->magic)) || hdr->slots != slots || hdr->data_size != data_size)
+		return 0;
+	if (hdr->oldest > hdr->next || hdr->next - hdr->oldest > slots)
+		return 0;
+	if (hdr->oldest == hdr->next)
+		return 1;
+
+	last = &hist->index[(hdr->next - 1) % slots];
+	return last->size <= data_size && last->pos + last->size <= hdr->head;
+}
+
+static int history_thread(void *arg)
+{
+	struct history *hist = arg;
+	struct history_frame frame;
+
+	mtx_lock(&hist->queue_lock);
+	for (;;) {
+		while (!hist->count && !hist->stop)
+			cnd_wait(&hist->more, &hist->queue_lock);
+		if (!hist->count)
+			break;
+
+		frame = hist->queue[hist->head];
+		hist->head = (hist->head + 1) % HISTORY_QUEUE;
+		hist->count--;
+		mtx_unlock(&hist->queue_lock);
+
+		history_add(hist, http_buffer_data(frame.buf), http_buffer_size(frame.buf), &frame.time);
+		http_buffer_release(frame.buf);
+
+		mtx_lock(&hist->queue_lock);
+	}
+	mtx_unlock(&hist->queue_lock);
+
+	return 0;
+}
+
+struct history* history_open(const char *path, size_t size)
+{
+	struct history *hist;
+	struct stat st;
+	size_t data_size = ROUND_PAGE(size < 16 * HISTORY_PAGE ? 16 * HISTORY_PAGE : size);
+	unsigned slots = data_size / HISTORY_SLOT_BYTES;
+	size_t index_size = ROUND_PAGE(slots * sizeof(struct history_entry));
+
+	hist = calloc(1, sizeof(struct history));
+	if (!hist)
+		return NULL;
+
+	hist->map_size = HISTORY_PAGE + index_size + data_size;
+	hist->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (hist->fd < 0) {
+		fprintf(stderr, "Error: can't open history `%s'\n", path);
+		free(hist);
+		return NULL;
+	}
+
+	/* A file of another size is started over */
+	if (fstat(hist->fd, &st) || (size_t)st.st_size != hist->map_size) {
+		if (ftruncate(hist->fd, 0) || ftruncate(hist->fd, hist->map_size)) {
+			fprintf(stderr, "Error: can't resize history `%s'\n", path);
+			close(hist->fd);
+			free(hist);
+			return NULL;
+		}
+	}
+
+	hist->map = mmap(NULL, hist->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, hist->fd, 0);
+	if (hist->map == MAP_FAILED) {
+		fprintf(stderr, "Error: can't map history `%s'\n", path);
+		close(hist->fd);
+		free(hist);
+		return NULL;
+	}
+	hist->hdr = (struct history_header*)hist->map;
+	hist->index = (struct history_entry*)(hist->map + HISTORY_PAGE);
+	hist->data = hist->map + HISTORY_PAGE + index_size;
+
+	if (!history_valid(hist, slots, data_size)) {
+		memset(hist->hdr, 0, sizeof(struct history_header));
+		memcpy(hist->hdr->magic, HISTORY_MAGIC, sizeof(hist->hdr->magic));
+		hist->hdr->slots = slots;
+		hist->hdr->data_size = data_size;
+	}
+	hist->reserved = hist->hdr->head;
+
+	mtx_init(&hist->lock, mtx_plain);
+	mtx_init(&hist->queue_lock, mtx_plain);
+	cnd_init(&hist->more);
+	if (thrd_create(&hist->thread, history_thread, hist) != thrd_success) {
+		fprintf(stderr, "Error: can't start history thread\n");
+		cnd_destroy(&hist->more);
+		mtx_destroy(&hist->queue_lock);
+		mtx_destroy(&hist->lock);
+		munmap(hist->map, hist->map_size);
+		close(hist->fd);
+		free(hist);
+		return NULL;
+	}
+
+	return hist;
+}
+
+void history_close(struct history *hist)
+{
+	if (!hist)
+		return;
+
+	mtx_lock(&hist->queue_lock);
+	hist->stop = 1;
+	cnd_signal(&hist->more);
+	mtx_unlock(&hist->queue_lock);
+	thrd_join(hist->thread, NULL);
+	cnd_destroy(&hist->more);
+	mtx_destroy(&hist->queue_lock);
+
+	msync(hist->map, hist->map_size, MS_SYNC);
+	munmap(hist->map, hist->map_size);
+	close(hist->fd);
+	mtx_destroy(&hist->lock);
+	free(hist);
+}
+
+int history_add(struct history *hist, const void *frame, size_t len, const struct timeval *time)
+{
+	struct history_header *hdr = hist->hdr;
+	struct history_entry *entry;
+	int64_t stamp = (int64_t)time->tv_sec * 1000000 + time->tv_usec;
+	int64_t newest;
+	uint64_t pos, end;
+
+	if (!len || len > hdr->data_size)
+		return -1;
+
+	mtx_lock(&hist->lock);
+	if (hdr->oldest < hdr->next) {
+		newest = hist->index[(hdr->next - 1) % hdr->slots].time;
+		if (stamp < newest - HISTORY_STEP_BACK)
+			hdr->oldest = hdr->next;
+		else if (stamp < newest)
+			stamp = newest;
+	}
+
+	pos = hdr->head;
+	if (pos % hdr->data_size + len > hdr->data_size)
+		pos += hdr->data_size - pos % hdr->data_size;
+	end = pos + len;
+
+	/* Drop the frames the new one overwrites, readers still copying them will notice */
+	while (hdr->oldest < hdr->next &&
+	       (hdr->next - hdr->oldest >= hdr->slots || hist->index[hdr->oldest % hdr->slots].pos + hdr->data_size < end))
+		hdr->oldest++;
+	hist->reserved = end;
+	mtx_unlock(&hist->lock);
+
+	memcpy(hist->data + pos % hdr->data_size, frame, len);
+
+	mtx_lock(&hist->lock);
+	entry = &hist->index[hdr->next % hdr->slots];
+	entry->time = stamp;
+	entry->pos = pos;
+	entry->size = len;
+	hdr->head = end;
+	hdr->next++;
+	mtx_unlock(&hist->lock);
+
+	return 0;
+}
+
+int history_push(struct history *hist, http_buffer_t *frame, const struct timeval *time)
+{
+	struct history_frame *f;
+	int rv = 0;
+
+	mtx_lock(&hist->queue_lock);
+	if (hist->count == HISTORY_QUEUE) {
+		rv = -1;
+	} else {
+		f = &hist->queue[(hist->head + hist->count) % HISTORY_QUEUE];
+		f->buf = http_buffer_ref(frame);
+		f->time = *time;
+		hist->count++;
+		cnd_signal(&hist->more);
+	}
+	mtx_unlock(&hist->queue_lock);
+
+	return rv;
+}
+
+/* Number of the first frame taken after time, under the lock */
+static uint64_t history_after(struct history *hist, int64_t time)
+{
+	uint64_t lo = hist->hdr->oldest, hi = hist->hdr->next, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (hist->index[mid % hist->hdr->slots].time > time)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+http_buffer_t* history_get(struct history *hist, int64_t time, int64_t *frame_time)
+{
+	struct history_entry entry;
+	http_buffer_t *frame;
+	uint64_t n;
+	int overwritten;
+
+	mtx_lock(&hist->lock);
+	n = history_after(hist, time);
+	if (n == hist->hdr->oldest) {
+		mtx_unlock(&hist->lock);
+		return NULL;
+	}
+	entry = hist->index[(n - 1) % hist->hdr->slots];
+	mtx_unlock(&hist->lock);
+
+	/* Copied rather than sent from the mapping: a send can take seconds and the writer never
+	 * waits for readers, so only a copy checked afterwards can't go out torn */
+	frame = http_buffer_new(hist->data + entry.pos % hist->hdr->data_size, entry.size);
+	if (!frame)
+		return NULL;
+
+	mtx_lock(&hist->lock);
+	overwritten = entry.pos + hist->hdr->data_size < hist->reserved;
+	mtx_unlock(&hist->lock);
+	if (overwritten) {
+		http_buffer_release(frame);
+		return NULL;
+	}
+
+	if (frame_time)
+		*frame_time = entry.time;
+
+	return frame;
+}
+
+unsigned history_range(struct history *hist, int64_t from, int64_t to, int64_t *times, uint32_t *sizes, unsigned max)
+{
+	struct history_entry *entry;
+	unsigned cnt = 0;
+	uint64_t n;
+
+	mtx_lock(&hist->lock);
+	for (n = history_after(hist, from - 1); n < hist->hdr->next && cnt < max; n++) {
+		entry = &hist->index[n % hist->hdr->slots];
+		if (entry->time > to)
+			break;
+		times[cnt] = entry->time;
+		sizes[cnt] = entry->size;
+		cnt++;
+	}
+	mtx_unlock(&hist->lock);
+
+	return cnt;
+}
@@ -0,0 +1,92 @@
+#ifndef HISTORY_H_INC
+#define HISTORY_H_INC
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "c11threads.h"
+#include "web/http.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* } */
+
+#define HISTORY_MAGIC "WWWCAMH1"
+/* Bytes of frame data per index slot, frames are expected to be larger */
+#define HISTORY_SLOT_BYTES 4096
+/* Frames waiting to be copied to the ring, more are dropped */
+#define HISTORY_QUEUE 8
+
+/* First page of the file, followed by the index and the frame data */
+struct history_header {
+	char magic[8];
+	uint32_t slots;      /* index entries */
+	uint32_t pad;
+	uint64_t data_size;  /* bytes of frame data */
+	uint64_t head;       /* data position of the next frame, data positions only grow */
+	uint64_t oldest;     /* number of the oldest frame still stored */
+	uint64_t next;       /* number of the next frame */
+};
+
+/* Frame n is in index slot n % slots, its data at position pos % data_size */
+struct history_entry {
+	int64_t time;        /* microseconds since the epoch */
+	uint64_t pos;
+	uint32_t size;
+	uint32_t pad;
+};
+
+struct history_frame {
+	http_buffer_t *buf;
+	struct timeval time;
+};
+
+/* Ring of the last encoded frames in a file mapping, it is kept across restarts */
+struct history {
+	int fd;
+	unsigned char *map;
+	size_t map_size;
+	struct history_header *hdr;
+	struct history_entry *index;
+	unsigned char *data;
+
+	mtx_t lock;
+	uint64_t reserved; /* data before this position may be overwritten by the frame being added */
+
+	/* Frames from history_push(), a thread of its own copies them */
+	mtx_t queue_lock;
+	cnd_t more;
+	struct history_frame queue[HISTORY_QUEUE];
+	unsigned head;
+	unsigned count;
+	int stop;
+	thrd_t thread;
+};
+
+/* Opens the ring file at path holding size bytes of frames, frames of an earlier run with the same size are kept */
+struct history* history_open(const char *path, size_t size);
+/* Copies the queued frames and closes the file */
+void history_close(struct history *hist);
+
+/* Queues an encoded frame taken at *time, it is referenced and copied to the ring by the history's
+ * thread. Never waits for the copy.
+ * RETURNS 0 when queued, -1 when dropped */
+int history_push(struct history *hist, http_buffer_t *frame, const struct timeval *time);
+
+/* Copies an encoded frame taken at *time to the ring, dropping the oldest ones to make room.
+ * Times a little before the newest frame's are clamped to it, a longer step back drops the stored frames. */
+int history_add(struct history *hist, const void *frame, size_t len, const struct timeval *time);
+
+/* The frame taken at or before time and its time, NULL when it isn't stored (anymore).
+ * The frame is copied from the mapping into a new buffer. */
+http_buffer_t* history_get(struct history *hist, int64_t time, int64_t *frame_time);
+
+/* Fills times and sizes with up to max frames taken between from and to, returns how many */
+unsigned history_range(struct history *hist, int64_t from, int64_t to, int64_t *times, uint32_t *sizes, unsigned max);
+
+/* extern "C" { */
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -43,7 +43,7 @@ int jpeg_params_check(const struct jpeg_params *params)
 
 // Various JPEG enums and tables.
 enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS =
-	    0xDA, M_DQT = 0xDB, M_APP0 = 0xE0
+	    0xDA, M_DQT = 0xDB, M_APP0 = 0xE0, M_RST0 = 0xD0, M_DRI = 0xDD
 };
 
 enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES =
@@ -217,6 +217,29 @@ static void Y_to_YCC(uint8 * pDst, const uint8 * pSrc, int num_pixels)
 	}
 }
 
+// YCbCr sources with one chroma sample per two pixels (4:2:2 and 4:2:0), the chroma is simply repeated
+// and subsampled later by load_block_*(). Luma of pixel i is pY[i * y_step], chroma is pCb/pCr[(i / 2) * c_step].
+// lut[0] and lut[1] map luma and chroma samples to the full range JFIF expects.
+static void YUV_to_YCC(uint8 * pDst, const uint8 * pY, const uint8 * pCb,
+		       const uint8 * pCr, int y_step, int c_step,
+		       int num_pixels, const uint8(*lut)[256])
+{
+	int i;
+
+	for (i = 0; i < num_pixels; i++, pDst += 3) {
+		pDst[0] = lut[0][pY[i * y_step]];
+		pDst[1] = lut[1][pCb[(i >> 1) * c_step]];
+		pDst[2] = lut[1][pCr[(i >> 1) * c_step]];
+	}
+}
+
+static void YUV_to_Y(uint8 * pDst, const uint8 * pY, int y_step,
+		     int num_pixels, const uint8 * lut)
+{
+	for (; num_pixels; pDst++, pY += y_step, num_pixels--)
+		pDst[0] = lut[pY[0]];
+}
+
 // Forward DCT - DCT derived from jfdctint.
 enum { CONST_BITS = 13, ROW_BITS = 2 };
 
@@ -272,6 +295,424 @@ static void DCT2D(int32 * p)
 	}
 }
 
+// SIMD colour conversion, forward DCT and quantization.
+// The DCT works on 8 (AVX2) or 4 (SSE2, NEON) rows/columns at once: the block is transposed, a row pass is run,
+// transposed back and a column pass is run. DCT_MUL()'s truncation to int16 is reproduced exactly, so the output
+// is bit-identical to DCT2D(). Quantization multiplies by a float reciprocal of the quantizer, which is exact
+// for all coefficient magnitudes the DCT can produce (checked exhaustively below 2^19).
+#if defined(JPGE_NO_SIMD)
+#elif defined(__SSE2__)
+#define JPGE_SSE2 1
+#if defined(__GNUC__)
+// SSSE3 and AVX2 code is compiled with a target attribute and only used if the CPU reports support for it.
+// JPGE_NO_AVX2 keeps the SSE2 DCT, so it can be checked on CPUs with AVX2.
+#define JPGE_SSSE3 1
+#if !defined(JPGE_NO_AVX2)
+#define JPGE_AVX2 1
+#endif
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define JPGE_NEON 1
+#endif
+
+#define DCT1D_V(T, ADD, SUB, MUL, s0, s1, s2, s3, s4, s5, s6, s7) \
+	do { \
+	T t0 = ADD(s0, s7), t7 = SUB(s0, s7), t1 = ADD(s1, s6), t6 = SUB(s1, s6), t2 = ADD(s2, s5), t5 = SUB(s2, s5), t3 = ADD(s3, s4), t4 = SUB(s3, s4); \
+	T t10 = ADD(t0, t3), t13 = SUB(t0, t3), t11 = ADD(t1, t2), t12 = SUB(t1, t2); \
+	T u1 = MUL(ADD(t12, t13), 4433), u2, u3, u4, z5; \
+	s2 = ADD(u1, MUL(t13, 6270)); \
+	s6 = ADD(u1, MUL(t12, -15137)); \
+	u1 = ADD(t4, t7); u2 = ADD(t5, t6); u3 = ADD(t4, t6); u4 = ADD(t5, t7); \
+	z5 = MUL(ADD(u3, u4), 9633); \
+	t4 = MUL(t4, 2446); t5 = MUL(t5, 16819); \
+	t6 = MUL(t6, 25172); t7 = MUL(t7, 12299); \
+	u1 = MUL(u1, -7373); u2 = MUL(u2, -20995); \
+	u3 = ADD(MUL(u3, -16069), z5); u4 = ADD(MUL(u4, -3196), z5); \
+	s0 = ADD(t10, t11); s1 = ADD(ADD(t7, u1), u4); s3 = ADD(ADD(t6, u2), u3); s4 = SUB(t10, t11); s5 = ADD(ADD(t5, u2), u4); s7 = ADD(ADD(t4, u1), u3); \
+	} while (0)
+
+// Row pass outputs (v[0..7] hold coefficient k of each row) and column pass outputs.
+#define DCT_ROW_SCALE_V(SHL, DESCALE, v) \
+	do { \
+	v[0] = SHL(v[0], ROW_BITS); v[4] = SHL(v[4], ROW_BITS); \
+	v[1] = DESCALE(v[1], CONST_BITS - ROW_BITS); v[2] = DESCALE(v[2], CONST_BITS - ROW_BITS); \
+	v[3] = DESCALE(v[3], CONST_BITS - ROW_BITS); v[5] = DESCALE(v[5], CONST_BITS - ROW_BITS); \
+	v[6] = DESCALE(v[6], CONST_BITS - ROW_BITS); v[7] = DESCALE(v[7], CONST_BITS - ROW_BITS); \
+	} while (0)
+#define DCT_COL_SCALE_V(DESCALE, v) \
+	do { \
+	v[0] = DESCALE(v[0], ROW_BITS + 3); v[4] = DESCALE(v[4], ROW_BITS + 3); \
+	v[1] = DESCALE(v[1], CONST_BITS + ROW_BITS + 3); v[2] = DESCALE(v[2], CONST_BITS + ROW_BITS + 3); \
+	v[3] = DESCALE(v[3], CONST_BITS + ROW_BITS + 3); v[5] = DESCALE(v[5], CONST_BITS + ROW_BITS + 3); \
+	v[6] = DESCALE(v[6], CONST_BITS + ROW_BITS + 3); v[7] = DESCALE(v[7], CONST_BITS + ROW_BITS + 3); \
+	} while (0)
+
+#ifdef JPGE_SSE2
+#include <emmintrin.h>
+
+// madd_epi16 with (c, 0) pairs multiplies the low 16 bits of each lane by c, which is exactly DCT_MUL().
+#define SSE2_MUL(v, c) _mm_madd_epi16((v), _mm_set1_epi32((c) & 0xFFFF))
+#define SSE2_DESCALE(v, n) _mm_srai_epi32(_mm_add_epi32((v), _mm_set1_epi32(1 << ((n) - 1))), (n))
+
+#define SSE2_TRANSPOSE4(a, b, c, d) \
+	do { \
+	__m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d); \
+	__m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d); \
+	a = _mm_unpacklo_epi64(t0, t1); b = _mm_unpackhi_epi64(t0, t1); \
+	c = _mm_unpacklo_epi64(t2, t3); d = _mm_unpackhi_epi64(t2, t3); \
+	} while (0)
+
+// l[i]/h[i] are the left/right halves of row i.
+static inline void sse2_transpose8(__m128i * l, __m128i * h)
+{
+	int i;
+
+	SSE2_TRANSPOSE4(l[0], l[1], l[2], l[3]);
+	SSE2_TRANSPOSE4(l[4], l[5], l[6], l[7]);
+	SSE2_TRANSPOSE4(h[0], h[1], h[2], h[3]);
+	SSE2_TRANSPOSE4(h[4], h[5], h[6], h[7]);
+	for (i = 0; i < 4; i++) {
+		__m128i t = l[i + 4];
+
+		l[i + 4] = h[i];
+		h[i] = t;
+	}
+}
+
+static void DCT2D_sse2(int32 * p)
+{
+	__m128i l[8], h[8];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		l[i] = _mm_loadu_si128((const __m128i *)(p + i * 8));
+		h[i] = _mm_loadu_si128((const __m128i *)(p + i * 8 + 4));
+	}
+	sse2_transpose8(l, h);
+	DCT1D_V(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL, l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+	DCT1D_V(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL, h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+	DCT_ROW_SCALE_V(_mm_slli_epi32, SSE2_DESCALE, l);
+	DCT_ROW_SCALE_V(_mm_slli_epi32, SSE2_DESCALE, h);
+	sse2_transpose8(l, h);
+	DCT1D_V(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL, l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+	DCT1D_V(__m128i, _mm_add_epi32, _mm_sub_epi32, SSE2_MUL, h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+	DCT_COL_SCALE_V(SSE2_DESCALE, l);
+	DCT_COL_SCALE_V(SSE2_DESCALE, h);
+	for (i = 0; i < 8; i++) {
+		_mm_storeu_si128((__m128i *) (p + i * 8), l[i]);
+		_mm_storeu_si128((__m128i *) (p + i * 8 + 4), h[i]);
+	}
+}
+
+static void quantize_sse2(int16 * pDst, const int32 * pSrc, const int32 * pRound, const float *pRecip)
+{
+	int i;
+
+	for (i = 0; i < 64; i += 8) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *)(pSrc + i));
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(pSrc + i + 4));
+		__m128i s0 = _mm_srai_epi32(x0, 31), s1 = _mm_srai_epi32(x1, 31);
+		// |x| + q / 2, then truncating multiply by 1 / q and restore the sign.
+		__m128i a0 = _mm_add_epi32(_mm_sub_epi32(_mm_xor_si128(x0, s0), s0), _mm_loadu_si128((const __m128i *)(pRound + i)));
+		__m128i a1 = _mm_add_epi32(_mm_sub_epi32(_mm_xor_si128(x1, s1), s1), _mm_loadu_si128((const __m128i *)(pRound + i + 4)));
+		a0 = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(a0), _mm_loadu_ps(pRecip + i)));
+		a1 = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(a1), _mm_loadu_ps(pRecip + i + 4)));
+		a0 = _mm_sub_epi32(_mm_xor_si128(a0, s0), s0);
+		a1 = _mm_sub_epi32(_mm_xor_si128(a1, s1), s1);
+		_mm_storeu_si128((__m128i *) (pDst + i), _mm_packs_epi32(a0, a1));
+	}
+}
+#endif
+
+#ifdef JPGE_SSSE3
+#include <immintrin.h>
+
+// pshufb masks gathering R, G and B of 16 pixels from three 16 byte loads, and scattering Y, Cb and Cr back.
+static const uint8 s_rgb_gather[3][3][16] = {
+	{{0, 3, 6, 9, 12, 15, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80}, {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 2, 5, 8, 11, 14, 0x80, 0x80, 0x80, 0x80, 0x80}, {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 1, 4, 7, 10, 13}},
+	{{1, 4, 7, 10, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80}, {0x80, 0x80, 0x80, 0x80, 0x80, 0, 3, 6, 9, 12, 15, 0x80, 0x80, 0x80, 0x80, 0x80}, {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 2, 5, 8, 11, 14}},
+	{{2, 5, 8, 11, 14, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80}, {0x80, 0x80, 0x80, 0x80, 0x80, 1, 4, 7, 10, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80}, {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0, 3, 6, 9, 12, 15}}
+};
+
+static const uint8 s_ycc_scatter[3][3][16] = {
+	{{0, 0x80, 0x80, 1, 0x80, 0x80, 2, 0x80, 0x80, 3, 0x80, 0x80, 4, 0x80, 0x80, 5}, {0x80, 0, 0x80, 0x80, 1, 0x80, 0x80, 2, 0x80, 0x80, 3, 0x80, 0x80, 4, 0x80, 0x80}, {0x80, 0x80, 0, 0x80, 0x80, 1, 0x80, 0x80, 2, 0x80, 0x80, 3, 0x80, 0x80, 4, 0x80}},
+	{{0x80, 0x80, 6, 0x80, 0x80, 7, 0x80, 0x80, 8, 0x80, 0x80, 9, 0x80, 0x80, 10, 0x80}, {5, 0x80, 0x80, 6, 0x80, 0x80, 7, 0x80, 0x80, 8, 0x80, 0x80, 9, 0x80, 0x80, 10}, {0x80, 5, 0x80, 0x80, 6, 0x80, 0x80, 7, 0x80, 0x80, 8, 0x80, 0x80, 9, 0x80, 0x80}},
+	{{0x80, 11, 0x80, 0x80, 12, 0x80, 0x80, 13, 0x80, 0x80, 14, 0x80, 0x80, 15, 0x80, 0x80}, {0x80, 0x80, 11, 0x80, 0x80, 12, 0x80, 0x80, 13, 0x80, 0x80, 14, 0x80, 0x80, 15, 0x80}, {10, 0x80, 0x80, 11, 0x80, 0x80, 12, 0x80, 0x80, 13, 0x80, 0x80, 14, 0x80, 0x80, 15}}
+};
+
+#define SSSE3_MASK(t, i, j) _mm_loadu_si128((const __m128i *)(t)[i][j])
+// Two int16 multipliers for _mm_madd_epi16().
+#define SSE2_PAIR(a, b) _mm_set1_epi32((int)(((unsigned)(a) & 0xFFFF) | ((unsigned)(b) << 16)))
+
+// Converts 4 pixels held as 32-bit lanes. YG and CB_B/CR_R don't fit in int16, so the G term of Y is split into
+// G * (YG - 65536) + (G << 16) and the 32768 terms are done with shifts. The results match RGB_to_YCC() exactly.
+__attribute__ ((target("ssse3")))
+static inline void ssse3_ycc4(__m128i r, __m128i g, __m128i b, __m128i * y, __m128i * cb, __m128i * cr)
+{
+	const __m128i rg = _mm_or_si128(r, _mm_slli_epi32(g, 16));
+	const __m128i gb = _mm_or_si128(g, _mm_slli_epi32(b, 16));
+	const __m128i chroma_bias = _mm_set1_epi32((128 << 16) + 32768);
+
+	*y = _mm_madd_epi16(rg, SSE2_PAIR(YR, YG - 65536));
+	*y = _mm_add_epi32(*y, _mm_madd_epi16(b, _mm_set1_epi32(YB)));
+	*y = _mm_add_epi32(*y, _mm_add_epi32(_mm_slli_epi32(g, 16), _mm_set1_epi32(32768)));
+	*y = _mm_srli_epi32(*y, 16);
+	*cb = _mm_madd_epi16(rg, SSE2_PAIR(CB_R, CB_G));
+	*cb = _mm_add_epi32(*cb, _mm_add_epi32(_mm_slli_epi32(b, 15), chroma_bias));
+	*cb = _mm_srai_epi32(*cb, 16);
+	*cr = _mm_madd_epi16(gb, SSE2_PAIR(CR_G, CR_B));
+	*cr = _mm_add_epi32(*cr, _mm_add_epi32(_mm_slli_epi32(r, 15), chroma_bias));
+	*cr = _mm_srai_epi32(*cr, 16);
+}
+
+// Converts 8 pixels held as 16-bit lanes, returns Y, Cb and Cr as 16-bit lanes clamped to 0..255.
+__attribute__ ((target("ssse3")))
+static inline void ssse3_ycc8(__m128i r, __m128i g, __m128i b, __m128i * y, __m128i * cb, __m128i * cr)
+{
+	const __m128i z = _mm_setzero_si128();
+	__m128i y0, y1, cb0, cb1, cr0, cr1;
+
+	ssse3_ycc4(_mm_unpacklo_epi16(r, z), _mm_unpacklo_epi16(g, z), _mm_unpacklo_epi16(b, z), &y0, &cb0, &cr0);
+	ssse3_ycc4(_mm_unpackhi_epi16(r, z), _mm_unpackhi_epi16(g, z), _mm_unpackhi_epi16(b, z), &y1, &cb1, &cr1);
+	*y = _mm_packs_epi32(y0, y1);
+	*cb = _mm_packs_epi32(cb0, cb1);
+	*cr = _mm_packs_epi32(cr0, cr1);
+}
+
+__attribute__ ((target("ssse3")))
+static void RGB_to_YCC_ssse3(uint8 * pDst, const uint8 * pSrc, int num_pixels)
+{
+	const __m128i z = _mm_setzero_si128();
+
+	for (; num_pixels >= 16; pDst += 48, pSrc += 48, num_pixels -= 16) {
+		__m128i v[3], c[3], y0, y1, cb0, cb1, cr0, cr1;
+		int i;
+
+		v[0] = _mm_loadu_si128((const __m128i *)pSrc);
+		v[1] = _mm_loadu_si128((const __m128i *)(pSrc + 16));
+		v[2] = _mm_loadu_si128((const __m128i *)(pSrc + 32));
+		for (i = 0; i < 3; i++)
+			c[i] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v[0], SSSE3_MASK(s_rgb_gather, i, 0)),
+							 _mm_shuffle_epi8(v[1], SSSE3_MASK(s_rgb_gather, i, 1))),
+					    _mm_shuffle_epi8(v[2], SSSE3_MASK(s_rgb_gather, i, 2)));
+		ssse3_ycc8(_mm_unpacklo_epi8(c[0], z), _mm_unpacklo_epi8(c[1], z), _mm_unpacklo_epi8(c[2], z), &y0, &cb0, &cr0);
+		ssse3_ycc8(_mm_unpackhi_epi8(c[0], z), _mm_unpackhi_epi8(c[1], z), _mm_unpackhi_epi8(c[2], z), &y1, &cb1, &cr1);
+		c[0] = _mm_packus_epi16(y0, y1);
+		c[1] = _mm_packus_epi16(cb0, cb1);
+		c[2] = _mm_packus_epi16(cr0, cr1);
+		for (i = 0; i < 3; i++)
+			_mm_storeu_si128((__m128i *) (pDst + i * 16),
+					 _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c[0], SSSE3_MASK(s_ycc_scatter, i, 0)),
+								   _mm_shuffle_epi8(c[1], SSSE3_MASK(s_ycc_scatter, i, 1))),
+						      _mm_shuffle_epi8(c[2], SSSE3_MASK(s_ycc_scatter, i, 2))));
+	}
+	RGB_to_YCC(pDst, pSrc, num_pixels);
+}
+#endif
+
+#ifdef JPGE_AVX2
+#include <immintrin.h>
+
+#define AVX2_MUL(v, c) _mm256_madd_epi16((v), _mm256_set1_epi32((c) & 0xFFFF))
+#define AVX2_DESCALE(v, n) _mm256_srai_epi32(_mm256_add_epi32((v), _mm256_set1_epi32(1 << ((n) - 1))), (n))
+
+__attribute__ ((target("avx2")))
+static inline void avx2_transpose8(__m256i * r)
+{
+	__m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]), t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]), t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]), t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+__attribute__ ((target("avx2")))
+static void DCT2D_avx2(int32 * p)
+{
+	__m256i r[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = _mm256_loadu_si256((const __m256i *)(p + i * 8));
+	avx2_transpose8(r);
+	DCT1D_V(__m256i, _mm256_add_epi32, _mm256_sub_epi32, AVX2_MUL, r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+	DCT_ROW_SCALE_V(_mm256_slli_epi32, AVX2_DESCALE, r);
+	avx2_transpose8(r);
+	DCT1D_V(__m256i, _mm256_add_epi32, _mm256_sub_epi32, AVX2_MUL, r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+	DCT_COL_SCALE_V(AVX2_DESCALE, r);
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *) (p + i * 8), r[i]);
+}
+
+__attribute__ ((target("avx2")))
+static void quantize_avx2(int16 * pDst, const int32 * pSrc, const int32 * pRound, const float *pRecip)
+{
+	int i;
+
+	for (i = 0; i < 64; i += 16) {
+		__m256i x0 = _mm256_loadu_si256((const __m256i *)(pSrc + i));
+		__m256i x1 = _mm256_loadu_si256((const __m256i *)(pSrc + i + 8));
+		__m256i a0 = _mm256_add_epi32(_mm256_abs_epi32(x0), _mm256_loadu_si256((const __m256i *)(pRound + i)));
+		__m256i a1 = _mm256_add_epi32(_mm256_abs_epi32(x1), _mm256_loadu_si256((const __m256i *)(pRound + i + 8)));
+
+		a0 = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(a0), _mm256_loadu_ps(pRecip + i)));
+		a1 = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(a1), _mm256_loadu_ps(pRecip + i + 8)));
+		a0 = _mm256_sign_epi32(a0, x0);
+		a1 = _mm256_sign_epi32(a1, x1);
+		// packs works within 128-bit lanes, restore the order afterwards.
+		_mm256_storeu_si256((__m256i *) (pDst + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(a0, a1), 0xD8));
+	}
+}
+#endif
+
+#ifdef JPGE_NEON
+#include <arm_neon.h>
+
+// Y = (R * YR + G * YG + B * YB + 32768) >> 16, unsigned since all terms are positive.
+static inline uint16x4_t neon_luma(uint16x4_t r, uint16x4_t g, uint16x4_t b)
+{
+	uint32x4_t x = vmlal_n_u16(vmlal_n_u16(vmull_n_u16(r, YR), g, YG), b, YB);
+
+	return vshrn_n_u32(vaddq_u32(x, vdupq_n_u32(32768)), 16);
+}
+
+// 128 + ((A * ca + B * cb + C * 32768 + 32768) >> 16), clamped at 0.
+static inline uint16x4_t neon_chroma(int16x4_t a, int16x4_t b, int16x4_t c, int16 ca, int16 cb)
+{
+	int32x4_t x = vmlal_n_s16(vmull_n_s16(a, ca), b, cb);
+
+	x = vaddq_s32(vaddq_s32(x, vshll_n_s16(c, 15)), vdupq_n_s32((128 << 16) + 32768));
+	return vqmovun_s32(vshrq_n_s32(x, 16));
+}
+
+static void RGB_to_YCC_neon(uint8 * pDst, const uint8 * pSrc, int num_pixels)
+{
+	for (; num_pixels >= 8; pDst += 24, pSrc += 24, num_pixels -= 8) {
+		uint8x8x3_t rgb = vld3_u8(pSrc), ycc;
+		uint16x8_t r = vmovl_u8(rgb.val[0]), g = vmovl_u8(rgb.val[1]), b = vmovl_u8(rgb.val[2]);
+		int16x8_t sr = vreinterpretq_s16_u16(r), sg = vreinterpretq_s16_u16(g), sb = vreinterpretq_s16_u16(b);
+
+		ycc.val[0] = vmovn_u16(vcombine_u16(neon_luma(vget_low_u16(r), vget_low_u16(g), vget_low_u16(b)),
+						    neon_luma(vget_high_u16(r), vget_high_u16(g), vget_high_u16(b))));
+		ycc.val[1] = vqmovn_u16(vcombine_u16(neon_chroma(vget_low_s16(sr), vget_low_s16(sg), vget_low_s16(sb), CB_R, CB_G),
+						     neon_chroma(vget_high_s16(sr), vget_high_s16(sg), vget_high_s16(sb), CB_R, CB_G)));
+		ycc.val[2] = vqmovn_u16(vcombine_u16(neon_chroma(vget_low_s16(sg), vget_low_s16(sb), vget_low_s16(sr), CR_G, CR_B),
+						     neon_chroma(vget_high_s16(sg), vget_high_s16(sb), vget_high_s16(sr), CR_G, CR_B)));
+		vst3_u8(pDst, ycc);
+	}
+	RGB_to_YCC(pDst, pSrc, num_pixels);
+}
+
+#define NEON_MUL(v, c) vmull_s16(vmovn_s32(v), vdup_n_s16(c))
+#define NEON_DESCALE(v, n) vshrq_n_s32(vaddq_s32((v), vdupq_n_s32(1 << ((n) - 1))), (n))
+#define NEON_SHL(v, n) vshlq_n_s32((v), (n))
+
+#define NEON_TRANSPOSE4(a, b, c, d) \
+	do { \
+	int32x4x2_t p0 = vtrnq_s32(a, b), p1 = vtrnq_s32(c, d); \
+	a = vcombine_s32(vget_low_s32(p0.val[0]), vget_low_s32(p1.val[0])); \
+	b = vcombine_s32(vget_low_s32(p0.val[1]), vget_low_s32(p1.val[1])); \
+	c = vcombine_s32(vget_high_s32(p0.val[0]), vget_high_s32(p1.val[0])); \
+	d = vcombine_s32(vget_high_s32(p0.val[1]), vget_high_s32(p1.val[1])); \
+	} while (0)
+
+static inline void neon_transpose8(int32x4_t * l, int32x4_t * h)
+{
+	int i;
+
+	NEON_TRANSPOSE4(l[0], l[1], l[2], l[3]);
+	NEON_TRANSPOSE4(l[4], l[5], l[6], l[7]);
+	NEON_TRANSPOSE4(h[0], h[1], h[2], h[3]);
+	NEON_TRANSPOSE4(h[4], h[5], h[6], h[7]);
+	for (i = 0; i < 4; i++) {
+		int32x4_t t = l[i + 4];
+
+		l[i + 4] = h[i];
+		h[i] = t;
+	}
+}
+
+static void DCT2D_neon(int32 * p)
+{
+	int32x4_t l[8], h[8];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		l[i] = vld1q_s32(p + i * 8);
+		h[i] = vld1q_s32(p + i * 8 + 4);
+	}
+	neon_transpose8(l, h);
+	DCT1D_V(int32x4_t, vaddq_s32, vsubq_s32, NEON_MUL, l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+	DCT1D_V(int32x4_t, vaddq_s32, vsubq_s32, NEON_MUL, h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+	DCT_ROW_SCALE_V(NEON_SHL, NEON_DESCALE, l);
+	DCT_ROW_SCALE_V(NEON_SHL, NEON_DESCALE, h);
+	neon_transpose8(l, h);
+	DCT1D_V(int32x4_t, vaddq_s32, vsubq_s32, NEON_MUL, l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+	DCT1D_V(int32x4_t, vaddq_s32, vsubq_s32, NEON_MUL, h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+	DCT_COL_SCALE_V(NEON_DESCALE, l);
+	DCT_COL_SCALE_V(NEON_DESCALE, h);
+	for (i = 0; i < 8; i++) {
+		vst1q_s32(p + i * 8, l[i]);
+		vst1q_s32(p + i * 8 + 4, h[i]);
+	}
+}
+
+static void quantize_neon(int16 * pDst, const int32 * pSrc, const int32 * pRound, const float *pRecip)
+{
+	int i;
+
+	for (i = 0; i < 64; i += 4) {
+		int32x4_t x = vld1q_s32(pSrc + i);
+		int32x4_t a = vaddq_s32(vabsq_s32(x), vld1q_s32(pRound + i));
+
+		a = vcvtq_s32_f32(vmulq_f32(vcvtq_f32_s32(a), vld1q_f32(pRecip + i)));
+		// Negate where x < 0.
+		a = vbslq_s32(vcltq_s32(x, vdupq_n_s32(0)), vnegq_s32(a), a);
+		vst1_s16(pDst + i, vmovn_s32(a));
+	}
+}
+#endif
+
+// Picks the fastest colour conversion, DCT and quantization routines the CPU supports.
+static void jpeg_encoder_select_simd(struct jpeg_encoder *self)
+{
+	self->m_rgb_to_ycc = RGB_to_YCC;
+	self->m_fdct = DCT2D;
+	self->m_quantize = NULL;
+#ifdef JPGE_SSE2
+	self->m_fdct = DCT2D_sse2;
+	self->m_quantize = quantize_sse2;
+#endif
+#ifdef JPGE_SSSE3
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3"))
+		self->m_rgb_to_ycc = RGB_to_YCC_ssse3;
+#endif
+#ifdef JPGE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		self->m_fdct = DCT2D_avx2;
+		self->m_quantize = quantize_avx2;
+	}
+#endif
+#ifdef JPGE_NEON
+	self->m_rgb_to_ycc = RGB_to_YCC_neon;
+	self->m_fdct = DCT2D_neon;
+	self->m_quantize = quantize_neon;
+#endif
+}
+
 struct sym_freq {
 	unsigned m_key, m_sym_index;
 };
@@ -553,6 +994,15 @@ void jpeg_encoder_emit_dhts(struct jpeg_encoder *self)
 	}
 }
 
+// emit restart interval, in MCUs
+void jpeg_encoder_emit_dri(struct jpeg_encoder *self)
+{
+	jpeg_encoder_emit_marker(self, M_DRI);
+	jpeg_encoder_emit_word(self, 4);
+	jpeg_encoder_emit_word(self,
+			       self->m_restart_rows * self->m_mcus_per_row);
+}
+
 // emit start of scan
 void jpeg_encoder_emit_sos(struct jpeg_encoder *self)
 {
@@ -582,6 +1032,8 @@ void jpeg_encoder_emit_markers(struct jpeg_encoder *self)
 	jpeg_encoder_emit_dqt(self);
 	jpeg_encoder_emit_sof(self);
 	jpeg_encoder_emit_dhts(self);
+	if (self->m_restart_rows)
+		jpeg_encoder_emit_dri(self);
 	jpeg_encoder_emit_sos(self);
 }
 
@@ -639,6 +1091,66 @@ void jpeg_encoder_compute_quant_table(struct jpeg_encoder *self, int32 * pDst,
 	}
 }
 
+// Natural order rounding and reciprocal tables for the SIMD quantizers.
+// The reciprocal is biased up slightly so the truncating multiply never lands just below an exact quotient.
+static void jpeg_encoder_compute_quant_recip(struct jpeg_encoder *self, int table)
+{
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		int32 q = self->m_quantization_tables[table][i];
+
+		self->m_quantization_round[table][s_zag[i]] = q >> 1;
+		self->m_quantization_recip[table][s_zag[i]] =
+		    (float)((1.0 / q) * (1.0 + 1.0 / (1 << 20)));
+	}
+}
+
+// Rounded division, also for negative numerators.
+static inline int div_round(int n, int d)
+{
+	return (n < 0 ? n - d / 2 : n + d / 2) / d;
+}
+
+// Sample mapping for YUV sources, either identity or BT.601 limited (16-235, 16-240) to full range.
+static void jpeg_encoder_compute_yuv_lut(struct jpeg_encoder *self)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		if (self->m_params.m_yuv_limited_range) {
+			self->m_yuv_lut[0][i] =
+			    clamp(div_round((i - 16) * 255, 219));
+			self->m_yuv_lut[1][i] =
+			    clamp(128 + div_round((i - 128) * 255, 224));
+		}
+
+		else {
+			self->m_yuv_lut[0][i] = i;
+			self->m_yuv_lut[1][i] = i;
+		}
+	}
+}
+
+// MCU rows per restart interval, 0 if no restart markers are needed.
+// Without an explicit interval, parallel encoding uses one interval per band.
+static int jpeg_encoder_get_restart_rows(struct jpeg_encoder *self)
+{
+	int rows = self->m_params.m_restart_rows;
+
+	if ((!rows) && (self->m_parallel_run) && (self->m_parallel_bands > 1)
+	    && (!self->m_params.m_two_pass_flag))
+		rows =
+		    (self->m_mcu_rows + self->m_parallel_bands -
+		     1) / self->m_parallel_bands;
+	// DRI holds the interval as a 16-bit MCU count.
+	if (rows * self->m_mcus_per_row > 0xFFFF)
+		rows = 0xFFFF / self->m_mcus_per_row;
+	if (rows >= self->m_mcu_rows)
+		rows = 0;
+	return rows;
+}
+
 // Higher-level methods.
 void jpeg_encoder_first_pass_init(struct jpeg_encoder *self)
 {
@@ -646,11 +1158,15 @@ void jpeg_encoder_first_pass_init(struct jpeg_encoder *self)
 	self->m_bits_in = 0;
 	memset(self->m_last_dc_val, 0, 3 * sizeof(self->m_last_dc_val[0]));
 	self->m_mcu_y_ofs = 0;
+	self->m_mcu_row = 0;
+	self->m_restart_num = 0;
 	self->m_pass_num = 1;
 }
 
 int jpeg_encoder_second_pass_init(struct jpeg_encoder *self)
 {
+	int i, j;
+
 	jpeg_encoder_compute_huffman_table(self, &self->m_huff_codes[0 + 0][0],
 					   &self->m_huff_code_sizes[0 + 0][0],
 					   self->m_huff_bits[0 + 0],
@@ -677,6 +1193,11 @@ int jpeg_encoder_second_pass_init(struct jpeg_encoder *self)
 						   self->m_huff_bits[2 + 1],
 						   self->m_huff_val[2 + 1]);
 	}
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 256; j++)
+			self->m_huff_code_len[i][j] =
+			    (self->m_huff_codes[i][j] << 8) |
+			    self->m_huff_code_sizes[i][j];
 	jpeg_encoder_first_pass_init(self);
 	jpeg_encoder_emit_markers(self);
 	self->m_pass_num = 2;
@@ -746,6 +1267,8 @@ int jpeg_encoder_jpg_open(struct jpeg_encoder *self, int p_x_res, int p_y_res,
 	self->m_image_bpl_xlt = self->m_image_x * self->m_num_components;
 	self->m_image_bpl_mcu = self->m_image_x_mcu * self->m_num_components;
 	self->m_mcus_per_row = self->m_image_x_mcu / self->m_mcu_x;
+	self->m_mcu_rows = self->m_image_y_mcu / self->m_mcu_y;
+	self->m_restart_rows = jpeg_encoder_get_restart_rows(self);
 	if ((self->m_mcu_lines[0] =
 	     CAST(uint8 *) (jpge_malloc(self->m_image_bpl_mcu * self->m_mcu_y)))
 	    == NULL)
@@ -759,6 +1282,10 @@ int jpeg_encoder_jpg_open(struct jpeg_encoder *self, int p_x_res, int p_y_res,
 					 self->m_params.
 					 m_no_chroma_discrim_flag ?
 					 s_std_lum_quant : s_std_croma_quant);
+	jpeg_encoder_compute_quant_recip(self, 0);
+	jpeg_encoder_compute_quant_recip(self, 1);
+	jpeg_encoder_compute_yuv_lut(self);
+	jpeg_encoder_select_simd(self);
 	self->m_out_buf_left = JPGE_OUT_BUF_SIZE;
 	self->m_pOut_buf = self->m_out_buf;
 	if (self->m_params.m_two_pass_flag) {
@@ -894,6 +1421,17 @@ void jpeg_encoder_load_quantized_coefficients(struct jpeg_encoder *self,
 	int16 *pDst = self->m_coefficient_array;
 	int i;
 
+	if (self->m_quantize) {
+		int16 coefs[64];
+
+		self->m_quantize(coefs, self->m_sample_array,
+				 self->m_quantization_round[component_num > 0],
+				 self->m_quantization_recip[component_num > 0]);
+		for (i = 0; i < 64; i++)
+			pDst[i] = coefs[s_zag[i]];
+		return;
+	}
+
 	for (i = 0; i < 64; i++) {
 		jpeg_sample_array_t j = self->m_sample_array[s_zag[i]];
 
@@ -928,21 +1466,77 @@ void jpeg_encoder_flush_output_buffer(struct jpeg_encoder *self)
 	self->m_out_buf_left = JPGE_OUT_BUF_SIZE;
 }
 
+#define JPGE_PUT_BYTE(c) { *self->m_pOut_buf++ = (c); if (--self->m_out_buf_left == 0) jpeg_encoder_flush_output_buffer(self); }
+
+// Bits are collected right-aligned in a 64-bit accumulator and written 32 at a time, so len may be up to 32.
+// Words without 0xFF bytes need no stuffing and are stored at once.
 void jpeg_encoder_put_bits(struct jpeg_encoder *self, unsigned bits,
 			   unsigned len)
 {
-	self->m_bit_buffer |=
-	    ((uint32) bits << (24 - (self->m_bits_in += len)));
+	uint32 w;
+	int i;
+
+	self->m_bit_buffer = (self->m_bit_buffer << len) | bits;
+	if ((self->m_bits_in += len) < 32)
+		return;
+
+	w = (uint32) (self->m_bit_buffer >> (self->m_bits_in -= 32));
+	if ((((~w - 0x01010101U) & w & 0x80808080U) == 0)
+	    && (self->m_out_buf_left > 4)) {
+		self->m_pOut_buf[0] = (uint8) (w >> 24);
+		self->m_pOut_buf[1] = (uint8) (w >> 16);
+		self->m_pOut_buf[2] = (uint8) (w >> 8);
+		self->m_pOut_buf[3] = (uint8) w;
+		self->m_pOut_buf += 4;
+		self->m_out_buf_left -= 4;
+		return;
+	}
+
+	for (i = 24; i >= 0; i -= 8) {
+		uint8 c = (uint8) (w >> i);
+
+		JPGE_PUT_BYTE(c);
+		if (c == 0xFF)
+			JPGE_PUT_BYTE(0);
+	}
+}
+
+// Pads the last byte with 1s and writes out all whole bytes left in the bit buffer.
+void jpeg_encoder_pad_bits(struct jpeg_encoder *self)
+{
+	jpeg_encoder_put_bits(self, 0x7F, 7);
 	while (self->m_bits_in >= 8) {
-		uint8 c;
+		uint8 c = (uint8) (self->m_bit_buffer >> (self->m_bits_in -= 8));
 
-#define JPGE_PUT_BYTE(c) { *self->m_pOut_buf++ = (c); if (--self->m_out_buf_left == 0) jpeg_encoder_flush_output_buffer(self); }
-		JPGE_PUT_BYTE(c = (uint8) ((self->m_bit_buffer >> 16) & 0xFF));
+		JPGE_PUT_BYTE(c);
 		if (c == 0xFF)
 			JPGE_PUT_BYTE(0);
-		self->m_bit_buffer <<= 8;
-		self->m_bits_in -= 8;
 	}
+	self->m_bit_buffer = 0;
+	self->m_bits_in = 0;
+}
+
+// Number of bits needed for the magnitude of a coefficient.
+static inline int jpge_bit_count(unsigned v)
+{
+#if defined(__GNUC__)
+	return v ? 32 - __builtin_clz(v) : 0;
+#else
+	int n = 0;
+
+	for (; v; v >>= 1)
+		n++;
+	return n;
+#endif
+}
+
+// Writes a Huffman code from m_huff_code_len[] followed by nbits of value with one put_bits().
+static inline void jpeg_encoder_put_code(struct jpeg_encoder *self,
+					 uint32 code_len, unsigned value,
+					 int nbits)
+{
+	jpeg_encoder_put_bits(self, ((code_len >> 8) << nbits) | value,
+			      (code_len & 0xFF) + nbits);
 }
 
 void jpeg_encoder_code_coefficients_pass_one(struct jpeg_encoder *self,
@@ -994,72 +1588,77 @@ void jpeg_encoder_code_coefficients_pass_one(struct jpeg_encoder *self,
 void jpeg_encoder_code_coefficients_pass_two(struct jpeg_encoder *self,
 					     int component_num)
 {
-	int i, j, run_len, nbits, temp1, temp2;
+	int i, run_len, nbits, temp1, temp2;
 
 	int16 *pSrc = self->m_coefficient_array;
-	unsigned *codes[2];
-
-	uint8 *code_sizes[2];
+	const uint32 *dc = self->m_huff_code_len[0 + (component_num > 0)];
+	const uint32 *ac = self->m_huff_code_len[2 + (component_num > 0)];
 
-	if (component_num == 0) {
-		codes[0] = self->m_huff_codes[0 + 0];
-		codes[1] = self->m_huff_codes[2 + 0];
-		code_sizes[0] = self->m_huff_code_sizes[0 + 0];
-		code_sizes[1] = self->m_huff_code_sizes[2 + 0];
-	}
-
-	else {
-		codes[0] = self->m_huff_codes[0 + 1];
-		codes[1] = self->m_huff_codes[2 + 1];
-		code_sizes[0] = self->m_huff_code_sizes[0 + 1];
-		code_sizes[1] = self->m_huff_code_sizes[2 + 1];
-	}
 	temp1 = temp2 = pSrc[0] - self->m_last_dc_val[component_num];
 	self->m_last_dc_val[component_num] = pSrc[0];
 	if (temp1 < 0) {
 		temp1 = -temp1;
 		temp2--;
 	}
-	nbits = 0;
-	while (temp1) {
-		nbits++;
-		temp1 >>= 1;
-	}
-	jpeg_encoder_put_bits(self, codes[0][nbits], code_sizes[0][nbits]);
-	if (nbits)
-		jpeg_encoder_put_bits(self, temp2 & ((1 << nbits) - 1), nbits);
+	nbits = jpge_bit_count(temp1);
+	jpeg_encoder_put_code(self, dc[nbits], temp2 & ((1 << nbits) - 1),
+			      nbits);
 	for (run_len = 0, i = 1; i < 64; i++) {
-		if ((temp1 = self->m_coefficient_array[i]) == 0)
+		if ((temp1 = pSrc[i]) == 0)
 			run_len++;
 
 		else {
 			while (run_len >= 16) {
-				jpeg_encoder_put_bits(self, codes[1][0xF0],
-						      code_sizes[1][0xF0]);
+				jpeg_encoder_put_code(self, ac[0xF0], 0, 0);
 				run_len -= 16;
 			}
 			if ((temp2 = temp1) < 0) {
 				temp1 = -temp1;
 				temp2--;
 			}
-			nbits = 1;
-			while (temp1 >>= 1)
-				nbits++;
-			j = (run_len << 4) + nbits;
-			jpeg_encoder_put_bits(self, codes[1][j],
-					      code_sizes[1][j]);
-			jpeg_encoder_put_bits(self, temp2 & ((1 << nbits) - 1),
-					      nbits);
+			nbits = jpge_bit_count(temp1);
+			jpeg_encoder_put_code(self, ac[(run_len << 4) + nbits],
+					      temp2 & ((1 << nbits) - 1), nbits);
 			run_len = 0;
 		}
 	}
 	if (run_len)
-		jpeg_encoder_put_bits(self, codes[1][0], code_sizes[1][0]);
+		jpeg_encoder_put_code(self, ac[0], 0, 0);
+}
+
+// Codes the block in m_sample_array with its DC coefficient only. The DC coefficient of the DCT is the sum
+// of the samples / 8, so neither the DCT nor the quantizer run, and the block takes a DC code and an EOB.
+static void jpeg_encoder_code_dc_block(struct jpeg_encoder *self, int component_num)
+{
+	int32 q = self->m_quantization_tables[component_num > 0][0];
+	int i, sum = 0, dc, diff, nbits;
+
+	for (i = 0; i < 64; i++)
+		sum += self->m_sample_array[i];
+	dc = (sum + 4) >> 3;
+	dc = dc < 0 ? -((-dc + (q >> 1)) / q) : (dc + (q >> 1)) / q;
+
+	diff = dc - self->m_last_dc_val[component_num];
+	self->m_last_dc_val[component_num] = dc;
+	nbits = jpge_bit_count(diff < 0 ? -diff : diff);
+	if (self->m_pass_num == 1) {
+		self->m_huff_count[0 + (component_num > 0)][nbits]++;
+		self->m_huff_count[2 + (component_num > 0)][0]++;
+	} else {
+		jpeg_encoder_put_code(self, self->m_huff_code_len[0 + (component_num > 0)][nbits],
+				      (diff < 0 ? diff - 1 : diff) & ((1 << nbits) - 1), nbits);
+		jpeg_encoder_put_code(self, self->m_huff_code_len[2 + (component_num > 0)][0], 0, 0);
+	}
 }
 
 void jpeg_encoder_code_block(struct jpeg_encoder *self, int component_num)
 {
-	DCT2D(self->m_sample_array);
+	if (self->m_mcu_dc_only) {
+		jpeg_encoder_code_dc_block(self, component_num);
+		return;
+	}
+
+	self->m_fdct(self->m_sample_array);
 	jpeg_encoder_load_quantized_coefficients(self, component_num);
 	if (self->m_pass_num == 1)
 		jpeg_encoder_code_coefficients_pass_one(self, component_num);
@@ -1070,15 +1669,19 @@ void jpeg_encoder_code_block(struct jpeg_encoder *self, int component_num)
 
 void jpeg_encoder_process_mcu_row(struct jpeg_encoder *self)
 {
+	const uint8 *mask = self->m_params.m_mcu_mask ?
+	    self->m_params.m_mcu_mask + self->m_mcu_row * self->m_mcus_per_row : NULL;
 	int i;
 
 	if (self->m_num_components == 1) {
 		for (i = 0; i < self->m_mcus_per_row; i++) {
+			self->m_mcu_dc_only = mask && mask[i];
 			jpeg_encoder_load_block_8_8_grey(self, i);
 			jpeg_encoder_code_block(self, 0);
 		}
 	} else if ((self->m_comp_h_samp[0] == 1) && (self->m_comp_v_samp[0] == 1)) {
 		for (i = 0; i < self->m_mcus_per_row; i++) {
+			self->m_mcu_dc_only = mask && mask[i];
 			jpeg_encoder_load_block_8_8(self, i, 0, 0);
 			jpeg_encoder_code_block(self, 0);
 			jpeg_encoder_load_block_8_8(self, i, 0, 1);
@@ -1088,6 +1691,7 @@ void jpeg_encoder_process_mcu_row(struct jpeg_encoder *self)
 		}
 	} else if ((self->m_comp_h_samp[0] == 2) && (self->m_comp_v_samp[0] == 1)) {
 		for (i = 0; i < self->m_mcus_per_row; i++) {
+			self->m_mcu_dc_only = mask && mask[i];
 			jpeg_encoder_load_block_8_8(self, i * 2 + 0, 0, 0);
 			jpeg_encoder_code_block(self, 0);
 			jpeg_encoder_load_block_8_8(self, i * 2 + 1, 0, 0);
@@ -1099,6 +1703,7 @@ void jpeg_encoder_process_mcu_row(struct jpeg_encoder *self)
 		}
 	} else if ((self->m_comp_h_samp[0] == 2) && (self->m_comp_v_samp[0] == 2)) {
 		for (i = 0; i < self->m_mcus_per_row; i++) {
+			self->m_mcu_dc_only = mask && mask[i];
 			jpeg_encoder_load_block_8_8(self, i * 2 + 0, 0, 0);
 			jpeg_encoder_code_block(self, 0);
 			jpeg_encoder_load_block_8_8(self, i * 2 + 1, 0, 0);
@@ -1113,6 +1718,24 @@ void jpeg_encoder_process_mcu_row(struct jpeg_encoder *self)
 			jpeg_encoder_code_block(self, 2);
 		}
 	}
+	self->m_mcu_dc_only = FALSE;
+
+	if ((++self->m_mcu_row < self->m_mcu_rows) && (self->m_restart_rows)
+	    && (self->m_mcu_row % self->m_restart_rows == 0))
+		jpeg_encoder_emit_restart(self);
+}
+
+// Ends a restart interval: pads the last byte with 1s, emits RSTn and resets DC prediction.
+void jpeg_encoder_emit_restart(struct jpeg_encoder *self)
+{
+	if (self->m_pass_num == 2) {
+		jpeg_encoder_pad_bits(self);
+		jpeg_encoder_flush_output_buffer(self);
+		jpeg_encoder_emit_marker(self,
+					 M_RST0 + (self->m_restart_num & 7));
+	}
+	self->m_restart_num++;
+	memset(self->m_last_dc_val, 0, 3 * sizeof(self->m_last_dc_val[0]));
 }
 
 int jpeg_encoder_terminate_pass_one(struct jpeg_encoder *self)
@@ -1130,14 +1753,15 @@ int jpeg_encoder_terminate_pass_one(struct jpeg_encoder *self)
 
 int jpeg_encoder_terminate_pass_two(struct jpeg_encoder *self)
 {
-	jpeg_encoder_put_bits(self, 0x7F, 7);
+	jpeg_encoder_pad_bits(self);
 	jpeg_encoder_flush_output_buffer(self);
 	jpeg_encoder_emit_marker(self, M_EOI);
 	self->m_pass_num++;	// purposely bump up m_pass_num, for debugging
 	return TRUE;
 }
 
-int jpeg_encoder_process_end_of_image(struct jpeg_encoder *self)
+// Encodes the last, partially filled MCU row by repeating its last scanline.
+static void jpeg_encoder_flush_mcu_row(struct jpeg_encoder *self)
 {
 	int i;
 
@@ -1151,6 +1775,11 @@ int jpeg_encoder_process_end_of_image(struct jpeg_encoder *self)
 		}
 		jpeg_encoder_process_mcu_row(self);
 	}
+}
+
+int jpeg_encoder_process_end_of_image(struct jpeg_encoder *self)
+{
+	jpeg_encoder_flush_mcu_row(self);
 	if (self->m_pass_num == 1)
 		return jpeg_encoder_terminate_pass_one(self);
 
@@ -1158,10 +1787,11 @@ int jpeg_encoder_process_end_of_image(struct jpeg_encoder *self)
 		return jpeg_encoder_terminate_pass_two(self);
 }
 
+static void jpeg_encoder_next_mcu_line(struct jpeg_encoder *self);
+
 void jpeg_encoder_load_mcu(struct jpeg_encoder *self, const void *pSrc)
 {
 	const uint8 *Psrc = (const uint8 *)(pSrc);
-	int i;
 
 	uint8 *pDst = self->m_mcu_lines[self->m_mcu_y_ofs];	// OK to write up to m_image_bpl_xlt bytes to pDst
 
@@ -1179,12 +1809,53 @@ void jpeg_encoder_load_mcu(struct jpeg_encoder *self, const void *pSrc)
 			RGBA_to_YCC(pDst, Psrc, self->m_image_x);
 
 		else if (self->m_image_bpp == 3)
-			RGB_to_YCC(pDst, Psrc, self->m_image_x);
+			self->m_rgb_to_ycc(pDst, Psrc, self->m_image_x);
 
 		else
 			Y_to_YCC(pDst, Psrc, self->m_image_x);
 	}
 
+	jpeg_encoder_next_mcu_line(self);
+}
+
+void jpeg_encoder_load_mcu_yuv(struct jpeg_encoder *self,
+			       enum jpge_yuv_format format, const uint8 * pY,
+			       const uint8 * pCb, const uint8 * pCr)
+{
+	uint8 *pDst = self->m_mcu_lines[self->m_mcu_y_ofs];
+	int y_step = 1, c_step = 1;
+
+	switch (format) {
+	case JPGE_YUYV:
+		y_step = 2;
+		c_step = 4;
+		pCb = pY + 1;
+		pCr = pY + 3;
+		break;
+	case JPGE_NV12:
+		c_step = 2;
+		pCr = pCb + 1;
+		break;
+	case JPGE_I420:
+		break;
+	}
+
+	if (self->m_num_components == 1)
+		YUV_to_Y(pDst, pY, y_step, self->m_image_x, self->m_yuv_lut[0]);
+
+	else
+		YUV_to_YCC(pDst, pY, pCb, pCr, y_step, c_step, self->m_image_x,
+			   self->m_yuv_lut);
+
+	jpeg_encoder_next_mcu_line(self);
+}
+
+// Pads the scanline just loaded into the MCU buffer and encodes the MCU row once it is complete.
+static void jpeg_encoder_next_mcu_line(struct jpeg_encoder *self)
+{
+	uint8 *pDst = self->m_mcu_lines[self->m_mcu_y_ofs];
+	int i;
+
 	// Possibly duplicate pixels at end of scanline if not a multiple of 8 or 16
 	if (self->m_num_components == 1) {
 		memset(self->m_mcu_lines[self->m_mcu_y_ofs] +
@@ -1227,6 +1898,8 @@ void jpeg_params_init(struct jpeg_params *self)
 	self->m_subsampling = JPGE_H2V2;
 	self->m_no_chroma_discrim_flag = FALSE;
 	self->m_two_pass_flag = FALSE;
+	self->m_yuv_limited_range = FALSE;
+	self->m_restart_rows = 0;
 }
 
 struct jpeg_encoder *jpeg_encoder_new()
@@ -1243,9 +1916,12 @@ struct jpeg_encoder *jpeg_encoder_new()
 	return self;
 }
 
+static void jpeg_encoder_free_bands(struct jpeg_encoder *self);
+
 void jpeg_encoder_free(struct jpeg_encoder *self)
 {
 	jpeg_encoder_deinit(self);
+	jpeg_encoder_free_bands(self);
 
 	jpge_free(self);
 }
@@ -1268,6 +1944,30 @@ int jpeg_encoder_encoder_init(struct jpeg_encoder *self,
 	return jpeg_encoder_jpg_open(self, width, height, src_channels);
 }
 
+int jpeg_encoder_restart(struct jpeg_encoder *self,
+			 struct jpeg_output_stream *pStream)
+{
+	if ((!pStream) || (!self->m_mcu_lines[0]))
+		return FALSE;
+
+	self->m_pStream = pStream;
+	self->m_all_stream_writes_succeeded = TRUE;
+	self->m_out_buf_left = JPGE_OUT_BUF_SIZE;
+	self->m_pOut_buf = self->m_out_buf;
+	if (self->m_params.m_two_pass_flag) {
+		clear_obj(self->m_huff_count);
+		jpeg_encoder_first_pass_init(self);
+	}
+
+	else {
+		// Huffman codes from the previous image are still valid, so skip over the first pass.
+		jpeg_encoder_first_pass_init(self);
+		jpeg_encoder_emit_markers(self);
+		self->m_pass_num = 2;
+	}
+	return self->m_all_stream_writes_succeeded;
+}
+
 void jpeg_encoder_deinit(struct jpeg_encoder *self)
 {
 	jpge_free(self->m_mcu_lines[0]);
@@ -1293,6 +1993,29 @@ int jpeg_encoder_process_scanline(struct jpeg_encoder *self,
 	return self->m_all_stream_writes_succeeded;
 }
 
+int jpeg_encoder_process_yuv_scanline(struct jpeg_encoder *self,
+				      enum jpge_yuv_format format,
+				      const uint8 * pY, const uint8 * pCb,
+				      const uint8 * pCr)
+{
+	if ((self->m_pass_num < 1) || (self->m_pass_num > 2))
+		return FALSE;
+	if ((format < JPGE_YUYV) || (format > JPGE_I420))
+		return FALSE;
+	if (self->m_all_stream_writes_succeeded) {
+		if (!pY) {
+			if (!jpeg_encoder_process_end_of_image(self))
+				return FALSE;
+		}
+
+		else {
+			jpeg_encoder_load_mcu_yuv(self, format, pY, pCb, pCr);
+		}
+	}
+
+	return self->m_all_stream_writes_succeeded;
+}
+
 const struct jpeg_params *jpeg_encoder_get_params(struct jpeg_encoder *self)
 {
 	return &self->m_params;
@@ -1445,7 +2168,7 @@ static int amem_put_buf(void *ctx, const void *pbuf, int len)
 	void *tmp;
 
 	if (s->pos + len > s->buf_len) {
-		for (l = s->buf_len; l < s->pos + len; l *= 2) {
+		for (l = s->buf_len ? s->buf_len : 1024; l < s->pos + len; l *= 2) {
 			if (l < s->buf_len) /* Overflow! */
 				return FALSE;
 		}
@@ -1456,6 +2179,7 @@ static int amem_put_buf(void *ctx, const void *pbuf, int len)
 		}
 
 		s->buf = tmp;
+		s->buf_len = l;
 	}
 
 	memcpy(s->buf + s->pos, pbuf, len);
@@ -1493,3 +2217,348 @@ int compress_image_to_jpeg_file_alloc_memory(void **pBuf, int *buf_size,
 	return TRUE;
 }
 
+static int jpeg_encoder_same_setup(struct jpeg_encoder *self, int width, int height,
+				   int num_channels,
+				   const struct jpeg_params *comp_params)
+{
+	return self->m_mcu_lines[0] && (self->m_image_x == width)
+	    && (self->m_image_y == height) && (self->m_image_bpp == num_channels)
+	    && (self->m_params.m_quality == comp_params->m_quality)
+	    && (self->m_params.m_subsampling == comp_params->m_subsampling)
+	    && (self->m_params.m_no_chroma_discrim_flag ==
+		comp_params->m_no_chroma_discrim_flag)
+	    && (self->m_params.m_two_pass_flag == comp_params->m_two_pass_flag)
+	    && (self->m_params.m_yuv_limited_range ==
+		comp_params->m_yuv_limited_range)
+	    && (self->m_params.m_restart_rows == comp_params->m_restart_rows);
+}
+
+// Feeds scanline i of an image to the encoder. yuv_format 0 means packed Y/RGB/RGBA pixels with num_channels.
+// Planar YUV images use the V4L2 layout: the chroma plane(s) follow the luma plane, I420 chroma rows are pitch/2 bytes.
+static int jpeg_encoder_process_image_line(struct jpeg_encoder *self,
+					   int yuv_format, int i, int height,
+					   int pitch, const uint8 * pImage_data)
+{
+	const uint8 *pChroma = pImage_data + pitch * height;
+	int c_pitch = pitch / 2;
+
+	switch (yuv_format) {
+	case JPGE_YUYV:
+		return jpeg_encoder_process_yuv_scanline(self, JPGE_YUYV,
+							 pImage_data + i * pitch,
+							 NULL, NULL);
+	case JPGE_NV12:
+		return jpeg_encoder_process_yuv_scanline(self, JPGE_NV12,
+							 pImage_data + i * pitch,
+							 pChroma + (i >> 1) * pitch,
+							 NULL);
+	case JPGE_I420:
+		return jpeg_encoder_process_yuv_scanline(self, JPGE_I420,
+							 pImage_data + i * pitch,
+							 pChroma + (i >> 1) * c_pitch,
+							 pChroma + c_pitch * ((height + 1) >> 1)
+							 + (i >> 1) * c_pitch);
+	}
+	return jpeg_encoder_process_scanline(self, pImage_data + i * pitch);
+}
+
+// Parallel encoding: the image is split into bands of whole restart intervals. Each band is encoded by its own
+// copy of the encoder into its own buffer, and the entropy coded segments are concatenated after the headers.
+// The result is identical to serial encoding with the same restart interval.
+struct jpeg_band {
+	struct jpeg_encoder *m_pEncoder;
+	struct memstream m_out;
+	struct jpeg_output_stream m_stream;
+	uint8 *m_pMcu_buf;
+	int m_mcu_buf_size;
+	int m_first_row, m_last_row;	// MCU rows
+	int m_yuv_format, m_pitch;
+	const uint8 *m_pImage_data;
+	int m_ok;
+};
+
+void jpeg_encoder_set_parallel(struct jpeg_encoder *self, jpeg_parallel_fn run,
+			       void *ctx, int num_bands)
+{
+	if ((run != self->m_parallel_run) || (num_bands != self->m_parallel_bands)) {
+		// The restart interval depends on the band count, force full initialization.
+		jpeg_encoder_deinit(self);
+		jpeg_encoder_free_bands(self);
+	}
+	self->m_parallel_run = run;
+	self->m_parallel_ctx = ctx;
+	self->m_parallel_bands = run ? num_bands : 0;
+}
+
+static void jpeg_encoder_free_bands(struct jpeg_encoder *self)
+{
+	int i;
+
+	for (i = 0; i < self->m_bands_count; i++) {
+		jpge_free(self->m_bands[i].m_pEncoder);
+		jpge_free(self->m_bands[i].m_pMcu_buf);
+		free(self->m_bands[i].m_out.buf);
+	}
+	jpge_free(self->m_bands);
+	self->m_bands = NULL;
+	self->m_bands_count = 0;
+}
+
+static int jpeg_encoder_use_bands(struct jpeg_encoder *self)
+{
+	return self->m_parallel_run && self->m_restart_rows
+	    && (self->m_pass_num == 2) && (self->m_mcu_y_ofs == 0)
+	    && (self->m_mcu_row == 0);
+}
+
+static void jpeg_encoder_encode_band(void *arg, int index)
+{
+	struct jpeg_band *band = (struct jpeg_band *)arg + index;
+	struct jpeg_encoder *self = band->m_pEncoder;
+	int i, y_end;
+
+	y_end = JPGE_MIN(band->m_last_row * self->m_mcu_y, self->m_image_y);
+	for (i = band->m_first_row * self->m_mcu_y; i < y_end; i++)
+		if (!jpeg_encoder_process_image_line(self, band->m_yuv_format, i,
+						     self->m_image_y,
+						     band->m_pitch,
+						     band->m_pImage_data))
+			break;
+
+	if (band->m_last_row == self->m_mcu_rows) {
+		// Last band, finish the entropy coded segment like terminate_pass_two() does.
+		jpeg_encoder_flush_mcu_row(self);
+		jpeg_encoder_pad_bits(self);
+	}
+	jpeg_encoder_flush_output_buffer(self);
+	band->m_ok = self->m_all_stream_writes_succeeded;
+}
+
+// Prepares band encoders as copies of self, each owning its MCU buffer and output.
+static int jpeg_encoder_init_bands(struct jpeg_encoder *self, int count,
+				   int band_rows)
+{
+	int i, j, mcu_buf_size = self->m_image_bpl_mcu * self->m_mcu_y;
+
+	if (self->m_bands_count < count) {
+		struct jpeg_band *bands =
+		    realloc(self->m_bands, count * sizeof(struct jpeg_band));
+
+		if (!bands)
+			return FALSE;
+		memset(bands + self->m_bands_count, 0,
+		       (count - self->m_bands_count) * sizeof(struct jpeg_band));
+		self->m_bands = bands;
+		self->m_bands_count = count;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct jpeg_band *band = &self->m_bands[i];
+		struct jpeg_encoder *enc = band->m_pEncoder;
+
+		if (!enc) {
+			enc = band->m_pEncoder =
+			    jpge_malloc(sizeof(struct jpeg_encoder));
+			if (!enc)
+				return FALSE;
+		}
+		if (band->m_mcu_buf_size != mcu_buf_size) {
+			jpge_free(band->m_pMcu_buf);
+			band->m_mcu_buf_size = 0;
+			band->m_pMcu_buf = jpge_malloc(mcu_buf_size);
+			if (!band->m_pMcu_buf)
+				return FALSE;
+			band->m_mcu_buf_size = mcu_buf_size;
+		}
+
+		memcpy(enc, self, sizeof(struct jpeg_encoder));
+		enc->m_bands = NULL;
+		enc->m_bands_count = 0;
+		enc->m_parallel_run = NULL;
+		for (j = 0; j < self->m_mcu_y; j++)
+			enc->m_mcu_lines[j] =
+			    band->m_pMcu_buf + j * self->m_image_bpl_mcu;
+
+		band->m_out.pos = 0;
+		band->m_stream.ctx = &band->m_out;
+		band->m_stream.close = amem_close;
+		band->m_stream.put_buf = amem_put_buf;
+		enc->m_pStream = &band->m_stream;
+		enc->m_pOut_buf = enc->m_out_buf;
+		enc->m_out_buf_left = JPGE_OUT_BUF_SIZE;
+
+		band->m_first_row = i * band_rows;
+		band->m_last_row =
+		    JPGE_MIN(band->m_first_row + band_rows, self->m_mcu_rows);
+		enc->m_mcu_row = band->m_first_row;
+		enc->m_restart_num = band->m_first_row / self->m_restart_rows;
+	}
+	return TRUE;
+}
+
+// Encodes the whole image in bands, called after the headers have been written.
+static int jpeg_encoder_compress_bands(struct jpeg_encoder *self,
+				       int yuv_format, int pitch,
+				       const uint8 * pImage_data)
+{
+	int intervals =
+	    (self->m_mcu_rows + self->m_restart_rows - 1) / self->m_restart_rows;
+	int count = JPGE_MIN(self->m_parallel_bands, intervals);
+	int band_rows =
+	    ((intervals + count - 1) / count) * self->m_restart_rows;
+	int i;
+
+	// Band sizes are rounded to whole intervals, which may leave fewer bands.
+	count = (self->m_mcu_rows + band_rows - 1) / band_rows;
+	if (!jpeg_encoder_init_bands(self, count, band_rows))
+		return FALSE;
+	for (i = 0; i < count; i++) {
+		self->m_bands[i].m_yuv_format = yuv_format;
+		self->m_bands[i].m_pitch = pitch;
+		self->m_bands[i].m_pImage_data = pImage_data;
+		self->m_bands[i].m_ok = FALSE;
+	}
+
+	self->m_parallel_run(self->m_parallel_ctx, jpeg_encoder_encode_band,
+			     self->m_bands, count);
+
+	jpeg_encoder_flush_output_buffer(self);
+	for (i = 0; i < count; i++) {
+		struct jpeg_band *band = &self->m_bands[i];
+
+		self->m_all_stream_writes_succeeded =
+		    self->m_all_stream_writes_succeeded && band->m_ok
+		    && self->m_pStream->put_buf(self->m_pStream->ctx,
+						band->m_out.buf,
+						band->m_out.pos);
+	}
+	jpeg_encoder_emit_marker(self, M_EOI);
+	self->m_pass_num++;
+	return self->m_all_stream_writes_succeeded;
+}
+
+// With fixed, *pBuf is never reallocated and the image must fit into *buf_capacity bytes.
+static int jpeg_encoder_compress_image_to_memory(struct jpeg_encoder *self,
+						 void **pBuf, int *buf_size,
+						 int *buf_capacity, int fixed,
+						 int width, int height,
+						 int num_channels,
+						 int yuv_format, int pitch,
+						 const uint8 * pImage_data,
+						 const struct jpeg_params
+						 *comp_params)
+{
+	struct memstream stream = { *pBuf, *pBuf ? *buf_capacity : 0, 0 };
+	struct jpeg_output_stream dst_stream = { &stream, amem_close, fixed ? memstream_put_buf : amem_put_buf };
+	unsigned pass_index;
+	int i, ok;
+
+	if (jpeg_encoder_same_setup(self, width, height, num_channels, comp_params)) {
+		self->m_params.m_mcu_mask = comp_params->m_mcu_mask;
+		ok = jpeg_encoder_restart(self, &dst_stream);
+	} else
+		ok = jpeg_encoder_encoder_init(self, &dst_stream, width, height,
+					       num_channels, comp_params);
+
+	if (ok && jpeg_encoder_use_bands(self))
+		ok = jpeg_encoder_compress_bands(self, yuv_format, pitch,
+						 pImage_data);
+
+	else
+		for (pass_index = 0;
+		     ok && pass_index < jpeg_encoder_get_total_passes(self);
+		     pass_index++) {
+			for (i = 0; ok && i < height; i++)
+				ok = jpeg_encoder_process_image_line(self,
+								     yuv_format,
+								     i, height,
+								     pitch,
+								     pImage_data);
+			if (ok)
+				ok = jpeg_encoder_process_scanline(self, NULL);
+		}
+
+	// The buffer may have been moved by realloc() even if compression failed.
+	*pBuf = stream.buf;
+	*buf_capacity = stream.buf_len;
+	if (!ok) {
+		// Force full initialization next time.
+		jpeg_encoder_deinit(self);
+		return FALSE;
+	}
+
+	*buf_size = stream.pos;
+
+	return TRUE;
+}
+
+// Writes JPEG image to caller-owned memory buffer, reusing the encoder tables between calls.
+int jpeg_encoder_compress_to_memory(struct jpeg_encoder *self, void **pBuf,
+				    int *buf_size, int *buf_capacity,
+				    int width, int height, int num_channels,
+				    int pitch, const uint8 * pImage_data,
+				    const struct jpeg_params *comp_params)
+{
+	if (pitch <= 0)
+		pitch = width * num_channels;
+
+	return jpeg_encoder_compress_image_to_memory(self, pBuf, buf_size,
+						     buf_capacity, FALSE, width,
+						     height, num_channels, 0,
+						     pitch, pImage_data,
+						     comp_params);
+}
+
+// Same for YUV images, the encoder is set up for colour input and the source is never converted from RGB.
+int jpeg_encoder_compress_yuv_to_memory(struct jpeg_encoder *self, void **pBuf,
+					int *buf_size, int *buf_capacity,
+					int width, int height,
+					enum jpge_yuv_format format, int pitch,
+					const uint8 * pImage_data,
+					const struct jpeg_params *comp_params)
+{
+	if ((format < JPGE_YUYV) || (format > JPGE_I420))
+		return FALSE;
+	if (pitch <= 0)
+		pitch = (format == JPGE_YUYV) ? width * 2 : width;
+
+	return jpeg_encoder_compress_image_to_memory(self, pBuf, buf_size,
+						     buf_capacity, FALSE, width,
+						     height, 3, format, pitch,
+						     pImage_data, comp_params);
+}
+
+// Same as jpeg_encoder_compress_to_memory() and jpeg_encoder_compress_yuv_to_memory() into a buffer that is not grown.
+int jpeg_encoder_compress_to_buffer(struct jpeg_encoder *self, void *pBuf,
+				    int *buf_size, int buf_capacity,
+				    int width, int height, int num_channels,
+				    int pitch, const uint8 * pImage_data,
+				    const struct jpeg_params *comp_params)
+{
+	if (pitch <= 0)
+		pitch = width * num_channels;
+
+	return jpeg_encoder_compress_image_to_memory(self, &pBuf, buf_size,
+						     &buf_capacity, TRUE, width,
+						     height, num_channels, 0,
+						     pitch, pImage_data,
+						     comp_params);
+}
+
+int jpeg_encoder_compress_yuv_to_buffer(struct jpeg_encoder *self, void *pBuf,
+					int *buf_size, int buf_capacity,
+					int width, int height,
+					enum jpge_yuv_format format, int pitch,
+					const uint8 * pImage_data,
+					const struct jpeg_params *comp_params)
+{
+	if ((format < JPGE_YUYV) || (format > JPGE_I420))
+		return FALSE;
+	if (pitch <= 0)
+		pitch = (format == JPGE_YUYV) ? width * 2 : width;
+
+	return jpeg_encoder_compress_image_to_memory(self, &pBuf, buf_size,
+						     &buf_capacity, TRUE, width,
+						     height, 3, format, pitch,
+						     pImage_data, comp_params);
+}
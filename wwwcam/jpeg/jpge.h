@@ -13,6 +13,7 @@ typedef signed short int16;
 typedef signed int int32;
 typedef unsigned short uint16;
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
 
 // JPEG chroma subsampling factors. Y_ONLY (grayscale images) and H2V2 (color images) are the most common.
 enum subsampling { JPGE_Y_ONLY = 0, JPGE_H1V1 = 1, JPGE_H2V1 = 2, JPGE_H2V2 = 3 };
@@ -36,6 +37,26 @@ struct jpeg_params {
 	// If true, the Y quantization table is also used for the CbCr channels.
 	int m_no_chroma_discrim_flag;
 	int m_two_pass_flag;
+
+	// YUV input only: samples use the BT.601 limited range (Y 16-235, CbCr 16-240), as most cameras deliver them.
+	// They are expanded to the full range JFIF expects.
+	int m_yuv_limited_range;
+
+	// Emit a restart marker every m_restart_rows MCU rows. 0 means only when needed for parallel encoding.
+	int m_restart_rows;
+
+	// Optional per-MCU mask, one byte per MCU left to right and top to bottom. MCUs are 8x8 pixels for
+	// Y_ONLY and H1V1, 16x8 for H2V1 and 16x16 for H2V2. MCUs with a nonzero byte are coded with the DC
+	// coefficients only (their average colour), skipping the DCT, for parts of no interest like a static
+	// background. The mask is only read while compressing and may change between images.
+	const uint8 *m_mcu_mask;
+};
+
+// YCbCr source formats accepted by jpeg_encoder_process_yuv_scanline(). No colour conversion is done for them.
+enum jpge_yuv_format {
+	JPGE_YUYV = 1,		// packed Y0 Cb Y1 Cr, 4:2:2
+	JPGE_NV12 = 2,		// Y plane followed by an interleaved CbCr plane, 4:2:0
+	JPGE_I420 = 3		// Y plane followed by Cb and Cr planes, 4:2:0
 };
 
 // Writes JPEG image to a file. 
@@ -63,6 +84,54 @@ int compress_image_to_jpeg_file_alloc_memory(void **pBuf, int *buf_size,
 					  const struct jpeg_params
 					  *comp_params);
 
+// Writes JPEG image to a caller-owned memory buffer using a persistent encoder (see jpeg_encoder_new()).
+// Quantization/Huffman tables and the MCU buffer are kept while width, height, num_channels and comp_params stay the same.
+// *pBuf must be NULL or allocated with malloc(), *buf_capacity is its size. The buffer is grown with realloc() when needed
+// and both values are updated even on failure, so the same buffer can be passed back for the next image.
+// pitch is the distance between scanlines in bytes, 0 means width*num_channels.
+// If return value is true, buf_size will be set to the size of the compressed data.
+struct jpeg_encoder;
+int jpeg_encoder_compress_to_memory(struct jpeg_encoder *self, void **pBuf,
+				    int *buf_size, int *buf_capacity,
+				    int width, int height, int num_channels,
+				    int pitch, const uint8 * pImage_data,
+				    const struct jpeg_params *comp_params);
+
+// Same as jpeg_encoder_compress_to_memory(), but takes a YUYV, NV12 or I420 image.
+// pitch is the distance between luma scanlines (0 means width * 2 for YUYV, width otherwise). The chroma plane(s)
+// of NV12 and I420 follow the luma plane, I420 chroma scanlines are pitch/2 bytes long.
+int jpeg_encoder_compress_yuv_to_memory(struct jpeg_encoder *self, void **pBuf,
+					int *buf_size, int *buf_capacity,
+					int width, int height,
+					enum jpge_yuv_format format, int pitch,
+					const uint8 * pImage_data,
+					const struct jpeg_params *comp_params);
+
+// Same as jpeg_encoder_compress_to_memory() and jpeg_encoder_compress_yuv_to_memory(), but the image is written to
+// pBuf of buf_capacity bytes, which is never reallocated. Fails if the image doesn't fit, so the caller can encode
+// straight into a buffer of its own, e.g. one sized for the worst case.
+int jpeg_encoder_compress_to_buffer(struct jpeg_encoder *self, void *pBuf,
+				    int *buf_size, int buf_capacity,
+				    int width, int height, int num_channels,
+				    int pitch, const uint8 * pImage_data,
+				    const struct jpeg_params *comp_params);
+int jpeg_encoder_compress_yuv_to_buffer(struct jpeg_encoder *self, void *pBuf,
+					int *buf_size, int buf_capacity,
+					int width, int height,
+					enum jpge_yuv_format format, int pitch,
+					const uint8 * pImage_data,
+					const struct jpeg_params *comp_params);
+
+// Runs fn(arg, 0) .. fn(arg, count - 1), in any order and on any threads, and returns when all calls are done.
+typedef void (*jpeg_parallel_fn)(void *ctx, void (*fn)(void *arg, int index),
+				 void *arg, int count);
+
+// Lets jpeg_encoder_compress_to_memory() and jpeg_encoder_compress_yuv_to_memory() encode one-pass images in
+// up to num_bands bands separated by restart markers, concurrently through run(ctx, ...). If m_restart_rows is 0,
+// one restart interval per band is used. Pass run == NULL to encode serially again.
+void jpeg_encoder_set_parallel(struct jpeg_encoder *self, jpeg_parallel_fn run,
+			       void *ctx, int num_bands);
+
 // Output stream abstract class - used by the jpeg_encoder class to write to the output stream. 
 // put_buf() is generally called with len==JPGE_OUT_BUF_SIZE bytes, but for headers it'll be called with smaller amounts.
 struct jpeg_output_stream {
@@ -95,12 +164,27 @@ int jpeg_encoder_encoder_init(struct jpeg_encoder *self,
 			      const struct jpeg_params *comp_params);
 void jpeg_encoder_deinit(struct jpeg_encoder *self);
 
+// Starts a new image with the settings of the previous jpeg_encoder_encoder_init() call.
+// Quantization and Huffman tables and the MCU buffer are reused, only the output stream is replaced.
+// Returns false if the encoder was not initialized or if a stream write fails.
+int jpeg_encoder_restart(struct jpeg_encoder *self,
+			 struct jpeg_output_stream *pStream);
+
 // Call this method with each source scanline.
 // width * src_channels bytes per scanline is expected (RGB or Y format).
 // You must call with NULL after all scanlines are processed to finish compression.
 // Returns false on out of memory or if a stream write fails.
 int jpeg_encoder_process_scanline(struct jpeg_encoder *self,
 				  const void *pScanline);
+// Same as jpeg_encoder_process_scanline() for YCbCr sources, see enum jpge_yuv_format.
+// YUYV: pY is the packed scanline, pCb and pCr are ignored.
+// NV12: pY is the luma scanline, pCb the CbCr scanline shared by two luma scanlines, pCr is ignored.
+// I420: pY is the luma scanline, pCb and pCr the chroma scanlines shared by two luma scanlines.
+// The encoder must have been initialized for 3 channels. Call with pY == NULL after all scanlines are processed.
+int jpeg_encoder_process_yuv_scanline(struct jpeg_encoder *self,
+				      enum jpge_yuv_format format,
+				      const uint8 * pY, const uint8 * pCb,
+				      const uint8 * pCr);
 typedef int32 jpeg_sample_array_t;
 struct jpeg_encoder {
 	struct jpeg_output_stream *m_pStream;
@@ -114,21 +198,37 @@ struct jpeg_encoder {
 	int m_mcu_x, m_mcu_y;
 	uint8 *m_mcu_lines[16];
 	uint8 m_mcu_y_ofs;
+	int m_mcu_row, m_mcu_rows;
+	int m_restart_rows, m_restart_num;
+	jpeg_parallel_fn m_parallel_run;
+	void *m_parallel_ctx;
+	int m_parallel_bands;
+	struct jpeg_band *m_bands;
+	int m_bands_count;
 	jpeg_sample_array_t m_sample_array[64];
 	int16 m_coefficient_array[64];
 	int32 m_quantization_tables[2][64];
+	int32 m_quantization_round[2][64];
+	float m_quantization_recip[2][64];
+	uint8 m_yuv_lut[2][256];
+	void (*m_rgb_to_ycc)(uint8 * pDst, const uint8 * pSrc, int num_pixels);
+	void (*m_fdct)(int32 * pSamples);
+	void (*m_quantize)(int16 * pDst, const int32 * pSamples,
+			   const int32 * pRound, const float *pRecip);
 	unsigned m_huff_codes[4][256];
 	uint8 m_huff_code_sizes[4][256];
+	uint32 m_huff_code_len[4][256];	// code << 8 | code size
 	uint8 m_huff_bits[4][17];
 	uint8 m_huff_val[4][256];
 	uint32 m_huff_count[4][256];
 	int m_last_dc_val[3];
+	int m_mcu_dc_only;
 
 #define JPGE_OUT_BUF_SIZE 2048
 	uint8 m_out_buf[JPGE_OUT_BUF_SIZE];
 	uint8 *m_pOut_buf;
 	unsigned m_out_buf_left;
-	uint32 m_bit_buffer;
+	uint64 m_bit_buffer;
 	unsigned m_bits_in;
 	uint8 m_pass_num;
 	int m_all_stream_writes_succeeded;
@@ -145,7 +245,9 @@ void jpeg_encoder_emit_sof(struct jpeg_encoder *self);
 void jpeg_encoder_emit_dht(struct jpeg_encoder *self, uint8 * bits,
 			   uint8 * val, int index, int ac_flag);
 void jpeg_encoder_emit_dhts(struct jpeg_encoder *self);
+void jpeg_encoder_emit_dri(struct jpeg_encoder *self);
 void jpeg_encoder_emit_sos(struct jpeg_encoder *self);
+void jpeg_encoder_emit_restart(struct jpeg_encoder *self);
 void jpeg_encoder_emit_markers(struct jpeg_encoder *self);
 void jpeg_encoder_compute_huffman_table(struct jpeg_encoder *self,
 					unsigned *codes,
@@ -169,6 +271,7 @@ void jpeg_encoder_load_quantized_coefficients(struct jpeg_encoder *self,
 void jpeg_encoder_flush_output_buffer(struct jpeg_encoder *self);
 void jpeg_encoder_put_bits(struct jpeg_encoder *self, unsigned bits,
 			   unsigned len);
+void jpeg_encoder_pad_bits(struct jpeg_encoder *self);
 void jpeg_encoder_code_coefficients_pass_one(struct jpeg_encoder *self,
 					     int component_num);
 void jpeg_encoder_code_coefficients_pass_two(struct jpeg_encoder *self,
@@ -179,6 +282,9 @@ int jpeg_encoder_terminate_pass_one(struct jpeg_encoder *self);
 int jpeg_encoder_terminate_pass_two(struct jpeg_encoder *self);
 int jpeg_encoder_process_end_of_image(struct jpeg_encoder *self);
 void jpeg_encoder_load_mcu(struct jpeg_encoder *self, const void *src);
+void jpeg_encoder_load_mcu_yuv(struct jpeg_encoder *self,
+			       enum jpge_yuv_format format, const uint8 * pY,
+			       const uint8 * pCb, const uint8 * pCr);
 void jpeg_encoder_clear(struct jpeg_encoder *self);
 void jpeg_encoder_init(struct jpeg_encoder *self);
 
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "motion.h"
+
+/* Change detection for skipping frames of static scenes.
+ * The luma of each frame is scaled down to 1/MOTION_SCALE of its size, every pixel and row counts
+ * in it. A cell is then a block of MOTION_BLOCK x MOTION_BLOCK samples stored together, so the sum
+ * of absolute differences of a cell with the reference takes a single SAD instruction. */
+
+#if defined(__SSE2__)
+#define MOTION_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/* Adds the luma of pixels 0 .. width - 1 of a line to acc[0 .. width - 1] */
+static void line_add(unsigned short *acc, const unsigned char *p, int width, webcam_pixel_format_t format)
+{
+	int x = 0;
+
+	switch (format) {
+	case WEBCAM_PIX_RGB24:
+		for (; x < width; x++, p += 3)
+			acc[x] += (p[0] + p[1] * 2 + p[2]) >> 2;
+		return;
+	case WEBCAM_PIX_YUYV: {
+#ifdef MOTION_SSE2
+		const __m128i luma = _mm_set1_epi16(0xff);
+		__m128i *a = (__m128i*)acc;
+
+		for (; x + 16 <= width; x += 16, a += 2) {
+			_mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a),
+				_mm_and_si128(_mm_loadu_si128((const __m128i*)(p + x * 2)), luma)));
+			_mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1),
+				_mm_and_si128(_mm_loadu_si128((const __m128i*)(p + x * 2 + 16)), luma)));
+		}
+#endif
+		for (; x < width; x++)
+			acc[x] += p[x * 2];
+		return;
+	}
+	default: {
+#ifdef MOTION_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		__m128i *a = (__m128i*)acc;
+		__m128i v;
+
+		for (; x + 16 <= width; x += 16, a += 2) {
+			v = _mm_loadu_si128((const __m128i*)(p + x));
+			_mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), _mm_unpacklo_epi8(v, zero)));
+			_mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), _mm_unpackhi_epi8(v, zero)));
+		}
+#endif
+		for (; x < width; x++)
+			acc[x] += p[x];
+		return;
+	}
+	}
+}
+
+/* Stores the means of groups of MOTION_SCALE columns of MOTION_SCALE summed lines, MOTION_BLOCK
+ * of them per cell, to row by of the cells' blocks */
+static void line_store(unsigned char *cells, const unsigned short *acc, int cols, int by)
+{
+	int c = 0, i;
+
+#ifdef MOTION_SSE2
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i round = _mm_set1_epi32(MOTION_SCALE * MOTION_SCALE / 2);
+	const __m128i *a = (const __m128i*)acc;
+	__m128i pairs, sums;
+
+	for (; c < cols; c++, a += 2) {
+		pairs = _mm_packs_epi32(_mm_madd_epi16(_mm_loadu_si128(a), ones), _mm_madd_epi16(_mm_loadu_si128(a + 1), ones));
+		sums = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(pairs, ones), round), 4);
+		sums = _mm_packs_epi32(sums, sums);
+		*(int*)(cells + c * MOTION_BLOCK * MOTION_BLOCK + by * MOTION_BLOCK) =
+			_mm_cvtsi128_si32(_mm_packus_epi16(sums, sums));
+	}
+#endif
+	for (; c < cols; c++) {
+		for (i = 0; i < MOTION_BLOCK; i++) {
+			const unsigned short *s = acc + c * MOTION_CELL + i * MOTION_SCALE;
+			cells[c * MOTION_BLOCK * MOTION_BLOCK + by * MOTION_BLOCK + i] =
+				(s[0] + s[1] + s[2] + s[3] + MOTION_SCALE * MOTION_SCALE / 2) >> 4;
+		}
+	}
+}
+
+/* Sum of absolute differences of the samples of a cell */
+static unsigned cell_sad(const unsigned char *a, const unsigned char *b)
+{
+#ifdef MOTION_SSE2
+	__m128i s = _mm_sad_epu8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b));
+	return _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+#else
+	unsigned sad = 0;
+	int i;
+
+	for (i = 0; i < MOTION_BLOCK * MOTION_BLOCK; i++)
+		sad += abs(a[i] - b[i]);
+	return sad;
+#endif
+}
+
+/* Number of cells whose samples differ by more than threshold on average. Changed cells get
+ * MOTION_HOLD in active, the other ones count down to 0. */
+static int count_changed(const unsigned char *a, const unsigned char *b, unsigned char *active, int n, int threshold)
+{
+	unsigned limit = threshold * MOTION_BLOCK * MOTION_BLOCK;
+	int changed = 0;
+	int i;
+
+	for (i = 0; i < n; i++, a += MOTION_BLOCK * MOTION_BLOCK, b += MOTION_BLOCK * MOTION_BLOCK) {
+		if (cell_sad(a, b) > limit) {
+			active[i] = MOTION_HOLD;
+			changed++;
+		} else if (active[i]) {
+			active[i]--;
+		}
+	}
+
+	return changed;
+}
+
+struct motion* motion_new(int width, int height, webcam_pixel_format_t format, int threshold)
+{
+	struct motion *motion;
+	int cells;
+
+	if (width < MOTION_CELL || height < MOTION_CELL)
+		return NULL;
+
+	motion = calloc(1, sizeof(struct motion));
+	if (!motion)
+		return NULL;
+
+	motion->width = width;
+	motion->height = height;
+	motion->format = format;
+	motion->threshold = threshold;
+	motion->cols = width / MOTION_CELL;
+	motion->rows = height / MOTION_CELL;
+	cells = motion->cols * motion->rows;
+	motion->grid = malloc(cells * (MOTION_BLOCK * MOTION_BLOCK * 2 + 1));
+	motion->acc = malloc(motion->cols * MOTION_CELL * sizeof(unsigned short));
+	if (!motion->grid || !motion->acc) {
+		motion_free(motion);
+		return NULL;
+	}
+	motion->ref = motion->grid + cells * MOTION_BLOCK * MOTION_BLOCK;
+	motion->active = motion->ref + cells * MOTION_BLOCK * MOTION_BLOCK;
+	memset(motion->active, MOTION_HOLD, cells);
+
+	return motion;
+}
+
+void motion_free(struct motion *motion)
+{
+	if (!motion)
+		return;
+
+	free(motion->grid);
+	free(motion->acc);
+	free(motion);
+}
+
+int motion_check(struct motion *motion, const unsigned char *data, int bpl)
+{
+	int cells = motion->cols * motion->rows;
+	int width = motion->cols * MOTION_CELL;
+	unsigned char *row;
+	int r, y;
+
+	for (r = 0; r < motion->rows; r++) {
+		row = motion->grid + r * motion->cols * MOTION_BLOCK * MOTION_BLOCK;
+		for (y = 0; y < MOTION_CELL; y++) {
+			if (y % MOTION_SCALE == 0)
+				memset(motion->acc, 0, width * sizeof(unsigned short));
+			line_add(motion->acc, data + (r * MOTION_CELL + y) * bpl, width, motion->format);
+			if (y % MOTION_SCALE == MOTION_SCALE - 1)
+				line_store(row, motion->acc, motion->cols, y / MOTION_SCALE);
+		}
+	}
+
+	if (!motion->has_ref)
+		return -1;
+
+	return (count_changed(motion->grid, motion->ref, motion->active, cells, motion->threshold) * 1000 + cells - 1) / cells;
+}
+
+void motion_update(struct motion *motion)
+{
+	memcpy(motion->ref, motion->grid, motion->cols * motion->rows * MOTION_BLOCK * MOTION_BLOCK);
+	motion->has_ref = 1;
+}
@@ -0,0 +1,50 @@
+#ifndef MOTION_H_INC
+#define MOTION_H_INC
+
+#include <libwebcam.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* } */
+
+/* Frames are compared in cells of MOTION_CELL x MOTION_CELL pixels */
+#define MOTION_CELL 16
+/* Luma is scaled down by this before comparing, a cell is a block of MOTION_BLOCK x MOTION_BLOCK samples */
+#define MOTION_SCALE 4
+#define MOTION_BLOCK (MOTION_CELL / MOTION_SCALE)
+/* Checks a cell stays active after it changed */
+#define MOTION_HOLD 8
+
+/* Change detector for frames of one size and format */
+struct motion {
+	int width;
+	int height;
+	webcam_pixel_format_t format;
+	int threshold; /* mean luma difference making a cell changed */
+
+	int cols;
+	int rows;
+	unsigned char *grid; /* cell blocks of the last checked frame */
+	unsigned char *ref;  /* cell blocks of the frame changes are counted from */
+	unsigned char *active; /* checks left until a cell is static, all are active without a reference */
+	int has_ref;
+	unsigned short *acc; /* luma sums of a line of cells */
+};
+
+struct motion* motion_new(int width, int height, webcam_pixel_format_t format, int threshold);
+void motion_free(struct motion *motion);
+
+/* Changed cells of a frame in 1000, rounded up so any change counts.
+ * Returns -1 while there is no reference frame yet. */
+int motion_check(struct motion *motion, const unsigned char *data, int bpl);
+
+/* Makes the last checked frame the reference of the next checks. Small changes add up against it
+ * instead of being lost between consecutive frames. */
+void motion_update(struct motion *motion);
+
+/* extern "C" { */
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/* Thread pool for splitting work like frame encoding between CPUs */
+
+/* Runs calls of the current batch. Called and returns with the lock held. */
+static void pool_work(struct pool *pool)
+{
+	int i;
+
+	while (pool->next < pool->count) {
+		i = pool->next++;
+		mtx_unlock(&pool->lock);
+
+		pool->fn(pool->arg, i);
+
+		mtx_lock(&pool->lock);
+		if (++pool->finished == pool->count)
+			cnd_broadcast(&pool->done);
+	}
+}
+
+static int pool_thread(void *ptr)
+{
+	struct pool *pool = ptr;
+
+	mtx_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->next >= pool->count)
+			cnd_wait(&pool->work, &pool->lock);
+
+		if (pool->stop)
+			break;
+
+		pool_work(pool);
+	}
+	mtx_unlock(&pool->lock);
+
+	return 0;
+}
+
+struct pool* pool_new(unsigned threads)
+{
+	struct pool *res;
+	long cpus;
+
+	if (threads == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+
+	res = calloc(1, sizeof(struct pool));
+	if (!res) {
+		return NULL;
+	}
+
+	res->threads = calloc(threads, sizeof(thrd_t));
+	if (!res->threads) {
+		free(res);
+		return NULL;
+	}
+
+	if (mtx_init(&res->lock, mtx_plain) != thrd_success) {
+		free(res->threads);
+		free(res);
+		return NULL;
+	}
+	cnd_init(&res->work);
+	cnd_init(&res->done);
+
+	/* The thread calling pool_run() is one of the workers */
+	for (res->threads_cnt = 0; res->threads_cnt < threads - 1; res->threads_cnt++) {
+		if (thrd_create(&res->threads[res->threads_cnt], pool_thread, res) != thrd_success) {
+			break;
+		}
+	}
+
+	return res;
+}
+
+void pool_free(struct pool *pool)
+{
+	unsigned i;
+
+	if (!pool)
+		return;
+
+	mtx_lock(&pool->lock);
+	pool->stop = 1;
+	cnd_broadcast(&pool->work);
+	mtx_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads_cnt; i++)
+		thrd_join(pool->threads[i], NULL);
+
+	cnd_destroy(&pool->work);
+	cnd_destroy(&pool->done);
+	mtx_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+unsigned pool_size(struct pool *pool)
+{
+	return pool->threads_cnt + 1;
+}
+
+void pool_run(struct pool *pool, pool_fn fn, void *arg, int count)
+{
+	mtx_lock(&pool->lock);
+	/* Batches of other callers run one after the other */
+	while (pool->count)
+		cnd_wait(&pool->done, &pool->lock);
+
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->count = count;
+	pool->next = 0;
+	pool->finished = 0;
+	cnd_broadcast(&pool->work);
+
+	pool_work(pool);
+	while (pool->finished < pool->count)
+		cnd_wait(&pool->done, &pool->lock);
+
+	pool->count = 0;
+	pool->next = 0;
+	cnd_broadcast(&pool->done);
+	mtx_unlock(&pool->lock);
+}
@@ -0,0 +1,47 @@
+#ifndef POOL_H_INC
+#define POOL_H_INC
+
+#include "c11threads.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* } */
+
+typedef void (*pool_fn)(void *arg, int index);
+
+/* Fixed set of worker threads running one batch of calls at a time */
+struct pool {
+	mtx_t lock;
+	cnd_t work; /* new batch or stop */
+	cnd_t done; /* all calls of the batch returned */
+
+	thrd_t *threads;
+	unsigned threads_cnt;
+
+	/* Current batch: */
+	pool_fn fn;
+	void *arg;
+	int count;
+	int next;
+	int finished;
+
+	int stop;
+};
+
+/* Start =threads workers, 0 means one per CPU. The calling thread works too, so 1 creates no threads. */
+struct pool* pool_new(unsigned threads);
+void pool_free(struct pool *pool);
+
+/* Number of calls that can run at the same time */
+unsigned pool_size(struct pool *pool);
+
+/* Call fn(arg, 0) .. fn(arg, count - 1) on the workers and wait until all of them return.
+ * Calls from several threads wait for each other's batches. */
+void pool_run(struct pool *pool, pool_fn fn, void *arg, int count);
+
+/* extern "C" { */
+#ifdef __cplusplus
+}
+#endif
+
+#endif
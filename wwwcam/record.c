@@ -0,0 +1,449 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+
+/* Recording of encoded frames to MJPEG AVI files.
+ * Capture only queues references to frames, a writer thread collects them into large writes
+ * ending on RECORD_WRITE_SIZE boundaries of the file.
+ * Every RECORD_FLUSH_SECS the buffered frames and the idx1 index after them are written and the
+ * header is updated, the frames stay buffered and the next write overwrites them and the index.
+ * So a file is playable up to its last index update until frames overwrite that index, players
+ * have to scan the movi list then. Closed files are whole. */
+
+/* RIFF, hdrl list with avih, strl list with strh and strf, then the movi list */
+#define AVI_HEADER_SIZE 224
+#define AVIF_HASINDEX 0x10
+#define AVIIF_KEYFRAME 0x10
+/* AVI 1.0 files stay under 1 GB, sizes and idx1 offsets are 32 bits */
+#define AVI_MAX_SIZE (1024 * 1024 * 1024)
+
+static unsigned char *put_le32(unsigned char *p, unsigned v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+	return p + 4;
+}
+
+static unsigned char *put_le16(unsigned char *p, unsigned v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	return p + 2;
+}
+
+static unsigned char *put_fourcc(unsigned char *p, const char *fourcc)
+{
+	memcpy(p, fourcc, 4);
+	return p + 4;
+}
+
+static void avi_header(struct record *rec, unsigned char *h)
+{
+	unsigned idx_size = 8 + rec->index_cnt * 16;
+	unsigned char *p = h;
+
+	p = put_fourcc(p, "RIFF");
+	p = put_le32(p, AVI_HEADER_SIZE - 8 + rec->movi_size + idx_size);
+	p = put_fourcc(p, "AVI ");
+
+	p = put_fourcc(p, "LIST");
+	p = put_le32(p, 192);
+	p = put_fourcc(p, "hdrl");
+
+	p = put_fourcc(p, "avih");
+	p = put_le32(p, 56);
+	p = put_le32(p, 1000000 / rec->fps);
+	p = put_le32(p, 0);                /* max bytes per second */
+	p = put_le32(p, 0);                /* padding granularity */
+	p = put_le32(p, AVIF_HASINDEX);
+	p = put_le32(p, rec->index_cnt);
+	p = put_le32(p, 0);                /* initial frames */
+	p = put_le32(p, 1);                /* streams */
+	p = put_le32(p, rec->max_frame);
+	p = put_le32(p, rec->width);
+	p = put_le32(p, rec->height);
+	memset(p, 0, 16);
+	p += 16;
+
+	p = put_fourcc(p, "LIST");
+	p = put_le32(p, 116);
+	p = put_fourcc(p, "strl");
+
+	p = put_fourcc(p, "strh");
+	p = put_le32(p, 56);
+	p = put_fourcc(p, "vids");
+	p = put_fourcc(p, "MJPG");
+	p = put_le32(p, 0);                /* flags */
+	p = put_le16(p, 0);                /* priority */
+	p = put_le16(p, 0);                /* language */
+	p = put_le32(p, 0);                /* initial frames */
+	p = put_le32(p, 1);                /* scale */
+	p = put_le32(p, rec->fps);         /* rate */
+	p = put_le32(p, 0);                /* start */
+	p = put_le32(p, rec->index_cnt);   /* length */
+	p = put_le32(p, rec->max_frame);
+	p = put_le32(p, 0xffffffff);       /* quality */
+	p = put_le32(p, 0);                /* sample size */
+	p = put_le16(p, 0);
+	p = put_le16(p, 0);
+	p = put_le16(p, rec->width);
+	p = put_le16(p, rec->height);
+
+	p = put_fourcc(p, "strf");
+	p = put_le32(p, 40);
+	p = put_le32(p, 40);
+	p = put_le32(p, rec->width);
+	p = put_le32(p, rec->height);
+	p = put_le16(p, 1);                /* planes */
+	p = put_le16(p, 24);               /* bits per pixel */
+	p = put_fourcc(p, "MJPG");
+	p = put_le32(p, rec->width * rec->height * 3);
+	memset(p, 0, 16);
+	p += 16;
+
+	p = put_fourcc(p, "LIST");
+	p = put_le32(p, 4 + rec->movi_size);
+	put_fourcc(p, "movi");
+}
+
+static int record_pwrite(struct record *rec, const void *ptr, size_t len, unsigned long long offset)
+{
+	const unsigned char *p = ptr;
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(rec->fd, p, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+static int record_flush_buffer(struct record *rec)
+{
+	if (rec->wlen && record_pwrite(rec, rec->wbuf, rec->wlen, rec->flushed))
+		return -1;
+	rec->flushed += rec->wlen;
+	rec->wlen = 0;
+
+	return 0;
+}
+
+/* Appends to the movi list through the write buffer.
+ * The first buffer of a file is short by the header, so the others are written aligned. */
+static int record_write(struct record *rec, const void *ptr, size_t len)
+{
+	const unsigned char *p = ptr;
+	size_t n, size;
+
+	while (len) {
+		size = RECORD_WRITE_SIZE - rec->flushed % RECORD_WRITE_SIZE;
+		n = size - rec->wlen;
+		if (n > len)
+			n = len;
+		memcpy(rec->wbuf + rec->wlen, p, n);
+		rec->wlen += n;
+		p += n;
+		len -= n;
+		if (rec->wlen == size && record_flush_buffer(rec))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Writes the buffered frames and the index after them and updates the header.
+ * The frames stay in the buffer. */
+static int record_flush_index(struct record *rec)
+{
+	unsigned char header[AVI_HEADER_SIZE];
+
+	put_fourcc(rec->index, "idx1");
+	put_le32(rec->index + 4, rec->index_cnt * 16);
+	avi_header(rec, header);
+	if ((rec->wlen && record_pwrite(rec, rec->wbuf, rec->wlen, rec->flushed)) ||
+	    record_pwrite(rec, rec->index, 8 + rec->index_cnt * 16, rec->flushed + rec->wlen) ||
+	    record_pwrite(rec, header, sizeof(header), 0))
+		return -1;
+	fdatasync(rec->fd);
+	rec->last_flush = time(NULL);
+
+	return 0;
+}
+
+static void record_close_segment(struct record *rec)
+{
+	if (rec->fd < 0)
+		return;
+
+	if (record_flush_index(rec)) {
+		mtx_lock(&rec->lock);
+		rec->error = 1;
+		mtx_unlock(&rec->lock);
+	}
+	close(rec->fd);
+	rec->fd = -1;
+}
+
+static int record_open_segment(struct record *rec, const struct timeval *tv)
+{
+	char path[1024];
+	char stamp[32];
+	time_t secs = tv->tv_sec;
+	int i;
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&secs));
+	for (i = 0; i < 100; i++) {
+		if (i)
+			snprintf(path, sizeof(path), "%s-%s-%d.avi", rec->prefix, stamp, i);
+		else
+			snprintf(path, sizeof(path), "%s-%s.avi", rec->prefix, stamp);
+		rec->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (rec->fd >= 0 || errno != EEXIST)
+			break;
+	}
+	if (rec->fd < 0) {
+		fprintf(stderr, "Error: can't create recording `%s'\n", path);
+		return -1;
+	}
+
+	rec->movi_size = 0;
+	rec->index_cnt = 0;
+	rec->max_frame = 0;
+	rec->wlen = 0;
+	rec->flushed = AVI_HEADER_SIZE;
+	if (record_flush_index(rec))
+		return -1;
+
+	mtx_lock(&rec->lock);
+	rec->segments++;
+	mtx_unlock(&rec->lock);
+
+	return 0;
+}
+
+/* Writes a frame as a 00dc chunk, its time goes to a COM segment after SOI */
+static int record_frame_write(struct record *rec, struct record_frame *frame)
+{
+	const unsigned char *data = http_buffer_data(frame->buf);
+	size_t len = http_buffer_size(frame->buf);
+	unsigned char head[8 + 2 + 4 + 40];
+	unsigned char *p = head;
+	unsigned char *index;
+	char comment[40];
+	size_t com_len, size;
+
+	if (len < 2 || data[0] != 0xff || data[1] != 0xd8)
+		return 0;
+
+	com_len = snprintf(comment, sizeof(comment), "wwwcam %lld.%06ld",
+			   (long long)frame->time.tv_sec, (long)frame->time.tv_usec);
+	size = len + 4 + com_len;
+
+	if (rec->fd >= 0 && AVI_HEADER_SIZE + rec->movi_size + 8 + size + 1 + (rec->index_cnt + 1) * 16 + 8 > rec->segment_max)
+		record_close_segment(rec);
+	if (rec->fd < 0 && record_open_segment(rec, &frame->time))
+		return -1;
+
+	if (rec->index_cnt == rec->index_cap) {
+		index = realloc(rec->index, 8 + (rec->index_cap + 1024) * 16);
+		if (!index)
+			return -1;
+		rec->index = index;
+		rec->index_cap += 1024;
+	}
+	index = rec->index + 8 + rec->index_cnt * 16;
+	index = put_fourcc(index, "00dc");
+	index = put_le32(index, AVIIF_KEYFRAME);
+	index = put_le32(index, rec->movi_size + 4);
+	put_le32(index, size);
+	rec->index_cnt++;
+
+	p = put_fourcc(p, "00dc");
+	p = put_le32(p, size);
+	*p++ = 0xff;
+	*p++ = 0xd8;
+	*p++ = 0xff;
+	*p++ = 0xfe;
+	*p++ = (com_len + 2) >> 8;
+	*p++ = com_len + 2;
+	memcpy(p, comment, com_len);
+	p += com_len;
+
+	if (record_write(rec, head, p - head) || record_write(rec, data + 2, len - 2) ||
+	    ((size & 1) && record_write(rec, "", 1)))
+		return -1;
+	rec->movi_size += 8 + size + (size & 1);
+	if (size > rec->max_frame)
+		rec->max_frame = size;
+
+	if (time(NULL) - rec->last_flush >= RECORD_FLUSH_SECS && record_flush_index(rec))
+		return -1;
+
+	return 0;
+}
+
+static int record_thread(void *arg)
+{
+	struct record *rec = arg;
+	struct record_frame frame;
+	struct timespec ts;
+	int rv;
+
+	mtx_lock(&rec->lock);
+	for (;;) {
+		while (!rec->count && !rec->stop) {
+			timespec_get(&ts, TIME_UTC);
+			ts.tv_sec += RECORD_FLUSH_SECS;
+			cnd_timedwait(&rec->more, &rec->lock, &ts);
+			if (!rec->count && rec->fd >= 0 && time(NULL) - rec->last_flush >= RECORD_FLUSH_SECS) {
+				mtx_unlock(&rec->lock);
+				rv = record_flush_index(rec);
+				mtx_lock(&rec->lock);
+				if (rv)
+					rec->error = 1;
+			}
+		}
+		if (!rec->count)
+			break;
+
+		frame = rec->queue[rec->head];
+		rec->head = (rec->head + 1) % RECORD_QUEUE;
+		rec->count--;
+		mtx_unlock(&rec->lock);
+
+		rv = rec->error ? -1 : record_frame_write(rec, &frame);
+		http_buffer_release(frame.buf);
+
+		mtx_lock(&rec->lock);
+		if (rv) {
+			if (!rec->error)
+				fprintf(stderr, "Error: can't write recording, frames are dropped\n");
+			rec->error = 1;
+			rec->dropped++;
+		} else {
+			rec->written++;
+		}
+	}
+	mtx_unlock(&rec->lock);
+
+	record_close_segment(rec);
+
+	return 0;
+}
+
+struct record* record_open(const char *prefix, int width, int height, unsigned fps, unsigned decimate, size_t segment_max)
+{
+	struct record *rec;
+	void *wbuf;
+
+	rec = calloc(1, sizeof(struct record));
+	if (!rec)
+		return NULL;
+
+	rec->prefix = strdup(prefix);
+	rec->width = width;
+	rec->height = height;
+	rec->fps = fps ? fps : 1;
+	rec->decimate = decimate ? decimate : 1;
+	rec->segment_max = segment_max && segment_max < AVI_MAX_SIZE ? segment_max : AVI_MAX_SIZE;
+	rec->fd = -1;
+	/* Page aligned so the kernel copies whole pages */
+	if (posix_memalign(&wbuf, 4096, RECORD_WRITE_SIZE))
+		wbuf = NULL;
+	rec->wbuf = wbuf;
+	rec->index = malloc(8 + 1024 * 16);
+	rec->index_cap = 1024;
+	if (!rec->prefix || !rec->wbuf || !rec->index) {
+		free(rec->prefix);
+		free(rec->wbuf);
+		free(rec->index);
+		free(rec);
+		return NULL;
+	}
+
+	mtx_init(&rec->lock, mtx_plain);
+	cnd_init(&rec->more);
+	if (thrd_create(&rec->thread, record_thread, rec) != thrd_success) {
+		cnd_destroy(&rec->more);
+		mtx_destroy(&rec->lock);
+		free(rec->prefix);
+		free(rec->wbuf);
+		free(rec->index);
+		free(rec);
+		return NULL;
+	}
+
+	return rec;
+}
+
+void record_close(struct record *rec)
+{
+	if (!rec)
+		return;
+
+	mtx_lock(&rec->lock);
+	rec->stop = 1;
+	cnd_signal(&rec->more);
+	mtx_unlock(&rec->lock);
+	thrd_join(rec->thread, NULL);
+
+	cnd_destroy(&rec->more);
+	mtx_destroy(&rec->lock);
+	free(rec->index);
+	free(rec->prefix);
+	free(rec->wbuf);
+	free(rec);
+}
+
+int record_push(struct record *rec, http_buffer_t *frame, const struct timeval *time)
+{
+	struct record_frame *f;
+	int rv = 0;
+
+	mtx_lock(&rec->lock);
+	if (rec->pushed++ % rec->decimate) {
+		rv = 1;
+	} else if (rec->count == RECORD_QUEUE || rec->error) {
+		rec->dropped++;
+		rv = -1;
+	} else {
+		f = &rec->queue[(rec->head + rec->count) % RECORD_QUEUE];
+		f->buf = http_buffer_ref(frame);
+		f->time = *time;
+		rec->count++;
+		cnd_signal(&rec->more);
+	}
+	mtx_unlock(&rec->lock);
+
+	return rv;
+}
+
+int record_stats(struct record *rec, struct record_stats *stats)
+{
+	if (!rec)
+		return -1;
+
+	mtx_lock(&rec->lock);
+	stats->written = rec->written;
+	stats->dropped = rec->dropped;
+	stats->segments = rec->segments;
+	stats->error = rec->error;
+	mtx_unlock(&rec->lock);
+
+	return 0;
+}
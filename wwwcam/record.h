@@ -0,0 +1,87 @@
+#ifndef RECORD_H_INC
+#define RECORD_H_INC
+
+#include "c11threads.h"
+#include "web/http.h"
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* } */
+
+/* Frames waiting for the writer, more are dropped */
+#define RECORD_QUEUE 32
+/* Frames are collected into writes of this size */
+#define RECORD_WRITE_SIZE (1024 * 1024)
+/* Seconds between index and header updates, files are valid up to the last one */
+#define RECORD_FLUSH_SECS 5
+
+struct record_frame {
+	http_buffer_t *buf;
+	struct timeval time;
+};
+
+/* Counters of a recorder since it was opened */
+struct record_stats {
+	unsigned long written;
+	unsigned long dropped;  /* frames lost to a full queue or write errors */
+	unsigned segments;      /* files started */
+	int error;              /* writing failed, frames are dropped from then on */
+};
+
+/* MJPEG AVI recorder, frames are written by a thread of its own */
+struct record {
+	char *prefix;    /* files are <prefix>-YYYYmmdd-HHMMSS.avi */
+	int width;
+	int height;
+	unsigned fps;
+	unsigned decimate; /* one of every decimate pushed frames is recorded */
+	size_t segment_max; /* bytes per file, at most 1 GB */
+
+	mtx_t lock;
+	cnd_t more;
+	struct record_frame queue[RECORD_QUEUE];
+	unsigned head;
+	unsigned count;
+	unsigned pushed;
+	int stop;
+
+	/* Counters, under the lock */
+	unsigned long written;
+	unsigned long dropped;
+	unsigned segments;
+	int error;
+
+	/* Writer state: */
+	int fd;
+	unsigned char *wbuf;
+	size_t wlen;
+	unsigned long long flushed; /* file offset of wbuf */
+	unsigned movi_size;
+	unsigned char *index;       /* idx1 chunk, frames add their entries as they are written */
+	unsigned index_cnt;
+	unsigned index_cap;
+	unsigned max_frame;
+	time_t last_flush;
+
+	thrd_t thread;
+};
+
+/* Starts a recorder for width x height frames played at fps */
+struct record* record_open(const char *prefix, int width, int height, unsigned fps, unsigned decimate, size_t segment_max);
+/* Writes the queued frames and closes the file */
+void record_close(struct record *rec);
+
+/* Queues an encoded frame taken at *time, it is referenced, not copied. Never waits for the writer.
+ * RETURNS 0 when queued, 1 when left out by decimation, -1 when dropped */
+int record_push(struct record *rec, http_buffer_t *frame, const struct timeval *time);
+
+/* Copies the counters, they can be taken from any thread */
+int record_stats(struct record *rec, struct record_stats *stats);
+
+/* extern "C" { */
+#ifdef __cplusplus
+}
+#endif
+
+#endif
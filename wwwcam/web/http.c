@@ -2,8 +2,36 @@
 
 #include "http.h"
 #include "web.h"
+#include "../c11threads.h"
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
 
 #define PATH_MAX 256
+#define STREAM_BOUNDARY "wwwcamframe"
+/* How often parts are retried for stream clients which didn't take them at once */
+#define STREAM_RETRY_MS 5
+/* Stream clients taking none of a part for this long are closed */
+#define STREAM_PART_TIMEOUT_MS 5000
+/* long-poll clients getting no part by then are answered 304 Not Modified */
+#define STREAM_LONGPOLL_TIMEOUT_MS 30000
+/* Clients with this much still queued in the kernel skip parts until it drains */
+#define STREAM_MAX_QUEUED (128 * 1024)
+/* Blocking sends of ordinary responses making no progress this long close the connection */
+#define HTTP_SEND_TIMEOUT_MS 5000
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
 
 struct free_list_st {
     void *ptr;
@@ -12,15 +40,52 @@ struct free_list_st {
 };
 typedef struct free_list_st free_list_t;
 
+/* Per-request state comes from the worker's arena, which is reset after each request. Blocks added
+ * when the first one is full are freed then and the first one grows to the request's total, so a
+ * warmed up worker serves requests without calling malloc(). */
+#define ARENA_MIN 4096
+#define ARENA_ALIGN sizeof(void*)
+/* bodies growing past this move to the heap instead of bloating the arena for good */
+#define ARENA_BODY_MAX 65536
+#define HEADERS_MIN 8
+
+struct http_arena_block_st {
+    struct http_arena_block_st* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct http_arena_st {
+    struct http_arena_block_st* blocks;
+    size_t total;
+};
+typedef struct http_arena_st http_arena_t;
+
 struct http_context_st {
     struct wby_con* con;
     const struct wby_request* request;
+    http_arena_t* arena;
     char* body;
     size_t body_len;
+    size_t body_cap;
+    int body_heap;
     int status;
     struct wby_header* headers;
     size_t header_count;
+    size_t header_cap;
     char query_param[1024];
+    int detached;
+    http_buffer_t* shared;
+    int file;
+    long file_len;
+};
+
+struct http_buffer_st {
+    atomic_int refs;
+    size_t len;
+    size_t cap;
+    char data[];
 };
 
 struct http_handler_st {
@@ -31,14 +96,117 @@ struct http_handler_st {
 };
 typedef struct http_handler_st http_handler_t;
 
+/* Stream clients are detached from webby and written without blocking.
+ * A part is sent as the client's own header, the shared data and a trailer.
+ * Clients get the newest part or none: one still busy with a part, or with a
+ * backlog in the kernel, skips new ones, and one past its deadline is closed.
+ * The deadline moves on whenever the client takes more, so only stalled clients are closed.
+ * WebSocket clients are expected to stay silent, anything they send closes them.
+ * Long-poll clients get one part newer than theirs as a whole response and are closed after it,
+ * waiting ones have no part and the deadline of the 304 answer. */
+struct http_stream_client_st {
+    wby_socket socket;
+    http_buffer_t* part;
+    char head[320];
+    size_t head_len;
+    size_t tail_len;
+    size_t pending_pos;
+    long long deadline;
+    int queued;
+    int last;
+    unsigned after;
+};
+typedef struct http_stream_client_st http_stream_client_t;
+
+/* Clients are added by server threads and parts pushed from any thread, both under the lock */
+struct http_stream_st {
+    char* path;
+    int websocket;
+    int longpoll;
+    char* content_type;
+    mtx_t lock;
+    http_stream_client_t* clients;
+    size_t client_count;
+    unsigned long sent;
+    unsigned long skipped;
+    unsigned long evicted;
+    /* long-poll streams keep their last part, handed to clients waiting for an older one */
+    http_buffer_t* last_part;
+    unsigned last_seq;
+    http_buffer_t* empty;
+    struct http_server_st* srv;
+    struct http_stream_st* next;
+};
+
+/* Routes are compiled by http_server_start() into a case-insensitive trie walked along the URI.
+ * A route matches every URI it is a prefix of and the first registered one wins, a '*' inside it
+ * matches one path segment and a trailing one anything. The routes' own paths are also hashed
+ * with the handler the walk finds for them, so exact requests take no walk at all. */
+struct http_route_node_st {
+    unsigned char c;
+    int child;
+    int sibling;
+    int handler;
+};
+
+struct http_route_exact_st {
+    unsigned hash;
+    const char* path;
+    int handler;
+};
+
+struct http_routes_st {
+    struct http_route_node_st* nodes;
+    size_t node_count;
+    struct http_route_exact_st* exact;
+    size_t exact_size;
+};
+typedef struct http_routes_st http_routes_t;
+
+/* Access log lines are queued by server threads and written by a thread of their own, so a slow
+ * terminal or disk never holds up requests. Past rate lines a second they are only counted. */
+#define LOG_BUFFER_SIZE 16384
+
+struct http_log_st {
+    FILE* out;
+    unsigned rate;
+    mtx_t lock;
+    cnd_t cond;
+    thrd_t thread;
+    int running;
+    int stop;
+    char* buf[2];
+    size_t len;
+    time_t second;
+    unsigned count;
+    unsigned dropped;
+};
+typedef struct http_log_st http_log_t;
+
+/* A webby server with its own listening socket, connections and, with threads, its own thread */
+struct http_worker_st {
+    struct http_server_st* srv;
+    struct wby_server server;
+    void* memory;
+    http_arena_t arena;
+    thrd_t thread;
+    int started;
+};
+typedef struct http_worker_st http_worker_t;
+
 struct http_server_st {
     http_handler_t* handlers;
     size_t handler_count;
+    http_routes_t routes[2];
+    http_log_t log;
     struct wby_config config;
-    struct wby_server server;
-    void *srv_memory;
+    http_worker_t* workers;
+    unsigned worker_count;
+    unsigned threads;
+    atomic_int stopping;
     char* addr;
     free_list_t* atexit;
+    http_stream_t* streams;
 };
 
 static void free_list_free(free_list_t* lst)
@@ -52,28 +220,66 @@ static void free_list_free(free_list_t* lst)
     }
 }
 
+static void stream_free(http_stream_t* stream);
+static void routes_free(http_routes_t* routes);
+static void arena_free(http_arena_t* arena);
+static void log_free(http_log_t* log);
+
 #define HTTP_SERVER_FREE(srv) \
     do { \
         if (srv) { \
+            routes_free(&srv->routes[0]); \
+            routes_free(&srv->routes[1]); \
+            log_free(&srv->log); \
+            while (srv->streams) { \
+                http_stream_t* next = srv->streams->next; \
+                stream_free(srv->streams); \
+                srv->streams = next; \
+            } \
             free_list_free(srv->atexit); \
             free(srv->addr); \
-            free(srv->srv_memory); \
+            for (unsigned w = 0; w < srv->worker_count; ++w) { \
+                free(srv->workers[w].memory); \
+                arena_free(&srv->workers[w].arena); \
+            } \
+            free(srv->workers); \
             free(srv->handlers); \
             free(srv); \
         } \
     } while (0)
 
 static int http_dispatch(struct wby_con *connection, void *pArg);
+static int websocket_connect(struct wby_con *connection, void *pArg);
+static void websocket_connected(struct wby_con *connection, void *pArg);
+static int websocket_frame(struct wby_con *connection, const struct wby_frame *frame, void *pArg);
+static void websocket_closed(struct wby_con *connection, void *pArg);
 http_server_t* http_server_new(const char* addr, int port)
 {
     http_server_t* ctx;
-    size_t needed_memory;
 
     ctx = (http_server_t*)calloc(1, sizeof(http_server_t));
     if (!ctx) {
         return NULL;
     }
 
+    ctx->log.out = stdout;
+    ctx->log.buf[0] = (char*)malloc(LOG_BUFFER_SIZE);
+    ctx->log.buf[1] = (char*)malloc(LOG_BUFFER_SIZE);
+    if (!ctx->log.buf[0] || !ctx->log.buf[1] ||
+        mtx_init(&ctx->log.lock, mtx_plain) != thrd_success) {
+        free(ctx->log.buf[0]);
+        free(ctx->log.buf[1]);
+        free(ctx);
+        return NULL;
+    }
+    if (cnd_init(&ctx->log.cond) != thrd_success) {
+        mtx_destroy(&ctx->log.lock);
+        free(ctx->log.buf[0]);
+        free(ctx->log.buf[1]);
+        free(ctx);
+        return NULL;
+    }
+
     if (!addr) {
         ctx->addr = strdup("0.0.0.0");
     } else {
@@ -87,333 +293,961 @@ http_server_t* http_server_new(const char* addr, int port)
     /* setup config */
     ctx->config.address = ctx->addr;
     ctx->config.port = port;
+#ifdef WBY_USE_EPOLL
+    ctx->config.connection_max = 256;
+#else
     ctx->config.connection_max = 32;
+#endif
     ctx->config.request_buffer_size = 8192;
     ctx->config.io_buffer_size = 16384;
+    ctx->config.send_timeout_ms = HTTP_SEND_TIMEOUT_MS;
     ctx->config.dispatch = http_dispatch;
-    ctx->config.userdata = ctx;
-    // ctx->config.ws_connect = websocket_connect;
-    // ctx->config.ws_connected = websocket_connected;
-    // ctx->config.ws_frame = websocket_frame;
-    // ctx->config.ws_closed = websocket_closed;
-
-    /* compute and allocate needed memory and start server */
-    wby_init(&ctx->server, &ctx->config, &needed_memory);
-    ctx->srv_memory = calloc(needed_memory, 1);
-    if (!ctx->srv_memory) {
-        HTTP_SERVER_FREE(ctx);
-        return NULL;
-    }
+    ctx->config.ws_connect = websocket_connect;
+    ctx->config.ws_connected = websocket_connected;
+    ctx->config.ws_frame = websocket_frame;
+    ctx->config.ws_closed = websocket_closed;
 
     return ctx;
 }
 
-int http_server_start(http_server_t* srv)
+int http_server_threads(http_server_t* srv, unsigned n)
 {
-    return wby_start(&srv->server, srv->srv_memory);
-}
+    if (srv->workers) {
+        return -1;
+    }
 
-int http_server_update(http_server_t* srv)
-{
-    wby_update(&srv->server);
+    srv->threads = n;
     return 0;
 }
 
-int http_server_stop(http_server_t* srv)
+int http_server_log(http_server_t* srv, FILE* out, unsigned rate)
 {
-    wby_stop(&srv->server);
+    if (srv->workers) {
+        return -1;
+    }
 
+    srv->log.out = out;
+    srv->log.rate = rate;
     return 0;
 }
 
-void http_server_free(http_server_t* srv)
+static void http_log(http_server_t* srv, const char* fmt, ...)
 {
-    HTTP_SERVER_FREE(srv);
-}
+    http_log_t* log = &srv->log;
+    time_t now;
+    va_list ap;
+    int len;
 
-int http_server_atexit(http_server_t* srv, void (*action)(void*), void* ptr)
-{
-    free_list_t* p = (free_list_t*)calloc(sizeof(free_list_t), 1);
-    if (!p) {
-        return -1;
+    if (!log->out) {
+        return;
     }
-    p->ptr = ptr;
-    p->action = action;
-    p->next = srv->atexit;
-    srv->atexit = p;
 
-    return 0;
+    now = time(NULL);
+    mtx_lock(&log->lock);
+    if (now != log->second) {
+        log->second = now;
+        log->count = 0;
+    }
+    if (log->rate && log->count >= log->rate) {
+        ++log->dropped;
+        mtx_unlock(&log->lock);
+        return;
+    }
+
+    va_start(ap, fmt);
+    len = vsnprintf(log->buf[0] + log->len, LOG_BUFFER_SIZE - log->len, fmt, ap);
+    va_end(ap);
+    if (len < 0 || log->len + len >= LOG_BUFFER_SIZE) {
+        ++log->dropped;
+    } else {
+        log->len += len;
+        ++log->count;
+        cnd_signal(&log->cond);
+    }
+    mtx_unlock(&log->lock);
 }
 
-static int resp_init(http_context_t* ctx, struct wby_con* con)
+static int log_main(void* arg)
 {
-    ctx->con = con;
-    ctx->request = &con->request;
-    ctx->status = 200;
+    http_log_t* log = (http_log_t*)arg;
 
-    ctx->body = NULL;
-    ctx->body_len = 0;
-    ctx->headers = (struct wby_header*)calloc(1, sizeof(struct wby_header));
-    if (!ctx->headers) {
-        return -1;
-    }
+    mtx_lock(&log->lock);
+    while (!log->stop || log->len || log->dropped) {
+        char* buf;
+        size_t len;
+        unsigned dropped;
 
-    ctx->headers[0].name = strdup("content-type");
-    if (!ctx->headers[0].name) {
-        free(ctx->headers);
-        return -1;
-    }
+        if (!log->len && !log->stop) {
+            cnd_wait(&log->cond, &log->lock);
+            continue;
+        }
 
-    ctx->headers[0].value = strdup("text/html");
-    if (!ctx->headers[0].value) {
-        free((char*)ctx->headers[0].name);
-        free(ctx->headers);
-        return -1;
+        buf = log->buf[0];
+        len = log->len;
+        dropped = log->dropped;
+        log->buf[0] = log->buf[1];
+        log->buf[1] = buf;
+        log->len = 0;
+        log->dropped = 0;
+        mtx_unlock(&log->lock);
+
+        fwrite(buf, 1, len, log->out);
+        if (dropped) {
+            fprintf(log->out, "... %u requests not logged\n", dropped);
+        }
+        fflush(log->out);
+
+        mtx_lock(&log->lock);
     }
-    ctx->header_count = 1;
+    mtx_unlock(&log->lock);
 
     return 0;
 }
 
-static void resp_free(http_context_t* ctx)
+static void log_stop(http_log_t* log)
 {
-    for (size_t i = 0; i < ctx->header_count; ++i) {
-        free((char*)ctx->headers[i].name);
-        free((char*)ctx->headers[i].value);
+    if (!log->running) {
+        return;
     }
-    free(ctx->body);
+
+    mtx_lock(&log->lock);
+    log->stop = 1;
+    cnd_signal(&log->cond);
+    mtx_unlock(&log->lock);
+    thrd_join(log->thread, NULL);
+    log->running = 0;
+    log->stop = 0;
 }
 
-int http_write(http_context_t* ctx, const void* ptr, int len)
+static void log_free(http_log_t* log)
 {
-    if (len < 0) {
-        len = strlen((const char*)ptr);
-    }
+    log_stop(log);
+    cnd_destroy(&log->cond);
+    mtx_destroy(&log->lock);
+    free(log->buf[0]);
+    free(log->buf[1]);
+}
 
-    if (ctx->body) {
-        void* tmp = realloc(ctx->body, ctx->body_len + len);
-        if (!tmp) {
-            return -1;
-        }
-        ctx->body = (char*)tmp;
-    } else {
-        ctx->body = (char*)malloc(len);
-        if (!ctx->body) {
-            return -1;
-        }
-    }
+static unsigned route_hash(const char* path)
+{
+    unsigned hash = 2166136261u;
 
-    memcpy(ctx->body + ctx->body_len, ptr, len);
-    ctx->body_len += len;
+    for (; *path; ++path) {
+        hash = (hash ^ (unsigned char)tolower((unsigned char)*path)) * 16777619u;
+    }
 
-    return len;
+    return hash;
 }
 
-const char* http_get_header(http_context_t* ctx, const char* name)
+static void routes_free(http_routes_t* routes)
 {
-    return wby_find_header(ctx->con, name);
+    free(routes->nodes);
+    free(routes->exact);
+    memset(routes, 0, sizeof(*routes));
 }
 
-const char* http_get_query_var(http_context_t* ctx, const char* name)
+static int route_node_new(http_routes_t* routes, unsigned char c)
 {
-    int r = wby_find_query_var(ctx->request->query_params, name, ctx->query_param, sizeof(ctx->query_param));
-    if (r < 0) {
-        return NULL;
+    void* tmp = realloc(routes->nodes, (routes->node_count + 1) * sizeof(struct http_route_node_st));
+    if (!tmp) {
+        return -1;
     }
+    routes->nodes = (struct http_route_node_st*)tmp;
 
-    if (r < (int)sizeof(ctx->query_param)) {
-        ctx->query_param[r] = 0;
-    } else {
-        ctx->query_param[sizeof(ctx->query_param) - 1] = 0;
-    }
+    routes->nodes[routes->node_count].c = c;
+    routes->nodes[routes->node_count].child = -1;
+    routes->nodes[routes->node_count].sibling = -1;
+    routes->nodes[routes->node_count].handler = -1;
 
-    return ctx->query_param;
+    return (int)routes->node_count++;
 }
 
-int http_set_header(http_context_t* ctx, const char* name, const char* value)
+static int route_insert(http_routes_t* routes, const char* path, int handler)
 {
-    // Search for the header:
-    for (size_t i = 0; i < ctx->header_count; ++i) {
-        if (strcasecmp(ctx->headers[i].name, name) == 0) {
-            char* val = strdup(value);
-            if (!val) {
+    int node = 0;
+    size_t len = strlen(path);
+
+    /* a trailing '*' says what every route does anyway */
+    if (len > 0 && path[len - 1] == '*') {
+        --len;
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)tolower((unsigned char)path[i]);
+        int child;
+
+        for (child = routes->nodes[node].child; child >= 0; child = routes->nodes[child].sibling) {
+            if (routes->nodes[child].c == c) {
+                break;
+            }
+        }
+        if (child < 0) {
+            child = route_node_new(routes, c);
+            if (child < 0) {
                 return -1;
             }
-            ctx->headers[i].value = val;
-            return 0;
+            routes->nodes[child].sibling = routes->nodes[node].child;
+            routes->nodes[node].child = child;
         }
+        node = child;
     }
 
-    void *tmp = realloc(ctx->headers, (ctx->header_count + 1) * sizeof(struct wby_header));
-    if (!tmp) {
-        return -1;
-    }
-    ctx->headers = (struct wby_header*)tmp;
-
-    ctx->headers[ctx->header_count].name = strdup(name);
-    if (!ctx->headers[ctx->header_count].name) {
-        return -1;
+    if (routes->nodes[node].handler < 0 || handler < routes->nodes[node].handler) {
+        routes->nodes[node].handler = handler;
     }
-    ctx->headers[ctx->header_count].value = strdup(value);
-    if (!ctx->headers[ctx->header_count].value) {
-        free((char*)ctx->headers[ctx->header_count].name);
-        return -1;
-    }
-    ++ctx->header_count;
 
     return 0;
 }
 
-static int http_dispatch(struct wby_con *connection, void *pArg)
+/* Returns the first registered handler among the ones whose routes the URI starts with, -1 if none */
+static int route_walk(const http_routes_t* routes, int node, const char* uri)
 {
-    http_server_t* srv = (http_server_t*)pArg;
-    http_handler_t* handlers = srv->handlers;
-    http_context_t resp;
-    char* body = NULL;
-    int body_len = 0;
-    int post = 0;
-    int rv = 0;
+    int best = routes->nodes[node].handler;
 
-    printf("%s %s\n", connection->request.method, connection->request.uri);
+    for (int child = routes->nodes[node].child; child >= 0; child = routes->nodes[child].sibling) {
+        const char* next = uri;
+        int h;
 
-    if (strcasecmp(connection->request.method, "GET") == 0) {
-        post = 0;
-    } else if (strcasecmp(connection->request.method, "POST") == 0) {
-        post = 1;
-    } else {
-        const char* err = "unsupported method";
-        struct wby_header ctype;
-        ctype.name = "content-type";
-        ctype.value = "text/plain";
-        wby_response_begin(connection, 400, strlen(err), &ctype, 1);
-        wby_write(connection, err, strlen(err));
-        wby_response_end(connection);
+        if (routes->nodes[child].c == '*') {
+            while (*next && *next != '/') {
+                ++next;
+            }
+        } else if (*next && routes->nodes[child].c == (unsigned char)tolower((unsigned char)*next)) {
+            ++next;
+        } else {
+            continue;
+        }
 
-        return 0;
+        h = route_walk(routes, child, next);
+        if (h >= 0 && (best < 0 || h < best)) {
+            best = h;
+        }
     }
 
-    int match_idx = -1;
-    for (size_t i = 0; i < srv->handler_count; ++i) {
-        size_t l = strlen(handlers[i].path);
-        if (strncasecmp(handlers[i].path, connection->request.uri, l) == 0) {
-            if (post && handlers[i].post) {
-                match_idx = i;
-                break;
-            }
+    return best;
+}
 
-            if (!post && handlers[i].get) {
-                match_idx = i;
-                break;
+static int route_find(const http_routes_t* routes, const char* uri)
+{
+    if (!routes->nodes) {
+        return -1;
+    }
+
+    if (routes->exact_size) {
+        unsigned hash = route_hash(uri);
+
+        for (size_t i = hash & (routes->exact_size - 1); routes->exact[i].path; i = (i + 1) & (routes->exact_size - 1)) {
+            if (routes->exact[i].hash == hash && strcasecmp(routes->exact[i].path, uri) == 0) {
+                return routes->exact[i].handler;
             }
         }
     }
 
-    if (match_idx < 0) {
-        const char* err = "Not found";
-        struct wby_header ctype;
-        ctype.name = "content-type";
-        ctype.value = "text/plain";
-        wby_response_begin(connection, 404, strlen(err), &ctype, 1);
-        wby_write(connection, err, strlen(err));
-        wby_response_end(connection);
+    return route_walk(routes, 0, uri);
+}
 
-        return 0;
+/* Compiles the GET (post = 0) or POST routes */
+static int routes_build(http_server_t* srv, int post)
+{
+    http_routes_t* routes = &srv->routes[post];
+    size_t count = 0;
+
+    routes_free(routes);
+    if (route_node_new(routes, 0) < 0) {
+        return -1;
     }
 
-    if (post && connection->request.content_length > 0) {
-        body = malloc(connection->request.content_length);
-        if (!body) {
-            return -1;
+    for (size_t i = 0; i < srv->handler_count; ++i) {
+        if (post ? !srv->handlers[i].post : !srv->handlers[i].get) {
+            continue;
         }
-        body_len = connection->request.content_length;
-
-        for (int pos = 0; pos < connection->request.content_length;) {
-            int l = wby_read(connection, body + pos, connection->request.content_length - pos);
-            if (l <= 0) {
-                free(body);
-                return -1;
-            }
-
-            pos += l;
+        if (route_insert(routes, srv->handlers[i].path, (int)i) < 0) {
+            routes_free(routes);
+            return -1;
         }
+        ++count;
     }
 
-    if (resp_init(&resp, connection) < 0) {
-        free(body);
+    for (routes->exact_size = 1; routes->exact_size < count * 2; routes->exact_size *= 2) {
+    }
+    routes->exact = (struct http_route_exact_st*)calloc(routes->exact_size, sizeof(struct http_route_exact_st));
+    if (!routes->exact) {
+        routes_free(routes);
         return -1;
     }
 
-    if (post) {
-        rv = handlers[match_idx].post(&resp, body, body_len, handlers[match_idx].ctx);
-    } else {
-        rv = handlers[match_idx].get(&resp, handlers[match_idx].ctx);
+    for (size_t i = 0; i < srv->handler_count; ++i) {
+        const char* path = srv->handlers[i].path;
+        unsigned hash;
+        size_t j;
+
+        if ((post ? !srv->handlers[i].post : !srv->handlers[i].get) || strchr(path, '*')) {
+            continue;
+        }
+
+        hash = route_hash(path);
+        for (j = hash & (routes->exact_size - 1); routes->exact[j].path; j = (j + 1) & (routes->exact_size - 1)) {
+            if (strcasecmp(routes->exact[j].path, path) == 0) {
+                break;
+            }
+        }
+        routes->exact[j].hash = hash;
+        routes->exact[j].path = path;
+        routes->exact[j].handler = route_walk(routes, 0, path);
     }
-    free(body);
-    if (rv < 0) {
-        resp_free(&resp);
-        return -1;
+
+    return 0;
+}
+
+static int stream_update(http_stream_t* stream, int timeout_ms);
+
+/* Detached stream clients are not watched, so the first worker wakes up to retry their parts
+ * and to answer long-poll clients past their deadline */
+static void worker_update(http_worker_t* worker, int timeout_ms)
+{
+    if (worker == worker->srv->workers) {
+        for (http_stream_t* stream = worker->srv->streams; stream; stream = stream->next) {
+            timeout_ms = stream_update(stream, timeout_ms);
+        }
     }
 
-    wby_response_begin(connection, resp.status, resp.body_len, resp.headers, resp.header_count);
-    wby_write(connection, resp.body, resp.body_len);
-    wby_response_end(connection);
-    resp_free(&resp);
+    wby_update_wait(&worker->server, timeout_ms);
+}
+
+static int worker_main(void* arg)
+{
+    http_worker_t* worker = (http_worker_t*)arg;
+
+    while (!atomic_load(&worker->srv->stopping)) {
+        worker_update(worker, -1);
+    }
 
     return 0;
 }
 
-static int add_handler(http_server_t* srv, const char* path, void* ctx)
+int http_server_start(http_server_t* srv)
 {
-    void *tmp = realloc(srv->handlers, (srv->handler_count + 1) * sizeof(http_handler_t));
-    if (!tmp) {
+    unsigned count = srv->threads ? srv->threads : 1;
+
+    if (srv->workers) {
         return -1;
     }
-    srv->handlers = (http_handler_t*)(tmp);
 
-    srv->handlers[srv->handler_count].path = strdup(path);
-    if (!srv->handlers[srv->handler_count].path) {
+    if (routes_build(srv, 0) < 0 || routes_build(srv, 1) < 0) {
         return -1;
     }
-    srv->handlers[srv->handler_count].ctx = ctx;
-    ++srv->handler_count;
+
+    if (srv->log.out && !srv->log.running) {
+        if (thrd_create(&srv->log.thread, log_main, &srv->log) != thrd_success) {
+            return -1;
+        }
+        srv->log.running = 1;
+    }
+
+    srv->workers = (http_worker_t*)calloc(count, sizeof(http_worker_t));
+    if (!srv->workers) {
+        return -1;
+    }
+    srv->worker_count = count;
+    atomic_init(&srv->stopping, 0);
+    srv->config.reuse_port = count > 1;
+
+    for (unsigned i = 0; i < count; ++i) {
+        http_worker_t* worker = &srv->workers[i];
+        size_t needed_memory;
+
+        /* compute and allocate needed memory and start server */
+        worker->srv = srv;
+        wby_init(&worker->server, &srv->config, &needed_memory);
+        worker->server.config.userdata = worker;
+        worker->memory = calloc(needed_memory, 1);
+        if (!worker->memory || wby_start(&worker->server, worker->memory) != 0) {
+            http_server_stop(srv);
+            return -1;
+        }
+        worker->started = 1;
+
+        if (srv->threads && thrd_create(&worker->thread, worker_main, worker) != thrd_success) {
+            wby_stop(&worker->server);
+            worker->started = 0;
+            http_server_stop(srv);
+            return -1;
+        }
+    }
 
     return 0;
 }
 
-int http_set_status(http_context_t* ctx, int status)
+int http_server_update(http_server_t* srv)
 {
-    ctx->status = status;
-    return 0;
+    return http_server_wait(srv, 0);
 }
 
-int http_server_get(http_server_t* srv, const char* path, int (*get)(http_context_t*, void*), void* ctx)
+int http_server_wait(http_server_t* srv, int timeout_ms)
 {
-    if (add_handler(srv, path, ctx) < 0) {
+    if (!srv->workers || srv->threads) {
         return -1;
     }
 
-    srv->handlers[srv->handler_count - 1].get = get;
-
+    worker_update(srv->workers, timeout_ms);
+#ifdef WBY_USE_EPOLL
+    return srv->workers->server.watch_ready;
+#else
     return 0;
+#endif
 }
 
-int http_server_post(http_server_t* srv, const char* path, int (*post)(http_context_t*, const void*, size_t, void*), void* ctx)
+int http_server_watch(http_server_t* srv, int fd)
 {
-    if (add_handler(srv, path, ctx) < 0) {
+    if (!srv->workers || srv->threads) {
         return -1;
     }
 
-    srv->handlers[srv->handler_count - 1].post = post;
-
-    return 0;
+    return wby_watch(&srv->workers->server, fd);
 }
 
+int http_server_wakeup(http_server_t* srv)
+{
+    for (unsigned i = 0; i < srv->worker_count; ++i) {
+        if (srv->workers[i].started) {
+            wby_wakeup(&srv->workers[i].server);
+        }
+    }
+    return 0;
+}
+
+int http_server_stop(http_server_t* srv)
+{
+    atomic_store(&srv->stopping, 1);
+    http_server_wakeup(srv);
+
+    for (unsigned i = 0; i < srv->worker_count; ++i) {
+        http_worker_t* worker = &srv->workers[i];
+        if (worker->started) {
+            if (srv->threads) {
+                thrd_join(worker->thread, NULL);
+            }
+            wby_stop(&worker->server);
+            worker->started = 0;
+        }
+    }
+    log_stop(&srv->log);
+
+    return 0;
+}
+
+void http_server_free(http_server_t* srv)
+{
+    HTTP_SERVER_FREE(srv);
+}
+
+int http_server_atexit(http_server_t* srv, void (*action)(void*), void* ptr)
+{
+    free_list_t* p = (free_list_t*)calloc(sizeof(free_list_t), 1);
+    if (!p) {
+        return -1;
+    }
+    p->ptr = ptr;
+    p->action = action;
+    p->next = srv->atexit;
+    srv->atexit = p;
+
+    return 0;
+}
+
+static void* arena_alloc(http_arena_t* arena, size_t size)
+{
+    struct http_arena_block_st* block = arena->blocks;
+    void* ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    arena->total += size;
+
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > ARENA_MIN ? size : ARENA_MIN;
+
+        block = (struct http_arena_block_st*)malloc(sizeof(struct http_arena_block_st) + block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    ptr = block->data + block->used;
+    block->used += size;
+
+    return ptr;
+}
+
+static char* arena_strdup(http_arena_t* arena, const char* str)
+{
+    size_t len = strlen(str) + 1;
+    char* copy = (char*)arena_alloc(arena, len);
+
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+
+    return copy;
+}
+
+static void arena_free(http_arena_t* arena)
+{
+    while (arena->blocks) {
+        struct http_arena_block_st* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->total = 0;
+}
+
+static void arena_reset(http_arena_t* arena)
+{
+    if (arena->blocks && arena->blocks->next) {
+        size_t total = arena->total;
+
+        arena_free(arena);
+        arena_alloc(arena, total);
+    }
+
+    if (arena->blocks) {
+        arena->blocks->used = 0;
+    }
+    arena->total = 0;
+}
+
+/* Header names used by the server and wwwcam are not copied */
+static const char* const HEADER_NAMES[] = {
+    "content-type", "content-encoding", "cache-control", "etag", "vary",
+    "date", "accept-ranges", "last-modified", "location", "connection"
+};
+
+static const char* header_name(http_arena_t* arena, const char* name)
+{
+    for (size_t i = 0; i < sizeof(HEADER_NAMES) / sizeof(HEADER_NAMES[0]); ++i) {
+        if (strcasecmp(HEADER_NAMES[i], name) == 0) {
+            return HEADER_NAMES[i];
+        }
+    }
+
+    return arena_strdup(arena, name);
+}
+
+static int resp_init(http_context_t* ctx, struct wby_con* con, http_arena_t* arena)
+{
+    ctx->con = con;
+    ctx->request = &con->request;
+    ctx->arena = arena;
+    ctx->status = 200;
+
+    ctx->body = NULL;
+    ctx->body_len = 0;
+    ctx->body_cap = 0;
+    ctx->body_heap = 0;
+    ctx->detached = 0;
+    ctx->shared = NULL;
+    ctx->file = -1;
+    ctx->file_len = 0;
+    ctx->headers = (struct wby_header*)arena_alloc(arena, HEADERS_MIN * sizeof(struct wby_header));
+    if (!ctx->headers) {
+        return -1;
+    }
+    ctx->header_cap = HEADERS_MIN;
+
+    ctx->headers[0].name = "content-type";
+    ctx->headers[0].value = "text/html";
+    ctx->header_count = 1;
+
+    return 0;
+}
+
+static void resp_free(http_context_t* ctx)
+{
+    if (ctx->body_heap) {
+        free(ctx->body);
+    }
+    http_buffer_release(ctx->shared);
+    if (ctx->file >= 0) {
+        close(ctx->file);
+    }
+    arena_reset(ctx->arena);
+}
+
+http_buffer_t* http_buffer_new(const void* ptr, size_t len)
+{
+    http_buffer_t* buf = (http_buffer_t*)malloc(sizeof(http_buffer_t) + len);
+    if (!buf) {
+        return NULL;
+    }
+
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+    buf->cap = len;
+    memcpy(buf->data, ptr, len);
+
+    return buf;
+}
+
+http_buffer_t* http_buffer_alloc(size_t cap)
+{
+    http_buffer_t* buf = (http_buffer_t*)malloc(sizeof(http_buffer_t) + cap);
+    if (!buf) {
+        return NULL;
+    }
+
+    atomic_init(&buf->refs, 1);
+    buf->len = 0;
+    buf->cap = cap;
+
+    return buf;
+}
+
+http_buffer_t* http_buffer_ref(http_buffer_t* buf)
+{
+    if (buf) {
+        atomic_fetch_add(&buf->refs, 1);
+    }
+
+    return buf;
+}
+
+void http_buffer_release(http_buffer_t* buf)
+{
+    if (buf && atomic_fetch_sub(&buf->refs, 1) == 1) {
+        free(buf);
+    }
+}
+
+const void* http_buffer_data(const http_buffer_t* buf)
+{
+    return buf->data;
+}
+
+size_t http_buffer_size(const http_buffer_t* buf)
+{
+    return buf->len;
+}
+
+void* http_buffer_payload(http_buffer_t* buf)
+{
+    return buf->data;
+}
+
+size_t http_buffer_capacity(const http_buffer_t* buf)
+{
+    return buf->cap;
+}
+
+void http_buffer_set_size(http_buffer_t* buf, size_t len)
+{
+    buf->len = len < buf->cap ? len : buf->cap;
+}
+
+int http_buffer_unique(http_buffer_t* buf)
+{
+    return atomic_load(&buf->refs) == 1;
+}
+
+int http_write_shared(http_context_t* ctx, http_buffer_t* buf)
+{
+    if (ctx->shared) {
+        return -1;
+    }
+
+    ctx->shared = http_buffer_ref(buf);
+
+    return (int)buf->len;
+}
+
+int http_write(http_context_t* ctx, const void* ptr, int len)
+{
+    if (len < 0) {
+        len = strlen((const char*)ptr);
+    }
+
+    if (ctx->body_len + len > ctx->body_cap) {
+        size_t cap = ctx->body_cap ? ctx->body_cap * 2 : 1024;
+        char* body;
+
+        while (cap < ctx->body_len + len) {
+            cap *= 2;
+        }
+
+        if (cap > ARENA_BODY_MAX) {
+            body = (char*)(ctx->body_heap ? realloc(ctx->body, cap) : malloc(cap));
+            if (!body) {
+                return -1;
+            }
+            if (!ctx->body_heap && ctx->body_len) {
+                memcpy(body, ctx->body, ctx->body_len);
+            }
+            ctx->body_heap = 1;
+        } else {
+            body = (char*)arena_alloc(ctx->arena, cap);
+            if (!body) {
+                return -1;
+            }
+            if (ctx->body_len) {
+                memcpy(body, ctx->body, ctx->body_len);
+            }
+        }
+        ctx->body = body;
+        ctx->body_cap = cap;
+    }
+
+    memcpy(ctx->body + ctx->body_len, ptr, len);
+    ctx->body_len += len;
+
+    return len;
+}
+
+const char* http_get_header(http_context_t* ctx, const char* name)
+{
+    return wby_find_header(ctx->con, name);
+}
+
+const char* http_get_query_var(http_context_t* ctx, const char* name)
+{
+    int r;
+
+    /* requests without a query string have none */
+    if (!ctx->request->query_params) {
+        return NULL;
+    }
+
+    r = wby_find_query_var(ctx->request->query_params, name, ctx->query_param, sizeof(ctx->query_param));
+    if (r < 0) {
+        return NULL;
+    }
+
+    if (r < (int)sizeof(ctx->query_param)) {
+        ctx->query_param[r] = 0;
+    } else {
+        ctx->query_param[sizeof(ctx->query_param) - 1] = 0;
+    }
+
+    return ctx->query_param;
+}
+
+int http_set_header(http_context_t* ctx, const char* name, const char* value)
+{
+    // Search for the header:
+    for (size_t i = 0; i < ctx->header_count; ++i) {
+        if (strcasecmp(ctx->headers[i].name, name) == 0) {
+            char* val = arena_strdup(ctx->arena, value);
+            if (!val) {
+                return -1;
+            }
+            ctx->headers[i].value = val;
+            return 0;
+        }
+    }
+
+    if (ctx->header_count == ctx->header_cap) {
+        struct wby_header* tmp = (struct wby_header*)arena_alloc(ctx->arena, ctx->header_cap * 2 * sizeof(struct wby_header));
+        if (!tmp) {
+            return -1;
+        }
+        memcpy(tmp, ctx->headers, ctx->header_count * sizeof(struct wby_header));
+        ctx->headers = tmp;
+        ctx->header_cap *= 2;
+    }
+
+    ctx->headers[ctx->header_count].name = header_name(ctx->arena, name);
+    ctx->headers[ctx->header_count].value = arena_strdup(ctx->arena, value);
+    if (!ctx->headers[ctx->header_count].name || !ctx->headers[ctx->header_count].value) {
+        return -1;
+    }
+    ++ctx->header_count;
+
+    return 0;
+}
+
+/* Sends the file after the rest of the response, without copying it where sendfile() exists */
+static int send_file(struct wby_con* connection, int fd, long len)
+{
+#ifdef WBY_USE_SENDFILE
+    return wby_sendfile(connection, fd, 0, (int)len) == WBY_OK ? 0 : -1;
+#else
+    char buf[4096];
+
+    while (len > 0) {
+        long l = read(fd, buf, len < (long)sizeof(buf) ? len : (long)sizeof(buf));
+        if (l <= 0 || wby_write(connection, buf, l) != WBY_OK) {
+            return -1;
+        }
+        len -= l;
+    }
+
+    return 0;
+#endif
+}
+
+static int http_dispatch(struct wby_con *connection, void *pArg)
+{
+    http_worker_t* worker = (http_worker_t*)pArg;
+    http_server_t* srv = worker->srv;
+    http_handler_t* handlers = srv->handlers;
+    http_context_t resp;
+    char* body = NULL;
+    int body_len = 0;
+    int post = 0;
+    int rv = 0;
+
+    http_log(srv, "%s %s\n", connection->request.method, connection->request.uri);
+
+    if (strcasecmp(connection->request.method, "GET") == 0) {
+        post = 0;
+    } else if (strcasecmp(connection->request.method, "POST") == 0) {
+        post = 1;
+    } else {
+        const char* err = "unsupported method";
+        struct wby_header ctype;
+        ctype.name = "content-type";
+        ctype.value = "text/plain";
+        wby_response_begin(connection, 400, strlen(err), &ctype, 1);
+        wby_write(connection, err, strlen(err));
+        wby_response_end(connection);
+
+        return 0;
+    }
+
+    int match_idx = route_find(&srv->routes[post], connection->request.uri);
+
+    if (match_idx < 0) {
+        const char* err = "Not found";
+        struct wby_header ctype;
+        ctype.name = "content-type";
+        ctype.value = "text/plain";
+        wby_response_begin(connection, 404, strlen(err), &ctype, 1);
+        wby_write(connection, err, strlen(err));
+        wby_response_end(connection);
+
+        return 0;
+    }
+
+    if (post && connection->request.content_length > 0) {
+        body = malloc(connection->request.content_length);
+        if (!body) {
+            return -1;
+        }
+        body_len = connection->request.content_length;
+
+        for (int pos = 0; pos < connection->request.content_length;) {
+            int l = wby_read(connection, body + pos, connection->request.content_length - pos);
+            if (l <= 0) {
+                free(body);
+                return -1;
+            }
+
+            pos += l;
+        }
+    }
+
+    if (resp_init(&resp, connection, &worker->arena) < 0) {
+        arena_reset(&worker->arena);
+        free(body);
+        return -1;
+    }
+
+    if (post) {
+        rv = handlers[match_idx].post(&resp, body, body_len, handlers[match_idx].ctx);
+    } else {
+        rv = handlers[match_idx].get(&resp, handlers[match_idx].ctx);
+    }
+    free(body);
+    if (resp.detached) {
+        resp_free(&resp);
+        return 0;
+    }
+    if (rv < 0) {
+        resp_free(&resp);
+        return -1;
+    }
+
+    wby_response_begin(connection, resp.status, resp.body_len + (resp.shared ? resp.shared->len : 0) + resp.file_len, resp.headers, resp.header_count);
+    if (resp.body_len > 0) {
+        wby_write(connection, resp.body, resp.body_len);
+    }
+    if (resp.shared) {
+        wby_write(connection, resp.shared->data, resp.shared->len);
+    }
+    if (resp.file >= 0 && send_file(connection, resp.file, resp.file_len) < 0) {
+        resp_free(&resp);
+        return -1;
+    }
+    wby_response_end(connection);
+    resp_free(&resp);
+
+    return 0;
+}
+
+static int add_handler(http_server_t* srv, const char* path, void* ctx)
+{
+    /* routes are compiled when the server starts */
+    if (srv->workers) {
+        return -1;
+    }
+
+    void *tmp = realloc(srv->handlers, (srv->handler_count + 1) * sizeof(http_handler_t));
+    if (!tmp) {
+        return -1;
+    }
+    srv->handlers = (http_handler_t*)(tmp);
+
+    srv->handlers[srv->handler_count].path = strdup(path);
+    if (!srv->handlers[srv->handler_count].path) {
+        return -1;
+    }
+    srv->handlers[srv->handler_count].get = NULL;
+    srv->handlers[srv->handler_count].post = NULL;
+    srv->handlers[srv->handler_count].ctx = ctx;
+    ++srv->handler_count;
+
+    return 0;
+}
+
+int http_set_status(http_context_t* ctx, int status)
+{
+    ctx->status = status;
+    return 0;
+}
+
+int http_server_get(http_server_t* srv, const char* path, int (*get)(http_context_t*, void*), void* ctx)
+{
+    if (add_handler(srv, path, ctx) < 0) {
+        return -1;
+    }
+
+    srv->handlers[srv->handler_count - 1].get = get;
+
+    return 0;
+}
+
+int http_server_post(http_server_t* srv, const char* path, int (*post)(http_context_t*, const void*, size_t, void*), void* ctx)
+{
+    if (add_handler(srv, path, ctx) < 0) {
+        return -1;
+    }
+
+    srv->handlers[srv->handler_count - 1].post = post;
+
+    return 0;
+}
+
+/* The file is sent from disk after the headers */
 static int serve_static_file(http_context_t* ctx, const char* path)
 {
-    FILE* f = fopen(path, "rb");
-    char buf[1024];
+    int fd = open(path, O_RDONLY);
+    struct stat st;
 
-    if (!f) {
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) {
+            close(fd);
+        }
         printf("FILE: %s is not found\n", path);
         http_set_status(ctx, 404);
         http_set_header(ctx, "content-type", "text/plain");
@@ -422,39 +1256,191 @@ static int serve_static_file(http_context_t* ctx, const char* path)
     }
 
     http_set_header(ctx, "content-type", http_server_mime_type(path));
+    ctx->file = fd;
+    ctx->file_len = (long)st.st_size;
 
-    for (;;) {
-        int l = fread(buf, 1, sizeof(buf), f);
+    return 0;
+}
+
+/* Static files are kept in memory with their ETag and type prepared, "file.gz" next to a file is
+ * sent instead to clients accepting gzip. Files are checked for changes at most once a second,
+ * ones bigger than STATIC_CACHE_MAX are not kept and go out with serve_static_file(). */
+#define STATIC_CACHE_MAX (1024 * 1024)
+#define STATIC_CHECK_SECS 1
+
+struct static_file_st {
+    char* path;
+    const char* content_type;
+    mtx_t lock;
+    time_t checked;
+    int found;
+    time_t mtime;
+    off_t size;
+    time_t gz_mtime;
+    char etag[40];
+    http_buffer_t* data;
+    http_buffer_t* gzip;
+};
+typedef struct static_file_st static_file_t;
+
+static http_buffer_t* load_file(const char* path, size_t len)
+{
+    int fd = open(path, O_RDONLY);
+    http_buffer_t* buf;
+    size_t pos = 0;
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    buf = (http_buffer_t*)malloc(sizeof(http_buffer_t) + len);
+    if (buf) {
+        atomic_init(&buf->refs, 1);
+        buf->len = len;
+    }
+    while (buf && pos < len) {
+        long l = read(fd, buf->data + pos, len - pos);
         if (l <= 0) {
+            free(buf);
+            buf = NULL;
             break;
         }
+        pos += l;
+    }
+    close(fd);
+
+    return buf;
+}
+
+static void static_file_drop(static_file_t* file)
+{
+    http_buffer_release(file->data);
+    http_buffer_release(file->gzip);
+    file->data = NULL;
+    file->gzip = NULL;
+    file->found = 0;
+}
+
+/* Reloads the file when it changes, called with the lock held */
+static void static_file_check(static_file_t* file)
+{
+    time_t now = time(NULL);
+    char gzpath[PATH_MAX + 4];
+    struct stat st, gz;
 
-        http_write(ctx, buf, l);
+    if (file->found && now - file->checked < STATIC_CHECK_SECS) {
+        return;
     }
-    fclose(f);
+    file->checked = now;
 
-    return 0;
+    if (stat(file->path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        static_file_drop(file);
+        return;
+    }
+    /* A stale .gz is ignored rather than served with the new file's ETag */
+    snprintf(gzpath, sizeof(gzpath), "%s.gz", file->path);
+    if (stat(gzpath, &gz) < 0 || !S_ISREG(gz.st_mode) || gz.st_mtime < st.st_mtime || gz.st_size > STATIC_CACHE_MAX) {
+        gz.st_mtime = 0;
+    }
+    if (file->found && st.st_mtime == file->mtime && st.st_size == file->size && gz.st_mtime == file->gz_mtime) {
+        return;
+    }
+
+    static_file_drop(file);
+    file->found = 1;
+    file->mtime = st.st_mtime;
+    file->size = st.st_size;
+    file->gz_mtime = gz.st_mtime;
+    snprintf(file->etag, sizeof(file->etag), "%lx-%lx", (unsigned long)st.st_mtime, (unsigned long)st.st_size);
+    if (st.st_size > STATIC_CACHE_MAX) {
+        return;
+    }
+    file->data = load_file(file->path, (size_t)st.st_size);
+    if (file->data && gz.st_mtime) {
+        file->gzip = load_file(gzpath, (size_t)gz.st_size);
+    }
+}
+
+static void static_file_free(void* arg)
+{
+    static_file_t* file = (static_file_t*)arg;
+
+    static_file_drop(file);
+    mtx_destroy(&file->lock);
+    free(file->path);
+    free(file);
 }
 
 static int static_file_get(http_context_t* ctx, void* arg)
 {
-    const char* path = (const char*)arg;
-    return serve_static_file(ctx, path);
+    static_file_t* file = (static_file_t*)arg;
+    const char* match = http_get_header(ctx, "if-none-match");
+    const char* encoding = http_get_header(ctx, "accept-encoding");
+    http_buffer_t* data = NULL;
+    int gzip = 0, vary = 0;
+    char etag[48];
+
+    mtx_lock(&file->lock);
+    static_file_check(file);
+    if (!file->found) {
+        mtx_unlock(&file->lock);
+        return serve_static_file(ctx, file->path);
+    }
+    vary = file->gzip != NULL;
+    gzip = vary && encoding && strstr(encoding, "gzip");
+    data = http_buffer_ref(gzip ? file->gzip : file->data);
+    snprintf(etag, sizeof(etag), "\"%s%s\"", file->etag, gzip ? "-gz" : "");
+    mtx_unlock(&file->lock);
+
+    http_set_header(ctx, "content-type", file->content_type);
+    http_set_header(ctx, "etag", etag);
+    if (vary) {
+        http_set_header(ctx, "vary", "Accept-Encoding");
+    }
+
+    if (match && strcmp(match, etag) == 0) {
+        http_buffer_release(data);
+        http_set_status(ctx, 304);
+        return 0;
+    }
+
+    if (!data) {
+        return serve_static_file(ctx, file->path);
+    }
+
+    if (gzip) {
+        http_set_header(ctx, "content-encoding", "gzip");
+    }
+    http_write_shared(ctx, data);
+    http_buffer_release(data);
+
+    return 0;
 }
 
 int http_server_static_file(http_server_t* srv, const char* path, const char* filepath)
 {
-    char* fpath = strdup(filepath);
-    if (!fpath) {
+    static_file_t* file = (static_file_t*)calloc(1, sizeof(static_file_t));
+    if (!file) {
+        return -1;
+    }
+
+    file->path = strdup(filepath);
+    if (!file->path || mtx_init(&file->lock, mtx_plain) != thrd_success) {
+        free(file->path);
+        free(file);
         return -1;
     }
+    file->content_type = http_server_mime_type(filepath);
 
-    if (http_server_atexit(srv, free, fpath) < 0) {
-        free(fpath);
+    if (http_server_atexit(srv, static_file_free, file) < 0) {
+        static_file_free(file);
         return -1;
     }
 
-    return http_server_get(srv, path, static_file_get, fpath);
+    /* Loaded now so the first requests are served from memory too */
+    static_file_check(file);
+
+    return http_server_get(srv, path, static_file_get, file);
 }
 
 struct dir_context {
@@ -525,6 +1511,543 @@ int http_server_static_path(http_server_t* srv, const char* path, const char* di
     return http_server_get(srv, path, static_dir_get, dctx);
 }
 
+static void stream_client_close(http_stream_t* stream, size_t idx)
+{
+    static const char ws_close[] = { (char)0x88, 0x00 };
+    http_stream_client_t* cl = &stream->clients[idx];
+
+    if (stream->websocket && !cl->part) {
+        send(cl->socket, ws_close, sizeof(ws_close), SEND_FLAGS);
+    }
+    wby_socket_close(cl->socket);
+    http_buffer_release(cl->part);
+    stream->clients[idx] = stream->clients[--stream->client_count];
+}
+
+static void stream_free(http_stream_t* stream)
+{
+    while (stream->client_count) {
+        stream_client_close(stream, stream->client_count - 1);
+    }
+    mtx_destroy(&stream->lock);
+    http_buffer_release(stream->last_part);
+    http_buffer_release(stream->empty);
+    free(stream->clients);
+    free(stream->path);
+    free(stream->content_type);
+    free(stream);
+}
+
+/* Sends as much of the pending part as the socket takes, -1 if the client is gone.
+ * Whatever is left of the header, data and trailer goes in one sendmsg() call. */
+static int stream_client_flush(http_stream_client_t* cl)
+{
+    while (cl->part) {
+        const char* base[3] = { cl->head, cl->part->data, "\r\n" };
+        size_t len[3] = { cl->head_len, cl->part->len, cl->tail_len };
+        size_t pos = cl->pending_pos;
+        struct iovec iov[3];
+        struct msghdr msg;
+        int n = 0;
+        long l;
+
+        for (int i = 0; i < 3; ++i) {
+            if (pos < len[i]) {
+                iov[n].iov_base = (void*)(base[i] + pos);
+                iov[n].iov_len = len[i] - pos;
+                ++n;
+                pos = 0;
+            } else {
+                pos -= len[i];
+            }
+        }
+
+        if (n == 0) {
+            http_buffer_release(cl->part);
+            cl->part = NULL;
+            break;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        l = sendmsg(cl->socket, &msg, SEND_FLAGS);
+        if (l < 0) {
+            return wby_socket_is_blocking_error(wby_socket_error()) ? 0 : -1;
+        }
+        cl->pending_pos += l;
+    }
+
+    return 0;
+}
+
+/* Flushes the client, true if it is gone or got its last part */
+static int stream_client_done(http_stream_client_t* cl)
+{
+    return stream_client_flush(cl) < 0 || (cl->last && !cl->part);
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int stream_timeout(int timeout_ms, long long ms)
+{
+    return timeout_ms < 0 || timeout_ms > ms ? (int)ms : timeout_ms;
+}
+
+/* the first worker retries parts that didn't fit in the socket, it may be asleep for good */
+static void stream_wakeup(http_stream_t* stream)
+{
+    if (stream->srv->workers && stream->srv->workers[0].started) {
+        wby_wakeup(&stream->srv->workers[0].server);
+    }
+}
+
+/* Writes the header of a part, returns its length or -1 and sets the trailer's.
+ * Long-poll parts are whole responses tagged with their sequence number. */
+static int stream_header(http_stream_t* stream, http_buffer_t* buf, unsigned seq, char* header, size_t size, int* trailer_len)
+{
+    int len;
+
+    *trailer_len = 2;
+    if (stream->websocket) {
+        *trailer_len = 0;
+        return (int)wby_make_websocket_header((wby_byte*)header, WBY_WSOP_BINARY_FRAME, (int)buf->len, 1);
+    } else if (stream->longpoll) {
+        len = snprintf(header, size,
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Length: %d\r\n"
+                       "ETag: \"%u\"\r\n"
+                       "Cache-Control: no-cache\r\n"
+                       "Connection: close\r\n"
+                       "\r\n", stream->content_type, (int)buf->len, seq);
+        *trailer_len = 0;
+    } else {
+        len = snprintf(header, size,
+                       "--" STREAM_BOUNDARY "\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Length: %d\r\n"
+                       "\r\n", stream->content_type, (int)buf->len);
+    }
+
+    return len < 0 || len >= (int)size ? -1 : len;
+}
+
+/* Gives an idle client a part to send, the caller flushes it */
+static void stream_client_start(http_stream_client_t* cl, const char* header, int header_len, int trailer_len,
+                                http_buffer_t* buf, long long now, int last)
+{
+    memcpy(cl->head, header, header_len);
+    cl->head_len = header_len;
+    cl->tail_len = trailer_len;
+    cl->part = http_buffer_ref(buf);
+    cl->pending_pos = 0;
+    cl->deadline = now + STREAM_PART_TIMEOUT_MS;
+    cl->last = last;
+}
+
+/* Bytes sent to the socket but not to the client yet, 0 where the system doesn't tell */
+static int stream_client_queued(http_stream_client_t* cl)
+{
+#ifdef SIOCOUTQ
+    int queued = 0;
+    if (ioctl(cl->socket, SIOCOUTQ, &queued) == 0) {
+        return queued;
+    }
+#endif
+    return 0;
+}
+
+/* Clients never send anything after the request, so reading EOF means they are gone */
+static int stream_client_alive(http_stream_t* stream, http_stream_client_t* cl)
+{
+    char buf[256];
+
+    for (;;) {
+        long l = recv(cl->socket, buf, sizeof(buf), 0);
+        if (l == 0 || (l > 0 && stream->websocket)) {
+            return 0;
+        }
+        if (l < 0) {
+            return wby_socket_is_blocking_error(wby_socket_error());
+        }
+    }
+}
+
+/* Returns timeout_ms lowered to when the stream needs the next update */
+static int stream_update(http_stream_t* stream, int timeout_ms)
+{
+    long long now = now_ms();
+    char header[320];
+    int header_len;
+
+    mtx_lock(&stream->lock);
+    for (size_t i = 0; i < stream->client_count;) {
+        http_stream_client_t* cl = &stream->clients[i];
+        size_t pos = cl->pending_pos;
+
+        if (!cl->part) {
+            if (!stream->longpoll || now <= cl->deadline) {
+                if (stream->longpoll) {
+                    timeout_ms = stream_timeout(timeout_ms, cl->deadline - now + 1);
+                }
+                ++i;
+                continue;
+            }
+            header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.1 304 Not Modified\r\n"
+                                  "ETag: \"%u\"\r\n"
+                                  "Cache-Control: no-cache\r\n"
+                                  "Connection: close\r\n"
+                                  "\r\n", cl->after);
+            stream_client_start(cl, header, header_len, 0, stream->empty, now, 1);
+        }
+        if (stream_client_done(cl)) {
+            stream_client_close(stream, i);
+            continue;
+        }
+        if (!cl->part || cl->pending_pos != pos) {
+            cl->deadline = now + STREAM_PART_TIMEOUT_MS;
+        } else if (now > cl->deadline) {
+            ++stream->evicted;
+            stream_client_close(stream, i);
+            continue;
+        }
+        if (cl->part) {
+            timeout_ms = stream_timeout(timeout_ms, STREAM_RETRY_MS);
+        }
+        ++i;
+    }
+    mtx_unlock(&stream->lock);
+
+    return timeout_ms;
+}
+
+/* Takes over a socket detached from webby, it is closed on failure.
+ * Long-poll clients get the last part at once when it is newer than the one they have, this is
+ * checked under the lock pushes take so no part slips by between the caller's check and here. */
+static int stream_client_add(http_stream_t* stream, wby_socket socket, unsigned after)
+{
+    http_stream_client_t* cl;
+    char header[320];
+    int header_len, trailer_len;
+    long long now = now_ms();
+
+    mtx_lock(&stream->lock);
+    void* tmp = realloc(stream->clients, (stream->client_count + 1) * sizeof(http_stream_client_t));
+    if (!tmp || wby_socket_set_blocking(socket, 0) != WBY_OK) {
+        if (tmp) {
+            stream->clients = (http_stream_client_t*)tmp;
+        }
+        mtx_unlock(&stream->lock);
+        wby_socket_close(socket);
+        return -1;
+    }
+    stream->clients = (http_stream_client_t*)tmp;
+
+    cl = &stream->clients[stream->client_count++];
+    cl->socket = socket;
+    cl->part = NULL;
+    cl->head_len = 0;
+    cl->tail_len = 0;
+    cl->pending_pos = 0;
+    cl->deadline = stream->longpoll ? now + STREAM_LONGPOLL_TIMEOUT_MS : 0;
+    cl->queued = 0;
+    cl->last = 0;
+    cl->after = after;
+
+    if (stream->longpoll && stream->last_part && (int)(stream->last_seq - after) > 0) {
+        header_len = stream_header(stream, stream->last_part, stream->last_seq, header, sizeof(header), &trailer_len);
+        if (header_len >= 0) {
+            stream_client_start(cl, header, header_len, trailer_len, stream->last_part, now, 1);
+            ++stream->sent;
+            if (stream_client_done(cl)) {
+                stream_client_close(stream, stream->client_count - 1);
+            }
+        }
+    }
+    mtx_unlock(&stream->lock);
+
+    return 0;
+}
+
+static int stream_get(http_context_t* ctx, void* arg)
+{
+    http_stream_t* stream = (http_stream_t*)arg;
+    char header[256];
+    wby_socket socket;
+    int len;
+
+    len = snprintf(header, sizeof(header),
+                   "HTTP/1.1 200 OK\r\n"
+                   "Content-Type: multipart/x-mixed-replace; boundary=" STREAM_BOUNDARY "\r\n"
+                   "Cache-Control: no-cache\r\n"
+                   "Connection: close\r\n"
+                   "\r\n");
+
+    socket = WBY_SOCK(wby_detach(ctx->con));
+    ctx->detached = 1;
+    if (wby_socket_send(socket, (const wby_byte*)header, len) != WBY_OK) {
+        wby_socket_close(socket);
+        return 0;
+    }
+    stream_client_add(stream, socket, 0);
+
+    return 0;
+}
+
+int http_stream_wait(http_context_t* ctx, http_stream_t* stream, unsigned after)
+{
+    ctx->detached = 1;
+
+    if (stream_client_add(stream, WBY_SOCK(wby_detach(ctx->con)), after) < 0) {
+        return -1;
+    }
+    /* the first worker may sleep past the client's deadline otherwise */
+    stream_wakeup(stream);
+
+    return 0;
+}
+
+static int websocket_connect(struct wby_con *connection, void *pArg)
+{
+    http_server_t* srv = ((http_worker_t*)pArg)->srv;
+
+    for (http_stream_t* stream = srv->streams; stream; stream = stream->next) {
+        if (stream->websocket && strncasecmp(stream->path, connection->request.uri, strlen(stream->path)) == 0) {
+            connection->user_data = stream;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void websocket_connected(struct wby_con *connection, void *pArg)
+{
+    http_log(((http_worker_t*)pArg)->srv, "WS %s\n", connection->request.uri);
+    stream_client_add((http_stream_t*)connection->user_data, WBY_SOCK(wby_detach(connection)), 0);
+}
+
+/* Not reached, WebSocket connections are detached as soon as they are upgraded */
+static int websocket_frame(struct wby_con *connection, const struct wby_frame *frame, void *pArg)
+{
+    return 1;
+}
+
+static void websocket_closed(struct wby_con *connection, void *pArg)
+{
+}
+
+static http_stream_t* stream_new(http_server_t* srv, const char* path, const char* content_type, int websocket)
+{
+    http_stream_t* stream = (http_stream_t*)calloc(1, sizeof(http_stream_t));
+    if (!stream) {
+        return NULL;
+    }
+
+    if (mtx_init(&stream->lock, mtx_plain) != thrd_success) {
+        free(stream);
+        return NULL;
+    }
+
+    stream->websocket = websocket;
+    stream->srv = srv;
+    stream->path = strdup(path);
+    stream->content_type = strdup(content_type);
+    if (!stream->path || !stream->content_type) {
+        stream_free(stream);
+        return NULL;
+    }
+
+    stream->next = srv->streams;
+    srv->streams = stream;
+
+    return stream;
+}
+
+http_stream_t* http_server_stream(http_server_t* srv, const char* path, const char* content_type)
+{
+    http_stream_t* stream = stream_new(srv, path, content_type, 0);
+    if (!stream) {
+        return NULL;
+    }
+
+    /* the stream stays in srv->streams and is freed with the server */
+    if (http_server_get(srv, path, stream_get, stream) < 0) {
+        return NULL;
+    }
+
+    return stream;
+}
+
+http_stream_t* http_server_websocket(http_server_t* srv, const char* path)
+{
+    return stream_new(srv, path, "application/octet-stream", 1);
+}
+
+http_stream_t* http_server_longpoll(http_server_t* srv, const char* content_type)
+{
+    http_stream_t* stream = stream_new(srv, "", content_type, 0);
+    if (stream) {
+        stream->longpoll = 1;
+        /* the body of 304 answers */
+        stream->empty = http_buffer_alloc(0);
+        if (!stream->empty) {
+            return NULL;
+        }
+    }
+
+    return stream;
+}
+
+/* Clients still sending the previous part skip this one, so slow clients drop frames instead of lagging.
+ * Parts pushed to long-poll streams without a sequence number follow the last one. */
+static int stream_push(http_stream_t* stream, http_buffer_t* buf, int has_seq, unsigned seq)
+{
+    char header[320];
+    int header_len, trailer_len;
+    int sent = 0, pending = 0;
+
+    if (!stream) {
+        return 0;
+    }
+
+    long long now = now_ms();
+
+    mtx_lock(&stream->lock);
+    if (stream->longpoll) {
+        if (!has_seq) {
+            seq = stream->last_seq + 1;
+        }
+        http_buffer_release(stream->last_part);
+        stream->last_part = http_buffer_ref(buf);
+        stream->last_seq = seq;
+    }
+    header_len = stream_header(stream, buf, seq, header, sizeof(header), &trailer_len);
+    if (header_len < 0) {
+        mtx_unlock(&stream->lock);
+        return -1;
+    }
+
+    for (size_t i = 0; i < stream->client_count;) {
+        http_stream_client_t* cl = &stream->clients[i];
+
+        if (!stream_client_alive(stream, cl)) {
+            stream_client_close(stream, i);
+            continue;
+        }
+
+        /* long-poll clients may have this part already, e.g. from a plain request */
+        if (stream->longpoll && !cl->part && (int)(seq - cl->after) <= 0) {
+            ++i;
+            continue;
+        }
+
+        int queued = cl->part ? 0 : stream_client_queued(cl);
+        if (cl->part || queued > STREAM_MAX_QUEUED) {
+            /* a backlogged client keeps its place as long as the kernel queue drains */
+            if (!cl->part && queued < cl->queued) {
+                cl->deadline = now + STREAM_PART_TIMEOUT_MS;
+            }
+            cl->queued = queued;
+            if (cl->deadline && now > cl->deadline) {
+                ++stream->evicted;
+                stream_client_close(stream, i);
+                continue;
+            }
+            ++stream->skipped;
+            ++i;
+            continue;
+        }
+
+        stream_client_start(cl, header, header_len, trailer_len, buf, now, stream->longpoll);
+        ++stream->sent;
+
+        if (stream_client_done(cl)) {
+            stream_client_close(stream, i);
+            continue;
+        }
+        ++sent;
+        pending += cl->part != NULL;
+        ++i;
+    }
+    mtx_unlock(&stream->lock);
+
+    if (pending) {
+        stream_wakeup(stream);
+    }
+
+    return sent;
+}
+
+int http_stream_push_shared(http_stream_t* stream, http_buffer_t* buf)
+{
+    return stream_push(stream, buf, 0, 0);
+}
+
+int http_stream_push_seq(http_stream_t* stream, http_buffer_t* buf, unsigned seq)
+{
+    return stream_push(stream, buf, 1, seq);
+}
+
+int http_stream_push(http_stream_t* stream, const void* ptr, int len)
+{
+    http_buffer_t* buf;
+    int rv;
+
+    if (http_stream_clients(stream) == 0) {
+        return 0;
+    }
+
+    buf = http_buffer_new(ptr, len);
+    if (!buf) {
+        return -1;
+    }
+    rv = http_stream_push_shared(stream, buf);
+    http_buffer_release(buf);
+
+    return rv;
+}
+
+int http_stream_stats(http_stream_t* stream, http_stream_stats_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!stream) {
+        return -1;
+    }
+
+    mtx_lock(&stream->lock);
+    stats->clients = (unsigned)stream->client_count;
+    stats->sent = stream->sent;
+    stats->skipped = stream->skipped;
+    stats->evicted = stream->evicted;
+    mtx_unlock(&stream->lock);
+
+    return 0;
+}
+
+int http_stream_clients(http_stream_t* stream)
+{
+    int count;
+
+    if (!stream) {
+        return 0;
+    }
+
+    mtx_lock(&stream->lock);
+    count = (int)stream->client_count;
+    mtx_unlock(&stream->lock);
+
+    return count;
+}
+
 static struct MIME {
     const char* ext;
     const char* mime;
@@ -13,6 +13,30 @@ struct wby_header;
 
 typedef struct http_context_st http_context_t;
 typedef struct http_server_st http_server_t;
+typedef struct http_stream_st http_stream_t;
+typedef struct http_buffer_st http_buffer_t;
+
+/* counters of a stream since it was created */
+typedef struct http_stream_stats_st {
+    unsigned clients;
+    unsigned long sent;    /* parts given to clients */
+    unsigned long skipped; /* parts clients missed while still sending older ones */
+    unsigned long evicted; /* clients closed for not taking a part in time */
+} http_stream_stats_t;
+
+/* immutable reference counted data shared by responses, the creator owns the first reference */
+http_buffer_t* http_buffer_new(const void* ptr, size_t len);
+http_buffer_t* http_buffer_ref(http_buffer_t* buf);
+void http_buffer_release(http_buffer_t* buf);
+const void* http_buffer_data(const http_buffer_t* buf);
+size_t http_buffer_size(const http_buffer_t* buf);
+/* writable buffer of cap bytes holding no data yet, for data made in place like encoded frames.
+ * It must not change while shared, once http_buffer_unique() is true again it can be reused. */
+http_buffer_t* http_buffer_alloc(size_t cap);
+void* http_buffer_payload(http_buffer_t* buf);
+size_t http_buffer_capacity(const http_buffer_t* buf);
+void http_buffer_set_size(http_buffer_t* buf, size_t len);
+int http_buffer_unique(http_buffer_t* buf);
 
 http_server_t* http_server_new(const char* addr, int port);
 void http_server_free(http_server_t* srv);
@@ -22,13 +46,45 @@ int http_server_redirect(http_server_t* srv, const char* path, const char* to);
 int http_server_static_file(http_server_t* srv, const char* path, const char* filepath);
 int http_server_static_path(http_server_t* srv, const char* path, const char* dirpath);
 int http_server_atexit(http_server_t* srv, void (*action)(void*), void* ptr);
+/* access log, written by a thread of its own; out = NULL disables it, rate = lines per second, 0 = all.
+ * It goes to stdout with no limit by default. */
+int http_server_log(http_server_t* srv, FILE* out, unsigned rate);
+
+/* multipart/x-mixed-replace stream, every pushed part replaces the previous one in clients */
+http_stream_t* http_server_stream(http_server_t* srv, const char* path, const char* content_type);
+/* push-only WebSocket, every pushed part is sent to clients as one binary message */
+http_stream_t* http_server_websocket(http_server_t* srv, const char* path);
+/* clients handed over with http_stream_wait() get the first part with a sequence number after theirs
+ * as the response, the last pushed one at once if it is newer already, then are closed.
+ * Clients getting none within 30 s are answered 304 Not Modified. */
+http_stream_t* http_server_longpoll(http_server_t* srv, const char* content_type);
+int http_stream_wait(http_context_t* ctx, http_stream_t* stream, unsigned after);
+int http_stream_push(http_stream_t* stream, const void* ptr, int len);
+int http_stream_push_shared(http_stream_t* stream, http_buffer_t* buf);
+/* seq orders long-poll parts and is sent as their ETag, other clients get plain parts */
+int http_stream_push_seq(http_stream_t* stream, http_buffer_t* buf, unsigned seq);
+int http_stream_clients(http_stream_t* stream);
+int http_stream_stats(http_stream_t* stream, http_stream_stats_t* stats);
 
+/* routes and log settings are fixed by http_server_start(), handlers can't be added afterwards */
+/* serves on n threads, each with its own listening socket; 0 = the caller runs http_server_update() */
+int http_server_threads(http_server_t* srv, unsigned n);
 int http_server_start(http_server_t* srv);
 int http_server_update(http_server_t* srv);
+/* like http_server_update() but sleeps up to timeout_ms (-1 = forever) until there is work,
+ * returns 1 when the descriptor from http_server_watch() got readable */
+int http_server_wait(http_server_t* srv, int timeout_ms);
+/* makes the next http_server_wait() also wake up once fd is readable, e.g. a camera.
+ * fd is watched once per call; fails without epoll or with worker threads */
+int http_server_watch(http_server_t* srv, int fd);
+/* interrupts http_server_wait(), can be called from any thread */
+int http_server_wakeup(http_server_t* srv);
 int http_server_stop(http_server_t* srv);
 
 int http_set_status(http_context_t* ctx, int status);
 int http_write(http_context_t* ctx, const void* ptr, int len);
+/* sends buf after the data from http_write() without copying it, one buffer per response */
+int http_write_shared(http_context_t* ctx, http_buffer_t* buf);
 const char* http_get_header(http_context_t* ctx, const char* name);
 const char* http_get_query_var(http_context_t* ctx, const char* name);
 int http_set_header(http_context_t* ctx, const char* name, const char* value);
@@ -41,6 +41,15 @@ DEFINES:
         will be added. This is the only C standard library function used
         by web.
 
+    WBY_NO_EPOLL
+        On Linux connections are watched with edge-triggered epoll, which
+        lets wby_update_wait() sleep until there is work to do. Define this
+        to use select() there as on all other systems.
+
+    WBY_USE_SENDFILE
+        Defined on Linux, where wby_sendfile() is available to send response
+        bodies from files without copying them through user space.
+
     WBY_UINT_PTR
         If your compiler is C99 you do not need to define this.
         Otherwise, web will try default assignments for them
@@ -163,6 +172,13 @@ extern "C" {
 #define WBY_API extern
 #endif
 
+#if defined(__linux__) && !defined(WBY_NO_EPOLL)
+#define WBY_USE_EPOLL 1
+#endif
+#if defined(__linux__)
+#define WBY_USE_SENDFILE 1
+#endif
+
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 19901L)
 #include <stdint.h>
 #ifndef WBY_UINT_PTR
@@ -283,6 +299,12 @@ struct wby_config {
     /*Called when a WebSocket data frame is incoming.
     * Call wby_read() to read the payload data.
     * Return non-zero to close the connection.*/
+    int reuse_port;
+    /* Set SO_REUSEPORT so several servers, e.g. one per thread, share the port. */
+    int send_timeout_ms;
+    /* Responses are written with blocking sends, one making no progress for
+    * this long closes the connection so a stalled client can't hold the
+    * server. 0 means no limit. */
 };
 
 struct wby_connection;
@@ -297,6 +319,18 @@ struct wby_server {
     /* number of active connection */
     struct wby_connection *con;
     /* connections */
+#ifdef WBY_USE_EPOLL
+    int epoll;
+    /* epoll instance watching the server socket, connections and wakeup */
+    int wakeup;
+    /* eventfd interrupting wby_update_wait() */
+    int listening;
+    /* whether the server socket is watched, it is not while all connections are used */
+    int watch;
+    /* descriptor of the caller watched by wby_watch(), -1 if none */
+    int watch_ready;
+    /* whether it became readable during the last wby_update_wait() */
+#endif
 #ifdef _WIN32
     int windows_socket_initialized;
     /* whether WSAStartup had to be called on Windows */
@@ -319,6 +353,18 @@ WBY_API int wby_start(struct wby_server*, void *memory);
 */
 WBY_API void wby_update(struct wby_server*);
 /* updates the server by being called frequenctly (at least once a frame) */
+WBY_API void wby_update_wait(struct wby_server*, int timeout_ms);
+/*  this function updates the server like wby_update() but first waits up to
+ *  timeout_ms milliseconds (-1 = forever) for incoming data or wby_wakeup().
+ *  Without epoll it doesn't wait. */
+WBY_API void wby_wakeup(struct wby_server*);
+/* interrupts wby_update_wait(), can be called from any thread */
+WBY_API int wby_watch(struct wby_server*, int fd);
+/*  makes the next wby_update_wait() also return once fd is readable, fd is watched once
+ *  per call. Returns -1 without epoll.
+    Output:
+    -   srv->watch_ready tells if fd got readable
+*/
 WBY_API void wby_stop(struct wby_server*);
 /* stops and shutdown the server */
 WBY_API int wby_response_begin(struct wby_con*, int status_code, int content_length,
@@ -364,6 +410,16 @@ WBY_API int wby_find_query_var(const char *buf, const char *name, char *dst, wby
 WBY_API const char* wby_find_header(struct wby_con*, const char *name);
 /*  this convenience function to find a header in a request. Returns the value
  *  of the specified header, or NULL if its was not present. */
+WBY_API wby_ptr wby_detach(struct wby_con*);
+/*  this function takes the socket of the connection away from the server,
+ *  which neither reads from nor closes it afterwards. Buffered output is
+ *  flushed first and the socket is left in blocking mode. Returns the socket. */
+#ifdef WBY_USE_SENDFILE
+WBY_API int wby_sendfile(struct wby_con*, int fd, long offset, int len);
+/*  this function writes len bytes of the file fd starting at offset as part
+ *  of the response, after any buffered output. The file position is not
+ *  changed, so one descriptor can be shared. Returns 0 on success. */
+#endif
 
 #ifdef __cplusplus
 }
@@ -595,12 +651,20 @@ wby_socket_is_blocking_error(int error)
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <strings.h>
+#ifdef WBY_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#ifdef WBY_USE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 typedef int wby_socket;
 typedef socklen_t wby_socklen;
@@ -653,11 +717,30 @@ wby_socket_config_incoming(wby_socket socket)
     return 0;
 }
 
+WBY_INTERN void
+wby_socket_set_send_timeout(wby_socket socket, int timeout_ms)
+{
+#ifdef _WIN32
+    DWORD timeout = (DWORD)timeout_ms;
+#else
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+#endif
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+#ifdef MSG_MORE
+#define WBY_SEND_MORE MSG_MORE
+#else
+#define WBY_SEND_MORE 0
+#endif
+
 WBY_INTERN int
-wby_socket_send(wby_socket socket, const wby_byte *buffer, int size)
+wby_socket_send_flags(wby_socket socket, const wby_byte *buffer, int size, int flags)
 {
     while (size > 0) {
-        long err = send(socket, (const char*)buffer, (wby_size)size, 0);
+        long err = send(socket, (const char*)buffer, (wby_size)size, flags);
         if (err <= 0) return 1;
         buffer += err;
         size -= (int)err;
@@ -665,6 +748,48 @@ wby_socket_send(wby_socket socket, const wby_byte *buffer, int size)
     return 0;
 }
 
+WBY_INTERN int
+wby_socket_send(wby_socket socket, const wby_byte *buffer, int size)
+{
+    return wby_socket_send_flags(socket, buffer, size, 0);
+}
+
+/* Sends head and then body, with a single call per partial write where the system has them */
+WBY_INTERN int
+wby_socket_send2(wby_socket socket, const wby_byte *head, int head_size,
+    const wby_byte *body, int body_size)
+{
+#ifdef _WIN32
+    if (head_size > 0 && wby_socket_send_flags(socket, head, head_size, WBY_SEND_MORE) != WBY_OK)
+        return 1;
+    return wby_socket_send(socket, body, body_size);
+#else
+    struct iovec iov[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = (void*)head;
+    iov[0].iov_len = (size_t)head_size;
+    iov[1].iov_base = (void*)body;
+    iov[1].iov_len = (size_t)body_size;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    while (iov[0].iov_len + iov[1].iov_len > 0) {
+        long err = (long)sendmsg(socket, &msg, 0);
+        if (err <= 0) return 1;
+        if ((size_t)err >= iov[0].iov_len) {
+            err -= (long)iov[0].iov_len;
+            iov[0].iov_len = 0;
+            iov[1].iov_base = (wby_byte*)iov[1].iov_base + err;
+            iov[1].iov_len -= (size_t)err;
+        } else {
+            iov[0].iov_base = (wby_byte*)iov[0].iov_base + err;
+            iov[0].iov_len -= (size_t)err;
+        }
+    }
+    return 0;
+#endif
+}
+
 /* Read as much as possible without blocking while there is buffer space. */
 enum {WBY_FILL_OK, WBY_FILL_ERROR, WBY_FILL_FULL};
 WBY_INTERN int
@@ -1012,8 +1137,28 @@ struct wby_connection {
     struct wby_frame ws_frame;
     wby_byte ws_opcode;
     wby_size blocking_count;
+#ifdef WBY_USE_EPOLL
+    int epoll;
+#endif
 };
 
+#ifdef WBY_USE_EPOLL
+/* epoll data of the server socket and the wakeup eventfd, connections use their index */
+#define WBY_EPOLL_LISTEN ((uint64_t)-1)
+#define WBY_EPOLL_WAKEUP ((uint64_t)-2)
+#define WBY_EPOLL_WATCH ((uint64_t)-3)
+
+WBY_INTERN int
+wby_epoll_ctl(int epoll, int op, wby_socket socket, unsigned int events, uint64_t data)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = data;
+    return epoll_ctl(epoll, op, socket, &ev);
+}
+#endif
+
 WBY_INTERN int
 wby_connection_set_blocking(struct wby_connection *conn)
 {
@@ -1187,24 +1332,27 @@ wby_connection_push(struct wby_connection *conn, const void *data_, int len)
         wby_dbg(conn->log, "attempt to write in non-serve state");
         return 1;
     }
-    if (len == 0)
-        return wby_socket_flush(WBY_SOCK(conn->socket), buf);
-
-    while (len > 0) {
-        int buf_space = (int)buf->max - (int)buf->used;
-        int copy_size = len < buf_space ? len : buf_space;
-        memcpy(buf->data + buf->used, data, (wby_size)copy_size);
-        buf->used += (wby_size)copy_size;
+    if (len == 0) {
+        if (wby_socket_flush(WBY_SOCK(conn->socket), buf) == WBY_OK)
+            return 0;
+        /* A response cut short leaves the client unable to read the next one */
+        conn->flags &= (unsigned short)~WBY_CON_FLAG_ALIVE;
+        return 1;
+    }
 
-        data += copy_size;
-        len -= copy_size;
-        if (buf->used == buf->max) {
-            if (wby_socket_flush(WBY_SOCK(conn->socket), buf) != WBY_OK)
-                return 1;
-            if ((wby_size)len >= buf->max)
-                return wby_socket_send(WBY_SOCK(conn->socket), data, len);
-        }
+    if (buf->used + (wby_size)len > buf->max) {
+        /* Data that doesn't fit is sent right from the caller's memory,
+         * gathered with the buffered part into the same calls. */
+        int used = (int)buf->used;
+        buf->used = 0;
+        if (wby_socket_send2(WBY_SOCK(conn->socket), buf->data, used, data, len) == WBY_OK)
+            return 0;
+        conn->flags &= (unsigned short)~WBY_CON_FLAG_ALIVE;
+        return 1;
     }
+
+    memcpy(buf->data + buf->used, data, (wby_size)len);
+    buf->used += (wby_size)len;
     return 0;
 }
 
@@ -1236,6 +1384,49 @@ wby_find_header(struct wby_con *conn, const char *name)
     return NULL;
 }
 
+WBY_API wby_ptr
+wby_detach(struct wby_con *conn_pub)
+{
+    struct wby_connection *conn = (struct wby_connection*)conn_pub;
+    wby_ptr socket = conn->socket;
+    wby_connection_push(conn, "", 0);
+#ifdef WBY_USE_EPOLL
+    epoll_ctl(conn->epoll, EPOLL_CTL_DEL, WBY_SOCK(socket), NULL);
+#endif
+    conn->socket = (wby_ptr)WBY_INVALID_SOCKET;
+    conn->flags &= (unsigned short)~WBY_CON_FLAG_ALIVE;
+    return socket;
+}
+
+#ifdef WBY_USE_SENDFILE
+WBY_API int
+wby_sendfile(struct wby_con *conn_pub, int fd, long offset, int len)
+{
+    struct wby_connection *conn = (struct wby_connection*)conn_pub;
+    struct wby_buffer *buf = &conn->io_buf;
+    off_t off = (off_t)offset;
+    if (conn->state != WBY_CON_STATE_SERVE) {
+        wby_dbg(conn->log, "attempt to write in non-serve state");
+        return 1;
+    }
+    if (buf->used > 0) {
+        if (wby_socket_send_flags(WBY_SOCK(conn->socket), buf->data,
+                (int)buf->used, WBY_SEND_MORE) != WBY_OK)
+            goto fail;
+        buf->used = 0;
+    }
+    while (len > 0) {
+        long err = (long)sendfile(WBY_SOCK(conn->socket), fd, &off, (size_t)len);
+        if (err <= 0) goto fail;
+        len -= (int)err;
+    }
+    return 0;
+fail:
+    conn->flags &= (unsigned short)~WBY_CON_FLAG_ALIVE;
+    return 1;
+}
+#endif
+
 WBY_INTERN int
 wby_con_is_websocket_request(struct wby_con* conn)
 {
@@ -1604,6 +1795,19 @@ wby_start(struct wby_server *server, void *memory)
 
     /* setup sever memory */
     server->socket = (wby_ptr)WBY_INVALID_SOCKET;
+#ifdef WBY_USE_EPOLL
+    server->epoll = epoll_create1(EPOLL_CLOEXEC);
+    server->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->listening = 0;
+    server->watch = -1;
+    if (server->epoll < 0 || server->wakeup < 0) {
+        wby_dbg(server->config.log, "failed to create epoll instance: %d", wby_socket_error());
+        if (server->epoll >= 0) close(server->epoll);
+        if (server->wakeup >= 0) close(server->wakeup);
+        server->epoll = server->wakeup = -1;
+        return -1;
+    }
+#endif
     server->con = (struct wby_connection*)WBY_ALIGN_PTR(buffer, wby_conn_align);
     buffer += ((wby_byte*)server->con - buffer);
     buffer += server->config.connection_max * sizeof(struct wby_connection);
@@ -1616,6 +1820,9 @@ wby_start(struct wby_server *server, void *memory)
         server->con[i].request_buffer_size = server->config.request_buffer_size;
         server->con[i].io_buffer_size = server->config.io_buffer_size;
         buffer += server->config.io_buffer_size;
+#ifdef WBY_USE_EPOLL
+        server->con[i].epoll = server->epoll;
+#endif
     }
     WBY_ASSERT((wby_size)(buffer - (wby_byte*)memory) <= server->memory_size);
 
@@ -1638,6 +1845,10 @@ wby_start(struct wby_server *server, void *memory)
     }
 
     setsockopt(WBY_SOCK(sock), SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    if (server->config.reuse_port)
+        setsockopt(WBY_SOCK(sock), SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
     #ifdef __APPLE__ /* Don't generate SIGPIPE when writing to dead socket, we check all writes. */
     signal(SIGPIPE, SIG_IGN);
     #endif
@@ -1662,12 +1873,26 @@ wby_start(struct wby_server *server, void *memory)
         goto error;
     }
     server->socket = (wby_ptr)sock;
+#ifdef WBY_USE_EPOLL
+    if (wby_epoll_ctl(server->epoll, EPOLL_CTL_ADD, sock, EPOLLIN, WBY_EPOLL_LISTEN) != 0 ||
+        wby_epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->wakeup, EPOLLIN, WBY_EPOLL_WAKEUP) != 0) {
+        wby_dbg(server->config.log, "epoll_ctl() failed: %d", wby_socket_error());
+        server->socket = (wby_ptr)WBY_INVALID_SOCKET;
+        goto error;
+    }
+    server->listening = 1;
+#endif
     wby_dbg(server->config.log, "server initialized: %s", strerror(errno));
     return 0;
 
 error:
     if (wby_socket_is_valid(WBY_SOCK(sock)))
         wby_socket_close(WBY_SOCK(sock));
+#ifdef WBY_USE_EPOLL
+    close(server->epoll);
+    close(server->wakeup);
+    server->epoll = server->wakeup = -1;
+#endif
     return -1;
 }
 
@@ -1683,6 +1908,11 @@ wby_stop(struct wby_server *srv)
     wby_socket_close(WBY_SOCK(srv->socket));
     for (i = 0; i < srv->con_count; ++i)
         wby_socket_close(WBY_SOCK(srv->con[i].socket));
+#ifdef WBY_USE_EPOLL
+    close(srv->epoll);
+    close(srv->wakeup);
+    srv->epoll = srv->wakeup = -1;
+#endif
 }
 
 WBY_INTERN int
@@ -1720,6 +1950,17 @@ wby_on_incoming(struct wby_server *srv)
         wby_socket_close(fd);
         return 1;
     }
+    if (srv->config.send_timeout_ms > 0)
+        wby_socket_set_send_timeout(fd, srv->config.send_timeout_ms);
+
+#ifdef WBY_USE_EPOLL
+    /* Registered once, edge-triggered: handlers always read until EAGAIN */
+    if (wby_epoll_ctl(srv->epoll, EPOLL_CTL_ADD, fd,
+            EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, connection_index) != 0) {
+        wby_socket_close(fd);
+        return 1;
+    }
+#endif
 
     /* OK, keep this connection */
     wby_dbg(srv->config.log, "tagging connection %d as alive", connection_index);
@@ -1938,6 +2179,127 @@ wby_update_connection(struct wby_server *srv, struct wby_connection* connection)
     } /* for */
 }
 
+#ifdef WBY_USE_EPOLL
+WBY_API void
+wby_update_wait(struct wby_server *srv, int timeout_ms)
+{
+    struct epoll_event events[64];
+    wby_size i, fresh;
+    int n, e;
+
+    srv->watch_ready = 0;
+    n = epoll_wait(srv->epoll, events, (int)WBY_LEN(events), timeout_ms);
+    if (n < 0) {
+        if (wby_socket_error() != EINTR)
+            wby_dbg(srv->config.log, "failed to epoll_wait");
+        return;
+    }
+
+    fresh = srv->con_count;
+    for (e = 0; e < n; ++e) {
+        uint64_t data = events[e].data.u64;
+        if (data == WBY_EPOLL_WAKEUP) {
+            uint64_t count;
+            if (read(srv->wakeup, &count, sizeof(count)) < 0)
+                wby_dbg(srv->config.log, "failed to read wakeup eventfd");
+        } else if (data == WBY_EPOLL_WATCH) {
+            srv->watch_ready = 1;
+        } else if (data == WBY_EPOLL_LISTEN) {
+            do {
+                wby_dbg(srv->config.log, "awake on incoming");
+            } while (wby_on_incoming(srv) == 0);
+        } else if (data < fresh && (srv->con[data].flags & WBY_CON_FLAG_ALIVE)) {
+            wby_dbg(srv->config.log, "reading from connection %d", (int)data);
+            wby_update_connection(srv, &srv->con[data]);
+        }
+    }
+
+    /* Serve requests that came with the connection */
+    for (i = fresh; i < srv->con_count; ++i) {
+        if (srv->con[i].flags & WBY_CON_FLAG_ALIVE)
+            wby_update_connection(srv, &srv->con[i]);
+    }
+
+    /* Close stale connections, the last one takes the free slot and is re-registered under its new index. */
+    for (i = 0; i < srv->con_count; ) {
+        struct wby_connection *connection = &srv->con[i];
+        if (!(connection->flags & WBY_CON_FLAG_ALIVE)) {
+            struct wby_connection tmp;
+            wby_size last = srv->con_count - 1;
+            wby_dbg(srv->config.log, "closing connection %d (%08x)", i, connection->flags);
+            if (connection->flags & WBY_CON_FLAG_WEBSOCKET)
+                srv->config.ws_closed(&connection->public_data, srv->config.userdata);
+            wby_connection_close(connection);
+            if (i != last) {
+                /* swap, so each slot keeps its own buffers */
+                tmp = srv->con[i];
+                srv->con[i] = srv->con[last];
+                srv->con[last] = tmp;
+                wby_epoll_ctl(srv->epoll, EPOLL_CTL_MOD, WBY_SOCK(srv->con[i].socket),
+                    EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, i);
+            }
+            --srv->con_count;
+        } else ++i;
+    }
+
+    /* Stop accepting while there are no free slots */
+    if ((srv->con_count < srv->config.connection_max) != srv->listening) {
+        srv->listening = !srv->listening;
+        wby_epoll_ctl(srv->epoll, EPOLL_CTL_MOD, WBY_SOCK(srv->socket),
+            srv->listening ? EPOLLIN : 0, WBY_EPOLL_LISTEN);
+    }
+}
+
+WBY_API void
+wby_wakeup(struct wby_server *srv)
+{
+    uint64_t one = 1;
+    if (write(srv->wakeup, &one, sizeof(one)) < 0)
+        wby_dbg(srv->config.log, "failed to write wakeup eventfd");
+}
+
+WBY_API int
+wby_watch(struct wby_server *srv, int fd)
+{
+    /* one-shot, so a descriptor the caller doesn't read yet can't keep waking it up */
+    if (fd == srv->watch)
+        return wby_epoll_ctl(srv->epoll, EPOLL_CTL_MOD, fd, EPOLLIN | EPOLLONESHOT, WBY_EPOLL_WATCH);
+    if (srv->watch >= 0)
+        epoll_ctl(srv->epoll, EPOLL_CTL_DEL, srv->watch, NULL);
+    srv->watch = -1;
+    if (wby_epoll_ctl(srv->epoll, EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLONESHOT, WBY_EPOLL_WATCH) != 0)
+        return -1;
+    srv->watch = fd;
+    return 0;
+}
+
+WBY_API void
+wby_update(struct wby_server *srv)
+{
+    wby_update_wait(srv, 0);
+}
+#else
+WBY_API void
+wby_update_wait(struct wby_server *srv, int timeout_ms)
+{
+    WBY_UNUSED(timeout_ms);
+    wby_update(srv);
+}
+
+WBY_API void
+wby_wakeup(struct wby_server *srv)
+{
+    WBY_UNUSED(srv);
+}
+
+WBY_API int
+wby_watch(struct wby_server *srv, int fd)
+{
+    WBY_UNUSED(srv);
+    WBY_UNUSED(fd);
+    return -1;
+}
+
 WBY_API void
 wby_update(struct wby_server *srv)
 {
@@ -2013,5 +2375,6 @@ wby_update(struct wby_server *srv)
         } else ++i;
     }
 }
+#endif
 
 #endif /* WBY_IMPLEMENTATION */
@@ -1,11 +1,18 @@
 #include "web/http.h"
 #include "optcfg.h"
 #include "sound.h"
+#include "pool.h"
+#include "motion.h"
+#include "record.h"
+#include "history.h"
 #include <libwebcam.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
 
 /* Simple webcam-based http camera interface */
@@ -16,12 +23,120 @@ static void sigint(int sig)
 	++exit_now;
 }
 
-unsigned char *FRAME = NULL;
-size_t FRAME_SZ = 0;
+/* Captured frame, it is encoded only when somebody asks for it */
+struct raw_frame {
+	unsigned char *data;
+	size_t cap;
+	size_t bpl;
+	int width;
+	int height;
+	webcam_pixel_format_t format;
+	unsigned seq;
+	/* Motion cells of captured frames, see struct motion. cols is 0 when they are not known. */
+	unsigned char *cells;
+	size_t cells_cap;
+	int cols;
+	int rows;
+};
+/* Triple buffer between capture and encoders: new_frame() fills RAW[RAW_BACK] and swaps it
+ * with RAW_READY, encode_frame() swaps RAW_FRONT with RAW_READY when RAW_NEW is set there.
+ * Capture never waits for an encoder this way. */
+#define RAW_NEW 4
+static struct raw_frame RAW[3];
+static int RAW_BACK = 0;
+static atomic_int RAW_READY = 1;
+static int RAW_FRONT = 2;
+/* Sequence number of the last captured frame */
+static atomic_uint RAW_SEQ = 0;
+/* Guards RAW_FRONT and LEVEL. Encoders reading them are counted in SOURCE_USERS, the front frame is
+ * only swapped once there are none, so encoding itself runs without the lock. */
+static mtx_t SOURCE_MUTEX;
+static cnd_t SOURCE_COND;
+static int SOURCE_USERS = 0;
+/* Downscale pyramid of RAW[RAW_FRONT], LEVEL[n] is half the size of LEVEL[n - 1] and LEVEL[0]
+ * is the frame itself. YUV frames are converted to I420 by the first halving, RGB ones stay RGB.
+ * Levels are made once per frame when a profile needs them and shared by all profiles. */
+#define LEVELS 4
+static struct raw_frame LEVEL[LEVELS];
+struct jpeg_state;
+/* Output profile: size, quality and subsampling of the JPEG frames served at /jpeg/<name> and
+ * streamed at /stream/<name>.mjpg. Frames are encoded only when somebody asks for them.
+ * With a bitrate the quality of each frame is picked to keep frames near bytes_per_frame,
+ * quality is then the highest one used. */
+struct profile {
+	char name[16];
+	int level;
+	int quality;
+	int subsampling;
+	int kbps;
+	size_t bytes_per_frame;
+	int rc_quality;
+	size_t last_len;
+	/* Last encoded frame, responses hold their own references so it is never copied per client.
+	 * Frames are encoded straight into their buffer, the one before is kept in spare and reused
+	 * once the last response holding it is gone. */
+	http_buffer_t *frame;
+	http_buffer_t *spare;
+	unsigned frame_seq;
+	http_stream_t *stream;
+	/* Stream clients when the last frame was pushed, new ones get that frame again */
+	int stream_clients;
+	/* Held while a frame of the profile is encoded, with the encoder and ROI mask of the profile.
+	 * Profiles are encoded at the same time, frame and frame_seq are only swapped under G_MUTEX. */
+	mtx_t encode_lock;
+	struct jpeg_state *jpeg;
+	unsigned char *roi_mask;
+	size_t roi_mask_cap;
+};
+/* PROFILES[0] is the full size one of /image.jpg, /jpeg/, /stream.mjpg and /ws/video */
+#define MAX_PROFILES 9
+static struct profile PROFILES[MAX_PROFILES] = { { .quality = 75, .subsampling = 420 } };
+static unsigned PROFILE_CNT = 1;
+/* Change detection: frames with MOTION_LEVEL or fewer changed cells in 1000 are not published,
+ * so they are neither copied nor encoded and conditional requests get 304. A frame is still
+ * published every MOTION_REFRESH_SECS. MOTION_SCORE is the score of the last captured frame.
+ * MOTION_LEVEL -1 publishes every frame, the detector then only runs for ROI. */
+#define MOTION_DIFF 6
+#define MOTION_REFRESH_SECS 10
+static struct motion *MOTION = NULL;
+static int MOTION_LEVEL = 0;
+static atomic_int MOTION_SCORE = 0;
+static time_t MOTION_PUBLISHED = 0;
+/* With ROI, MCUs of encoded frames covering no active motion cell get their average colour only */
+static int ROI = 0;
+/* Recorder of published full size frames, NULL when not recording */
+static struct record *RECORD = NULL;
+/* Ring file of the last published full size frames, NULL when there is none */
+static struct history *HISTORY = NULL;
+/* Frames in the --shm ring, consumers have SHM_SLOTS - 1 frame times to use one */
+#define SHM_SLOTS 4
+/* Frames listed by one /history/range response at most */
+#define HISTORY_RANGE_MAX 4096
+/* Last frame pushed to the streams */
+static unsigned PUSH_SEQ = 0;
+/* Sequence number of the last frame pushed to long-poll clients */
+static unsigned NEXT_SEQ = 0;
+/* MJPEG stream and WebSockets, frames and sound are pushed to them as they are captured */
+static http_stream_t *STREAM = NULL;
+static http_stream_t *WS_VIDEO = NULL;
+static http_stream_t *WS_AUDIO = NULL;
+/* Clients of /jpeg/next waiting for a frame newer than the one they have */
+static http_stream_t *NEXT = NULL;
+/* Id of the last sound buffer pushed to WS_AUDIO */
+static unsigned SND_ID = 0;
+/* Threads encoding a frame, 0 means one per CPU */
+static unsigned ENCODE_THREADS = 0;
+/* HTTP worker threads, with 0 clients are served from the capture loop */
+static unsigned WORKERS = 0;
+/* With workers capture wakes the streamer thread to push frames and sound */
+static mtx_t PUSH_MUTEX;
+static cnd_t PUSH_COND;
+static int PUSH_EXIT = 0;
 char CAM_NAME[256] = "";
 struct snd_ctx *sound = NULL;
 
 char ROOT[256];
+/* Guards the published frames of profiles, it is only held to take or swap a reference */
 static mtx_t G_MUTEX;
 
 static void LOCK(void)
@@ -35,10 +150,22 @@ static void UNLOCK(void)
 }
 
 static void new_frame(void *ctx, webcam_t *cam, unsigned char *pixels, size_t bpl, size_t size);
-static int save_jpeg(unsigned char **buf, size_t *len, int quality, unsigned char *data, int width, int height, int bpl);
+static int encode_frame(struct profile *prof);
+static void push_frame(void);
+static void push_sound(void);
+static void frame_ready(void);
+static int streamer(void *arg);
+static int save_jpeg(struct jpeg_state **state, http_buffer_t *out, int quality, int subsampling, const unsigned char *mask, unsigned char *data, int width, int height, int bpl, webcam_pixel_format_t format);
+static int parse_profiles(const char *spec);
+static http_buffer_t *current_frame(struct profile *prof, unsigned *seq);
 static int current_image_get(http_context_t *cnx, void *param);
+static int next_image_get(http_context_t *cnx, void *param);
 static int snd_enabled_get(http_context_t *cnx, void *param);
 static int snd_wav_get(http_context_t *cnx, void *param);
+static int stats_get(http_context_t *cnx, void *param);
+static int motion_get(http_context_t *cnx, void *param);
+static int history_frame_get(http_context_t *cnx, void *param);
+static int history_range_get(http_context_t *cnx, void *param);
 
 
 static long delta_time(struct timeval *t1, struct timeval *t2)
@@ -68,23 +195,65 @@ int main(int argc, char *argv[])
 		{ 'S', "stereo",
 			"Enable stereo mode", OPTCFG_FLAG, "no" },
 		{ 'e', "exec",
-			"Execute program as sound source", 0, NULL }
+			"Execute program as sound source", 0, NULL },
+		{ 'P', "pixel-format",
+			"Camera pixel format: rgb, yuyv, nv12 or i420", 0, "yuyv" },
+		{ 'T', "threads",
+			"Threads encoding each frame with the bundled encoder, 0 = one per CPU", 0, "0" },
+		{ 'W', "workers",
+			"HTTP worker threads, 0 = serve clients between captures", 0, "0" },
+		{ 'L', "log-rate",
+			"Requests logged per second at most, 0 = no access log", 0, "100" },
+		{ 'j', "profiles",
+			"JPEG profiles as name:scale:quality:subsampling, scale is 1, 2, 4 or 8 and subsampling 444, 422 or 420",
+			0, "hi:1:90:444,lo:2:60:420,thumb:8:50:420" },
+		{ 'B', "bitrate",
+			"Target bitrate of full size frames in kbit/s, 0 = fixed quality. Profiles take it as a fifth field", 0, "0" },
+		{ 'M', "motion",
+			"Changed parts in 1000 up to which a frame is taken as unchanged and skipped, -1 = keep all", 0, "-1" },
+		{ 'R', "roi",
+			"Encode only the parts of frames with motion in full, the rest with its average colour", OPTCFG_FLAG, "no" },
+		{ 'o', "record",
+			"Record frames to <record>-<date>-<time>.avi files, with --motion only frames with changes", 0, NULL },
+		{ 't', "timelapse",
+			"Record one of every N frames", 0, "1" },
+		{ 'g', "segment",
+			"Start a new recording file after this many MB, 1024 at most", 0, "256" },
+		{ 'k', "history",
+			"Keep the last frames in this ring file for /history, it is kept across restarts", 0, NULL },
+		{ 'K', "history-size",
+			"Size of the history ring file in MB", 0, "64" },
+		{ 'x', "shm",
+			"Publish raw frames to local processes in this POSIX shared memory ring, see webcam_shm_open()", 0, NULL }
 	};
+	static const char *pixel_formats[] = { "rgb", "yuyv", "nv12", "i420" };
+	webcam_pixel_format_t pixfmt = WEBCAM_PIX_RGB24;
 	unsigned options_cnt = sizeof(options) / sizeof(options[0]);
 	struct optcfg *opts;
 	int cams[64];
 	unsigned cam_cnt = 64;
 	webcam_t *cam;
     http_server_t* srv;
+	thrd_t pusher;
+	int log_rate;
 	struct timeval last, cur;
 	long dtime;
 	int port;
 	const char *host;
 	int bsecs, freq, bits, stereo;
+	int watch;
 	const char *snd_cmd = NULL;
 	const char *root = NULL;
+	const char *pixfmt_name;
+	const char *record;
+	const char *history;
+	const char *shm;
+	char path[64];
+	unsigned i;
 
     mtx_init(&G_MUTEX, mtx_plain);
+	mtx_init(&SOURCE_MUTEX, mtx_plain);
+	cnd_init(&SOURCE_COND);
 	
 	opts = optcfg_new();
 	if (!opts) {
@@ -114,9 +283,38 @@ int main(int argc, char *argv[])
 
 	host = optcfg_get(opts, "host", NULL);
 
+	ENCODE_THREADS = optcfg_get_int(opts, "threads", 0);
+	WORKERS = optcfg_get_int(opts, "workers", 0);
+	log_rate = optcfg_get_int(opts, "log-rate", 100);
+	MOTION_LEVEL = optcfg_get_int(opts, "motion", -1);
+	ROI = optcfg_get_flag(opts, "roi");
+
+	PROFILES[0].kbps = optcfg_get_int(opts, "bitrate", 0);
+	if (parse_profiles(optcfg_get(opts, "profiles", ""))) {
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < PROFILE_CNT; i++) {
+		PROFILES[i].bytes_per_frame = PROFILES[i].kbps > 0 ? (size_t)PROFILES[i].kbps * 125 * dtime / 1000000 : 0;
+		PROFILES[i].rc_quality = PROFILES[i].quality;
+		mtx_init(&PROFILES[i].encode_lock, mtx_plain);
+	}
+
 	root = optcfg_get(opts, "root", ".");
 	snprintf(ROOT, sizeof(ROOT), "%s/", root);
 
+	/* YUV frames are encoded as they are, without RGB conversion in libv4l2 and back in the encoder */
+	pixfmt_name = optcfg_get(opts, "pixel-format", "yuyv");
+	for (i = 0; i < sizeof(pixel_formats) / sizeof(pixel_formats[0]); i++) {
+		if (!strcasecmp(pixfmt_name, pixel_formats[i])) {
+			pixfmt = i;
+			break;
+		}
+	}
+	if (i == sizeof(pixel_formats) / sizeof(pixel_formats[0])) {
+		fprintf(stderr, "Error: unknown pixel format `%s'\n", pixfmt_name);
+		return EXIT_FAILURE;
+	}
+
 	if (webcam_list(cams, &cam_cnt)) {
 		fprintf(stderr, "Error: Can't get list of cameras!\n");
 		return 1;
@@ -128,8 +326,10 @@ int main(int argc, char *argv[])
 	}
 
 	signal(SIGINT, sigint);
+	/* Stream clients go away at any moment, send errors are handled */
+	signal(SIGPIPE, SIG_IGN);
 
-	cam = webcam_open(cams[0], 640, 480);
+	cam = webcam_open_format(cams[0], 640, 480, pixfmt);
 	if (!cam) {
 		http_server_free(srv);
 		fprintf(stderr, "Error: can't open camera!\n");
@@ -137,18 +337,39 @@ int main(int argc, char *argv[])
 	}
 	snprintf(CAM_NAME, sizeof(CAM_NAME), "WEBCAM: %s", cam->name);
 
+	shm = optcfg_get(opts, "shm", NULL);
+	if (shm && webcam_publish(cam, shm, SHM_SLOTS))
+		fprintf(stderr, "WARNING: can't publish frames to shared memory!\n");
+
     srv = http_server_new(host, port);
     if (!srv) {
         fprintf(stderr, "Error: can't create web server!\n");
         return 1;
     }
+    http_server_log(srv, log_rate > 0 ? stdout : NULL, log_rate);
 
     http_server_static_file(srv, "/index.html", "index.html");
     http_server_static_file(srv, "/jquery-2.1.3.min.js", "jquery-2.1.3.min.js");
-    http_server_get(srv, "/image.jpg", current_image_get, NULL);
-	http_server_get(srv, "/jpeg/", current_image_get, NULL);
+    http_server_get(srv, "/image.jpg", current_image_get, &PROFILES[0]);
+	http_server_get(srv, "/jpeg/next", next_image_get, &PROFILES[0]);
+	for (i = 1; i < PROFILE_CNT; i++) {
+		snprintf(path, sizeof(path), "/jpeg/%s", PROFILES[i].name);
+		http_server_get(srv, path, current_image_get, &PROFILES[i]);
+		snprintf(path, sizeof(path), "/stream/%s.mjpg", PROFILES[i].name);
+		PROFILES[i].stream = http_server_stream(srv, path, "image/jpeg");
+	}
+	http_server_get(srv, "/jpeg/", current_image_get, &PROFILES[0]);
+	NEXT = http_server_longpoll(srv, "image/jpeg");
+	STREAM = http_server_stream(srv, "/stream.mjpg", "image/jpeg");
+	PROFILES[0].stream = STREAM;
+	WS_VIDEO = http_server_websocket(srv, "/ws/video");
+	WS_AUDIO = http_server_websocket(srv, "/ws/audio");
 	http_server_get(srv, "/sound_enabled.txt", snd_enabled_get, NULL);
 	http_server_get(srv, "/audio.wav*", snd_wav_get, NULL);
+	http_server_get(srv, "/stats.txt", stats_get, NULL);
+	http_server_get(srv, "/motion.txt", motion_get, NULL);
+	http_server_get(srv, "/history/range", history_range_get, NULL);
+	http_server_get(srv, "/history", history_frame_get, NULL);
     http_server_static_file(srv, "/", "index.html");
 
 	webcam_start(cam);
@@ -156,7 +377,7 @@ int main(int argc, char *argv[])
 	printf("Waiting for the first frame...");
 	fflush(stdout);
 
-	while (!FRAME) {
+	while (!atomic_load(&RAW_SEQ)) {
 		if (webcam_wait_frame_cb(cam, new_frame, NULL, 10) < 0) {
 			webcam_stop(cam);
 			webcam_close(cam);
@@ -186,25 +407,85 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	record = optcfg_get(opts, "record", NULL);
+	if (record) {
+		RECORD = record_open(record, cam->width, cam->height, 1000000 / dtime,
+				     optcfg_get_int(opts, "timelapse", 1),
+				     (size_t)optcfg_get_int(opts, "segment", 256) << 20);
+		if (!RECORD)
+			fprintf(stderr, "WARNING: can't start recording!\n");
+	}
+
+	history = optcfg_get(opts, "history", NULL);
+	if (history) {
+		HISTORY = history_open(history, (size_t)optcfg_get_int(opts, "history-size", 64) << 20);
+		if (!HISTORY)
+			fprintf(stderr, "WARNING: can't open history!\n");
+	}
+
+	if (WORKERS) {
+		mtx_init(&PUSH_MUTEX, mtx_plain);
+		cnd_init(&PUSH_COND);
+		if (thrd_create(&pusher, streamer, NULL) != thrd_success) {
+			fprintf(stderr, "Error: can't start streamer thread!\n");
+			WORKERS = 0;
+		}
+		http_server_threads(srv, WORKERS);
+	}
+
     http_server_start(srv);
+	/* Without workers the server loop sleeps on the camera too, else capture waits on its own */
+	watch = !WORKERS && http_server_watch(srv, webcam_get_fd(cam)) == 0;
 	for (;;) {
 		int cam_status;
+		long wait;
 
 		gettimeofday(&cur, NULL);
 		if (delta_time(&last, &cur) > dtime) {
-			cam_status = webcam_wait_frame_cb(cam, new_frame, NULL, 10);
+			if (watch)
+				cam_status = webcam_try_frame(cam, new_frame, NULL);
+			else
+				cam_status = webcam_wait_frame_cb(cam, new_frame, NULL, 10);
 			if (cam_status < 0)
 				break;
-			if (cam_status > 0)
+			if (cam_status > 0) {
 				memcpy(&last, &cur, sizeof(struct timeval));
+				frame_ready();
+			}
 		}
 
 		if (exit_now)
 			break;
 
-        http_server_update(srv);
+		gettimeofday(&cur, NULL);
+		wait = dtime - delta_time(&last, &cur);
+		if (WORKERS) {
+			/* Workers serve clients, just sleep until the next frame is due */
+			if (wait > 0)
+				usleep(wait);
+			continue;
+		}
+
+		push_sound();
+
+		/* Serve clients until the next frame is due, then until the camera has it, instead of polling */
+		if (wait > 0)
+			http_server_wait(srv, (wait + 999) / 1000);
+		else if (watch && http_server_watch(srv, webcam_get_fd(cam)) == 0)
+			http_server_wait(srv, dtime / 1000);
+		else
+			http_server_wait(srv, 0);
+	}
+	if (WORKERS) {
+		mtx_lock(&PUSH_MUTEX);
+		PUSH_EXIT = 1;
+		cnd_signal(&PUSH_COND);
+		mtx_unlock(&PUSH_MUTEX);
+		thrd_join(pusher, NULL);
 	}
     http_server_stop(srv);
+	record_close(RECORD);
+	history_close(HISTORY);
 	webcam_stop(cam);
 	webcam_close(cam);
 
@@ -215,34 +496,68 @@ int main(int argc, char *argv[])
 
 	printf("EXIT!\n");
 	http_server_free(srv);
+	motion_free(MOTION);
 
 	return 0;
 }
 
 static int current_image_get(http_context_t *cnx, void *param)
 {
+	struct profile *prof = param;
 	char date[80];
+	char etag[16];
 	time_t curtime = time(NULL);
 	struct tm *gmt = gmtime(&curtime);
+	const char *match = http_get_header(cnx, "if-none-match");
+	http_buffer_t *frame;
+	unsigned seq;
 
 	strftime(date, sizeof(date) - 1, "%c", gmt);
 
-	if (!FRAME) {
+	/* Frames are tagged with their sequence number, the client's one is not encoded nor sent again */
+	snprintf(etag, sizeof(etag), "\"%u\"", atomic_load(&RAW_SEQ));
+	if (match && strcmp(match, etag) == 0) {
+		http_set_status(cnx, 304);
+		http_set_header(cnx, "etag", etag);
+		http_set_header(cnx, "cache-control", "no-cache");
+		return 0;
+	}
+
+	frame = current_frame(prof, &seq);
+	if (!frame) {
 		return -1; /* TODO! */
 	}
+	snprintf(etag, sizeof(etag), "\"%u\"", seq);
 
     http_set_header(cnx, "accept-ranges", "bytes");
     http_set_header(cnx, "date", date);
     http_set_header(cnx, "content-type", "image/jpeg");
     http_set_header(cnx, "cache-control", "no-cache");
+    http_set_header(cnx, "etag", etag);
 
-    LOCK();
-    http_write(cnx, FRAME, FRAME_SZ);
-    UNLOCK();
+    http_write_shared(cnx, frame);
+    http_buffer_release(frame);
 
 	return 0;
 }
 
+/* Long-poll for the frame after the one tagged with ?after=, the server loop is not blocked while waiting.
+ * A frame pushed after the check is handed over by http_stream_wait(), one captured but not pushed yet
+ * is pushed by the streamer as soon as it sees the client. */
+static int next_image_get(http_context_t *cnx, void *param)
+{
+	const char *after = http_get_query_var(cnx, "after");
+	unsigned seq;
+
+	if (after) {
+		seq = (unsigned)strtoul(after, NULL, 10);
+		if ((int)(atomic_load(&RAW_SEQ) - seq) <= 0)
+			return http_stream_wait(cnx, NEXT, seq);
+	}
+
+	return current_image_get(cnx, param);
+}
+
 static int snd_enabled_get(http_context_t *cnx, void *param)
 {
 	http_set_header(cnx, "content-type", "text/plain");
@@ -256,6 +571,137 @@ static int snd_enabled_get(http_context_t *cnx, void *param)
 	return 0;
 }
 
+static int stats_get(http_context_t *cnx, void *param)
+{
+	static const char *names[] = { "stream", "ws_video", "ws_audio", "next" };
+	http_stream_t *streams[] = { STREAM, WS_VIDEO, WS_AUDIO, NEXT };
+	http_stream_stats_t stats;
+	struct record_stats rstats;
+	char line[160];
+	size_t i;
+
+	http_set_header(cnx, "content-type", "text/plain");
+	http_set_header(cnx, "cache-control", "no-cache");
+
+	for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+		if (http_stream_stats(streams[i], &stats))
+			continue;
+		snprintf(line, sizeof(line), "%s clients=%u sent=%lu skipped=%lu evicted=%lu\n",
+			 names[i], stats.clients, stats.sent, stats.skipped, stats.evicted);
+		http_write(cnx, line, -1);
+	}
+
+	if (record_stats(RECORD, &rstats) == 0) {
+		snprintf(line, sizeof(line), "record written=%lu dropped=%lu segments=%u error=%d\n",
+			 rstats.written, rstats.dropped, rstats.segments, rstats.error);
+		http_write(cnx, line, -1);
+	}
+
+	LOCK();
+	for (i = 0; i < PROFILE_CNT; i++) {
+		snprintf(line, sizeof(line), "profile %s quality=%d bytes=%zu\n",
+			 i ? PROFILES[i].name : "default",
+			 PROFILES[i].bytes_per_frame ? PROFILES[i].rc_quality : PROFILES[i].quality,
+			 PROFILES[i].last_len);
+		http_write(cnx, line, -1);
+	}
+	UNLOCK();
+
+	return 0;
+}
+
+/* Changed parts in 1000 of the last captured frame, -1 when it is not known */
+static int motion_get(http_context_t *cnx, void *param)
+{
+	char line[32];
+
+	http_set_header(cnx, "content-type", "text/plain");
+	http_set_header(cnx, "cache-control", "no-cache");
+
+	snprintf(line, sizeof(line), "%d\n", MOTION ? atomic_load(&MOTION_SCORE) : -1);
+	http_write(cnx, line, -1);
+
+	return 0;
+}
+
+/* Times of /history are seconds since the epoch with up to 6 decimals, as in the responses */
+static int64_t parse_time(const char *str, int64_t def)
+{
+	int64_t time, frac = 0;
+	char *end;
+	int digits = 0;
+
+	if (!str || !*str)
+		return def;
+
+	time = strtoll(str, &end, 10) * 1000000;
+	if (*end == '.') {
+		for (end++; *end >= '0' && *end <= '9' && digits < 6; end++, digits++)
+			frac = frac * 10 + *end - '0';
+		for (; digits < 6; digits++)
+			frac *= 10;
+	}
+
+	return str[0] == '-' ? time - frac : time + frac;
+}
+
+/* Stored frame taken at or before ?t=, the newest one without it */
+static int history_frame_get(http_context_t *cnx, void *param)
+{
+	http_buffer_t *frame = NULL;
+	int64_t time;
+	char stamp[32];
+
+	if (HISTORY)
+		frame = history_get(HISTORY, parse_time(http_get_query_var(cnx, "t"), INT64_MAX), &time);
+	if (!frame) {
+		http_set_status(cnx, 404);
+		http_set_header(cnx, "content-type", "text/plain");
+		http_write(cnx, "No frame", -1);
+		return 0;
+	}
+
+	snprintf(stamp, sizeof(stamp), "%lld.%06lld", (long long)(time / 1000000), (long long)(time % 1000000));
+	http_set_header(cnx, "content-type", "image/jpeg");
+	http_set_header(cnx, "cache-control", "no-cache");
+	http_set_header(cnx, "x-timestamp", stamp);
+	http_write_shared(cnx, frame);
+	http_buffer_release(frame);
+
+	return 0;
+}
+
+/* Times and sizes of the stored frames taken between ?from= and ?to=, one per line */
+static int history_range_get(http_context_t *cnx, void *param)
+{
+	int64_t *times;
+	uint32_t *sizes;
+	unsigned cnt = 0, i;
+	char line[48];
+
+	http_set_header(cnx, "content-type", "text/plain");
+	http_set_header(cnx, "cache-control", "no-cache");
+
+	if (!HISTORY)
+		return 0;
+
+	times = malloc(HISTORY_RANGE_MAX * (sizeof(int64_t) + sizeof(uint32_t)));
+	if (!times)
+		return -1;
+	sizes = (uint32_t*)(times + HISTORY_RANGE_MAX);
+
+	cnt = history_range(HISTORY, parse_time(http_get_query_var(cnx, "from"), 0),
+			    parse_time(http_get_query_var(cnx, "to"), INT64_MAX), times, sizes, HISTORY_RANGE_MAX);
+	for (i = 0; i < cnt; i++) {
+		snprintf(line, sizeof(line), "%lld.%06lld %u\n",
+			 (long long)(times[i] / 1000000), (long long)(times[i] % 1000000), (unsigned)sizes[i]);
+		http_write(cnx, line, -1);
+	}
+	free(times);
+
+	return 0;
+}
+
 static int snd_wav_get(http_context_t *cnx, void *param)
 {
 	char date[80];
@@ -267,6 +713,13 @@ static int snd_wav_get(http_context_t *cnx, void *param)
 
 	strftime(date, sizeof(date) - 1, "%c", gmt);
 
+	if (!sound) {
+		http_set_status(cnx, 404);
+		http_set_header(cnx, "content-type", "text/plain");
+		http_write(cnx, "No sound", -1);
+		return 0;
+	}
+
 	id = snd_current_buf(sound);
 	printf("SND: %u --- ", id);
 	if (snd_buf(sound, &id, &buf, &buf_len)) {
@@ -283,64 +736,219 @@ static int snd_wav_get(http_context_t *cnx, void *param)
 	return 0;
 }
 
+/* Luma and chroma of scanline y of a YUV frame, pixel x has luma py[x * y_step] and
+ * chroma pu/pv[(x / 2) * c_step] */
+static void yuv_scanline(const unsigned char *data, int y, int height, int bpl, webcam_pixel_format_t format,
+			 const unsigned char **py, const unsigned char **pu, const unsigned char **pv,
+			 int *y_step, int *c_step)
+{
+	int c_bpl = bpl / 2;
+
+	*py = data + y * bpl;
+	*y_step = 1;
+	*c_step = 1;
+
+	switch (format) {
+	case WEBCAM_PIX_YUYV:
+		*y_step = 2;
+		*c_step = 4;
+		*pu = *py + 1;
+		*pv = *py + 3;
+		break;
+	case WEBCAM_PIX_NV12:
+		*c_step = 2;
+		*pu = data + height * bpl + (y / 2) * bpl;
+		*pv = *pu + 1;
+		break;
+	default:
+		*pu = data + height * bpl + (y / 2) * c_bpl;
+		*pv = *pu + c_bpl * ((height + 1) / 2);
+		break;
+	}
+}
+
 #if defined(WITH_LIBJPEG) && WITH_LIBJPEG
 
 #include <jpeglib.h>
 
-static int save_jpeg(unsigned char **buf, size_t *len, int quality, unsigned char *data, int width, int height, int bpl)
-{
+/* Compressor of a profile, created with its first frame and reused for all frames */
+struct jpeg_state {
 	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	unsigned char *b = NULL;
-	unsigned long l = 0;
-	JSAMPROW row_pointer[1];
+	struct jpeg_error_mgr err;
+	/* YCbCr scanline unpacked from YUV frames */
+	unsigned char *ycc_row;
+	size_t ycc_row_cap;
+};
+/* Limited to full range tables for YUV frames */
+static unsigned char Y_LUT[256], C_LUT[256];
+static once_flag YUV_LUTS_ONCE = ONCE_FLAG_INIT;
+
+static unsigned char clamp8(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
 
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
+static void init_yuv_luts(void)
+{
+	int i;
 
-	jpeg_mem_dest(&cinfo, &b, &l);
+	for (i = 0; i < 256; i++) {
+		Y_LUT[i] = clamp8(i < 16 ? 0 : ((i - 16) * 255 + 109) / 219);
+		C_LUT[i] = clamp8(128 + ((i - 128) * 255 + ((i < 128) ? -112 : 112)) / 224);
+	}
+}
 
-	cinfo.image_width = width;
-	cinfo.image_height = height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_EXT_RGB;
+/* Expands scanline y of a YUV frame into interleaved full range YCbCr */
+static unsigned char *yuv_row(struct jpeg_state *st, unsigned char *data, int y, int width, int height, int bpl, webcam_pixel_format_t format)
+{
+	const unsigned char *py, *pu, *pv;
+	int y_step, c_step;
+	unsigned char *d = st->ycc_row;
+	int x;
+
+	yuv_scanline(data, y, height, bpl, format, &py, &pu, &pv, &y_step, &c_step);
 
-	jpeg_set_defaults(&cinfo);
+	for (x = 0; x < width; x++) {
+		*d++ = Y_LUT[py[x * y_step]];
+		*d++ = C_LUT[pu[(x / 2) * c_step]];
+		*d++ = C_LUT[pv[(x / 2) * c_step]];
+	}
 
-	jpeg_set_quality(&cinfo, quality, TRUE);
+	return st->ycc_row;
+}
 
-	jpeg_start_compress(&cinfo, TRUE);
+static int save_jpeg(struct jpeg_state **state, http_buffer_t *out, int quality, int subsampling, const unsigned char *mask, unsigned char *data, int width, int height, int bpl, webcam_pixel_format_t format)
+{
+	struct jpeg_state *st = *state;
+	struct jpeg_compress_struct *cinfo;
+	unsigned char *b = http_buffer_payload(out);
+	unsigned long l = http_buffer_capacity(out);
+	JSAMPROW row_pointer[1];
 
-	while (cinfo.next_scanline < cinfo.image_height) {
-		row_pointer[0] = (void*)&data[cinfo.next_scanline * bpl];
-		(void)jpeg_write_scanlines(&cinfo, row_pointer, 1);
+	if (!st) {
+		st = calloc(1, sizeof(struct jpeg_state));
+		if (!st) {
+			return -1;
+		}
+		st->cinfo.err = jpeg_std_error(&st->err);
+		jpeg_create_compress(&st->cinfo);
+		call_once(&YUV_LUTS_ONCE, init_yuv_luts);
+		*state = st;
 	}
+	cinfo = &st->cinfo;
+
+	if (format != WEBCAM_PIX_RGB24 && st->ycc_row_cap < (size_t)width * 3) {
+		free(st->ycc_row);
+		st->ycc_row_cap = 0;
+		st->ycc_row = malloc(width * 3);
+		if (!st->ycc_row) {
+			return -1;
+		}
+		st->ycc_row_cap = width * 3;
+	}
+
+	/* libjpeg writes into the frame until it is full and then switches to its own buffer */
+	jpeg_mem_dest(cinfo, &b, &l);
+
+	cinfo->image_width = width;
+	cinfo->image_height = height;
+	cinfo->input_components = 3;
+	/* YCbCr input is only subsampled, not converted */
+	cinfo->in_color_space = format == WEBCAM_PIX_RGB24 ? JCS_EXT_RGB : JCS_YCbCr;
 
-	jpeg_finish_compress(&cinfo);
+	jpeg_set_defaults(cinfo);
 
-	*buf = b;
-	*len = l;
+	/* libjpeg has no way to skip MCUs, frames are encoded in full */
+	(void)mask;
+	jpeg_set_quality(cinfo, quality, TRUE);
+	/* Chroma of the first component is sampled at 2x2 by default */
+	cinfo->comp_info[0].h_samp_factor = subsampling == 444 ? 1 : 2;
+	cinfo->comp_info[0].v_samp_factor = subsampling == 420 ? 2 : 1;
 
-	jpeg_destroy_compress(&cinfo);
+	jpeg_start_compress(cinfo, TRUE);
+
+	while (cinfo->next_scanline < cinfo->image_height) {
+		if (format == WEBCAM_PIX_RGB24)
+			row_pointer[0] = (void*)&data[cinfo->next_scanline * bpl];
+		else
+			row_pointer[0] = yuv_row(st, data, cinfo->next_scanline, width, height, bpl, format);
+		(void)jpeg_write_scanlines(cinfo, row_pointer, 1);
+	}
+
+	jpeg_finish_compress(cinfo);
+
+	if (b != http_buffer_payload(out)) {
+		free(b);
+		return -1;
+	}
+	http_buffer_set_size(out, l);
 
 	return 0;
 }
 #else
 #include <jpge.h>
-static int save_jpeg(unsigned char **buf, size_t *len, int quality, unsigned char *data, int width, int height, int bpl)
+
+/* Encoder of a profile, it keeps its tables and buffers between frames */
+struct jpeg_state {
+	struct jpeg_encoder *encoder;
+};
+/* Frames are split into bands separated by restart markers and encoded on the pool, which is
+ * shared by all profiles and runs one frame's bands at a time */
+static struct pool *POOL = NULL;
+static once_flag POOL_ONCE = ONCE_FLAG_INIT;
+
+static void pool_init(void)
 {
+	POOL = pool_new(ENCODE_THREADS);
+}
+
+static void encode_parallel(void *ctx, void (*fn)(void *arg, int index), void *arg, int count)
+{
+	pool_run(ctx, fn, arg, count);
+}
+
+static int save_jpeg(struct jpeg_state **state, http_buffer_t *out, int quality, int subsampling, const unsigned char *mask, unsigned char *data, int width, int height, int bpl, webcam_pixel_format_t format)
+{
+	static const enum jpge_yuv_format yuv_formats[] = { 0, JPGE_YUYV, JPGE_NV12, JPGE_I420 };
+	struct jpeg_state *st = *state;
 	struct jpeg_params params;
-	void *pbuf = NULL;
-	int plen = 0;
+	int len = 0;
+	int rv;
+
+	if (!st) {
+		st = calloc(1, sizeof(struct jpeg_state));
+		if (!st) {
+			return -1;
+		}
+		st->encoder = jpeg_encoder_new();
+		if (!st->encoder) {
+			free(st);
+			return -1;
+		}
+
+		call_once(&POOL_ONCE, pool_init);
+		if (POOL && pool_size(POOL) > 1)
+			jpeg_encoder_set_parallel(st->encoder, encode_parallel, POOL, pool_size(POOL));
+		*state = st;
+	}
 
 	jpeg_params_init(&params);
 	params.m_quality = quality;
-
-	if (!compress_image_to_jpeg_file_alloc_memory(&pbuf, &plen, width, height, 3, data, &params)) {
+	params.m_subsampling = subsampling == 444 ? JPGE_H1V1 : (subsampling == 422 ? JPGE_H2V1 : JPGE_H2V2);
+
+	params.m_yuv_limited_range = 1;
+	params.m_mcu_mask = mask;
+
+	if (format == WEBCAM_PIX_RGB24)
+		rv = jpeg_encoder_compress_to_buffer(st->encoder, http_buffer_payload(out), &len, http_buffer_capacity(out),
+						     width, height, 3, bpl, data, &params);
+	else
+		rv = jpeg_encoder_compress_yuv_to_buffer(st->encoder, http_buffer_payload(out), &len, http_buffer_capacity(out),
+							 width, height, yuv_formats[format], bpl, data, &params);
+	if (!rv) {
 		return -1;
 	}
-	*buf = pbuf;
-	*len = plen;
+	http_buffer_set_size(out, len);
 
 	return 0;
 }
@@ -348,18 +956,518 @@ static int save_jpeg(unsigned char **buf, size_t *len, int quality, unsigned cha
 
 static void new_frame(void *ctx, webcam_t *cam, unsigned char *pixels, size_t bpl, size_t size)
 {
-	unsigned char *buf = NULL;
-	size_t len = 0;
+	struct raw_frame *raw = &RAW[RAW_BACK];
+	time_t now;
+	int score;
+
+	if (MOTION_LEVEL >= 0 || ROI) {
+		if (MOTION && (MOTION->width != (int)cam->width || MOTION->height != (int)cam->height || MOTION->format != cam->format)) {
+			motion_free(MOTION);
+			MOTION = NULL;
+		}
+		if (!MOTION)
+			MOTION = motion_new(cam->width, cam->height, cam->format, MOTION_DIFF);
+	}
+	if (MOTION) {
+		score = motion_check(MOTION, pixels, bpl);
+		atomic_store(&MOTION_SCORE, score);
+		now = time(NULL);
+		if (score >= 0 && MOTION_LEVEL >= 0 && score <= MOTION_LEVEL && now - MOTION_PUBLISHED < MOTION_REFRESH_SECS)
+			return;
+		motion_update(MOTION);
+		MOTION_PUBLISHED = now;
+	}
+
+	raw->cols = 0;
+	if (MOTION && ROI) {
+		size_t cells = MOTION->cols * MOTION->rows;
+
+		if (raw->cells_cap < cells) {
+			free(raw->cells);
+			raw->cells_cap = 0;
+			raw->cells = malloc(cells);
+		}
+		if (raw->cells) {
+			raw->cells_cap = cells;
+			memcpy(raw->cells, MOTION->active, cells);
+			raw->cols = MOTION->cols;
+			raw->rows = MOTION->rows;
+		}
+	}
+
+	if (raw->cap < size) {
+		free(raw->data);
+		raw->cap = 0;
+		raw->data = malloc(size);
+		if (!raw->data) {
+			fprintf(stderr, "Error: can't save frame!\n");
+			return;
+		}
+		raw->cap = size;
+	}
+
+	memcpy(raw->data, pixels, size);
+	raw->bpl = bpl;
+	raw->width = cam->width;
+	raw->height = cam->height;
+	raw->format = cam->format;
+	/* Only capture changes RAW_SEQ */
+	raw->seq = atomic_load(&RAW_SEQ) + 1;
+
+	RAW_BACK = atomic_exchange(&RAW_READY, RAW_BACK | RAW_NEW) & 3;
+	atomic_store(&RAW_SEQ, raw->seq);
+}
 
-	if (save_jpeg(&buf, &len, 75, pixels, cam->width, cam->height, bpl)) {
-		fprintf(stderr, "Error: can't save frame!\n");
+/* Called after a frame is captured */
+static void frame_ready(void)
+{
+	if (!WORKERS) {
+		push_frame();
 		return;
 	}
 
+	mtx_lock(&PUSH_MUTEX);
+	cnd_signal(&PUSH_COND);
+	mtx_unlock(&PUSH_MUTEX);
+}
+
+/* Pushes frames and sound to stream clients while HTTP workers serve the rest */
+static int streamer(void *arg)
+{
+	struct timespec ts;
+
+	mtx_lock(&PUSH_MUTEX);
+	while (!PUSH_EXIT) {
+		if (PUSH_SEQ == atomic_load(&RAW_SEQ)) {
+			/* Wake up now and then for sound */
+			timespec_get(&ts, TIME_UTC);
+			ts.tv_nsec += 100000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			cnd_timedwait(&PUSH_COND, &PUSH_MUTEX, &ts);
+		}
+		mtx_unlock(&PUSH_MUTEX);
+
+		push_frame();
+		push_sound();
+
+		mtx_lock(&PUSH_MUTEX);
+	}
+	mtx_unlock(&PUSH_MUTEX);
+
+	return 0;
+}
+
+/* Sends the new frame to stream clients, only profiles with clients are encoded.
+ * Unchanged frames are not published, so clients joining a static scene get the last one again. */
+static void push_frame(void)
+{
+	http_buffer_t *frame;
+	unsigned seq = atomic_load(&RAW_SEQ);
+	int fresh = seq != PUSH_SEQ;
+	struct timeval now;
+	int clients;
+	int waiting;
+	unsigned i;
+
+	PUSH_SEQ = seq;
+
+	clients = http_stream_clients(STREAM) + http_stream_clients(WS_VIDEO);
+	/* long-poll clients may have come in after a frame they missed */
+	waiting = http_stream_clients(NEXT) && seq != NEXT_SEQ;
+	if ((fresh && (clients || RECORD || HISTORY)) || waiting || clients > PROFILES[0].stream_clients) {
+		frame = current_frame(&PROFILES[0], &seq);
+		if (frame) {
+			http_stream_push_shared(STREAM, frame);
+			http_stream_push_shared(WS_VIDEO, frame);
+			if (seq != NEXT_SEQ) {
+				http_stream_push_seq(NEXT, frame, seq);
+				NEXT_SEQ = seq;
+			}
+			if (fresh) {
+				gettimeofday(&now, NULL);
+				if (RECORD)
+					record_push(RECORD, frame, &now);
+				if (HISTORY)
+					history_push(HISTORY, frame, &now);
+			}
+			http_buffer_release(frame);
+		}
+	}
+	PROFILES[0].stream_clients = clients;
+
+	for (i = 1; i < PROFILE_CNT; i++) {
+		clients = http_stream_clients(PROFILES[i].stream);
+		if (clients && (fresh || clients > PROFILES[i].stream_clients)) {
+			frame = current_frame(&PROFILES[i], &seq);
+			if (frame) {
+				http_stream_push_shared(PROFILES[i].stream, frame);
+				http_buffer_release(frame);
+			}
+		}
+		PROFILES[i].stream_clients = clients;
+	}
+}
+
+/* Returns a reference to the newest frame of a profile and its sequence number, encoding it if needed.
+ * A frame already encoded only costs a reference. Requests coming while the profile is encoded wait
+ * for it and share the result, requests for other profiles don't. */
+static http_buffer_t *current_frame(struct profile *prof, unsigned *seq)
+{
+	http_buffer_t *frame = NULL;
+
+	LOCK();
+	if (prof->frame && prof->frame_seq == atomic_load(&RAW_SEQ)) {
+		frame = http_buffer_ref(prof->frame);
+		*seq = prof->frame_seq;
+	}
+	UNLOCK();
+	if (frame)
+		return frame;
+
+	mtx_lock(&prof->encode_lock);
+	encode_frame(prof);
 	LOCK();
-		free(FRAME);
-		FRAME = buf;
-		FRAME_SZ = len;
+	frame = http_buffer_ref(prof->frame);
+	*seq = prof->frame_seq;
 	UNLOCK();
+	mtx_unlock(&prof->encode_lock);
+
+	return frame;
+}
+
+/* Parses name:scale:quality:subsampling[:kbps][,...] into PROFILES[1...] */
+static int parse_profiles(const char *spec)
+{
+	struct profile *prof;
+	int scale, n;
+
+	while (*spec) {
+		if (PROFILE_CNT == MAX_PROFILES) {
+			fprintf(stderr, "Error: too many profiles\n");
+			return -1;
+		}
+		prof = &PROFILES[PROFILE_CNT];
+		n = 0;
+		if (sscanf(spec, "%15[^:,]:%d:%d:%d%n", prof->name, &scale, &prof->quality, &prof->subsampling, &n) == 4 &&
+		    spec[n] == ':') {
+			spec += n + 1;
+			n = 0;
+			sscanf(spec, "%d%n", &prof->kbps, &n);
+		}
+		if (!n || (spec[n] != ',' && spec[n] != '\0')) {
+			fprintf(stderr, "Error: bad profile `%s'\n", spec);
+			return -1;
+		}
+		for (prof->level = 0; prof->level < LEVELS && (1 << prof->level) != scale; prof->level++)
+			;
+		if (prof->level == LEVELS || prof->quality < 1 || prof->quality > 100 ||
+		    (prof->subsampling != 444 && prof->subsampling != 422 && prof->subsampling != 420) ||
+		    !strcmp(prof->name, "next")) {
+			fprintf(stderr, "Error: bad profile `%s'\n", spec);
+			return -1;
+		}
+		PROFILE_CNT++;
+		spec += spec[n] ? n + 1 : n;
+	}
+
+	return 0;
+}
+
+/* Halves a YUV frame into I420, every output sample is the average of four input ones */
+static void half_yuv(const struct raw_frame *src, struct raw_frame *dst)
+{
+	const unsigned char *py0, *pu0, *pv0, *py1, *pu1, *pv1;
+	unsigned char *dy, *du, *dv;
+	int y_step, c_step;
+	int c_bpl = dst->bpl / 2;
+	int x, y;
+
+	for (y = 0; y < dst->height; y++) {
+		yuv_scanline(src->data, y * 2, src->height, src->bpl, src->format, &py0, &pu0, &pv0, &y_step, &c_step);
+		yuv_scanline(src->data, y * 2 + 1, src->height, src->bpl, src->format, &py1, &pu1, &pv1, &y_step, &c_step);
+		dy = dst->data + y * dst->bpl;
+		for (x = 0; x < dst->width; x++)
+			dy[x] = (py0[x * 2 * y_step] + py0[(x * 2 + 1) * y_step] +
+				 py1[x * 2 * y_step] + py1[(x * 2 + 1) * y_step] + 2) >> 2;
+	}
+
+	/* A chroma sample of the output covers 4x4 input pixels, rows 0 and 2 of them are averaged */
+	for (y = 0; y < dst->height / 2; y++) {
+		yuv_scanline(src->data, y * 4, src->height, src->bpl, src->format, &py0, &pu0, &pv0, &y_step, &c_step);
+		yuv_scanline(src->data, y * 4 + 2, src->height, src->bpl, src->format, &py1, &pu1, &pv1, &y_step, &c_step);
+		du = dst->data + dst->height * dst->bpl + y * c_bpl;
+		dv = du + c_bpl * (dst->height / 2);
+		for (x = 0; x < dst->width / 2; x++) {
+			du[x] = (pu0[x * 2 * c_step] + pu0[(x * 2 + 1) * c_step] +
+				 pu1[x * 2 * c_step] + pu1[(x * 2 + 1) * c_step] + 2) >> 2;
+			dv[x] = (pv0[x * 2 * c_step] + pv0[(x * 2 + 1) * c_step] +
+				 pv1[x * 2 * c_step] + pv1[(x * 2 + 1) * c_step] + 2) >> 2;
+		}
+	}
+}
+
+static void half_rgb(const struct raw_frame *src, struct raw_frame *dst)
+{
+	const unsigned char *s0, *s1;
+	unsigned char *d;
+	int x, y, c;
+
+	for (y = 0; y < dst->height; y++) {
+		s0 = src->data + y * 2 * src->bpl;
+		s1 = s0 + src->bpl;
+		d = dst->data + y * dst->bpl;
+		for (x = 0; x < dst->width; x++, s0 += 6, s1 += 6)
+			for (c = 0; c < 3; c++)
+				*d++ = (s0[c] + s0[c + 3] + s1[c] + s1[c + 3] + 2) >> 2;
+	}
+}
+
+/* Returns level n of the pyramid of the front frame, making the missing levels.
+ * Levels too small to halve again are returned instead of deeper ones. Called with SOURCE_MUTEX held,
+ * a level is not changed once made for the front frame. */
+static struct raw_frame *pyramid_level(struct raw_frame *raw, int n)
+{
+	struct raw_frame *src = raw, *dst;
+	size_t size;
+	int i;
+
+	for (i = 1; i <= n; i++, src = dst) {
+		dst = &LEVEL[i];
+		if (dst->data && dst->seq == raw->seq)
+			continue;
+		if (src->width < 32 || src->height < 32)
+			break;
+
+		dst->width = (src->width / 2) & ~1;
+		dst->height = (src->height / 2) & ~1;
+		dst->format = src->format == WEBCAM_PIX_RGB24 ? WEBCAM_PIX_RGB24 : WEBCAM_PIX_YUV420;
+		dst->bpl = dst->format == WEBCAM_PIX_RGB24 ? dst->width * 3 : dst->width;
+		size = dst->format == WEBCAM_PIX_RGB24 ? (size_t)dst->bpl * dst->height : (size_t)dst->bpl * dst->height * 3 / 2;
+		if (dst->cap < size) {
+			free(dst->data);
+			dst->cap = 0;
+			dst->data = malloc(size);
+			if (!dst->data)
+				break;
+			dst->cap = size;
+		}
+
+		if (src->format == WEBCAM_PIX_RGB24)
+			half_rgb(src, dst);
+		else
+			half_yuv(src, dst);
+		dst->seq = raw->seq;
+	}
+
+	return src;
+}
+
+/* Sends every new sound buffer as a WAV file to WebSocket clients */
+static void push_sound(void)
+{
+	unsigned char *buf;
+	size_t len;
+	unsigned id;
+
+	if (!sound || http_stream_clients(WS_AUDIO) == 0)
+		return;
+
+	id = snd_current_buf(sound);
+	if (id == SND_ID || snd_buf(sound, &id, &buf, &len))
+		return;
+
+	http_stream_push(WS_AUDIO, buf, len);
+	SND_ID = id;
+}
+
+/* IJG quality to quantizer scale in percent and back, both encoders use it for their tables */
+static int quality_scale(int quality)
+{
+	return quality < 50 ? 5000 / quality : 200 - quality * 2;
+}
+
+static int scale_quality(int scale)
+{
+	return scale > 100 ? 5000 / scale : (200 - scale) / 2;
+}
+
+/* Quality for the next frame of a rate controlled profile from the size the last one got at quality.
+ * Frame size is taken as inversely proportional to the quantizer scale, which holds well enough
+ * around the target, and the scale moves at most 2x per frame. */
+static int rate_quality(struct profile *prof, int quality, size_t len)
+{
+	size_t target = prof->bytes_per_frame;
+	int scale = quality_scale(quality);
+	int next;
+
+	/* Sizes within 10% of the target don't move the quality so it doesn't flicker */
+	if (len * 10 > target * 9 && len * 10 < target * 11)
+		return quality;
+
+	if (scale < 1)
+		scale = 1;
+	if (len > target * 2)
+		next = scale * 2;
+	else if (len * 2 < target)
+		next = (scale + 1) / 2;
+	else
+		next = (int)((long long)scale * len / target);
+	if (next == scale)
+		next += len > target ? 1 : -1;
+
+	quality = next < 1 ? 100 : scale_quality(next);
+	if (quality > prof->quality)
+		quality = prof->quality;
+	if (quality < 5)
+		quality = 5;
+
+	return quality;
+}
+
+/* Per-MCU mask of an image made from raw for jpeg_params.m_mcu_mask, MCUs covering no active motion
+ * cell of raw are set. Cells the frame has no data for count as active. Called with SOURCE_MUTEX and
+ * the profile's encode lock held. */
+static const unsigned char *roi_mask(struct profile *prof, const struct raw_frame *raw, const struct raw_frame *img)
+{
+	int subsampling = prof->subsampling;
+	int mcu_w = subsampling == 444 ? 8 : 16, mcu_h = subsampling == 420 ? 16 : 8;
+	int cols = (img->width + mcu_w - 1) / mcu_w, rows = (img->height + mcu_h - 1) / mcu_h;
+	int mx, my, cx, cy, cx0, cx1, cy0, cy1, active;
+
+	if (!ROI || !raw->cols)
+		return NULL;
+
+	if (prof->roi_mask_cap < (size_t)(cols * rows)) {
+		free(prof->roi_mask);
+		prof->roi_mask_cap = 0;
+		prof->roi_mask = malloc(cols * rows);
+		if (!prof->roi_mask)
+			return NULL;
+		prof->roi_mask_cap = cols * rows;
+	}
+
+	for (my = 0; my < rows; my++) {
+		cy0 = my * mcu_h * raw->height / img->height / MOTION_CELL;
+		cy1 = ((my + 1) * mcu_h * raw->height / img->height + MOTION_CELL - 1) / MOTION_CELL;
+		for (mx = 0; mx < cols; mx++) {
+			cx0 = mx * mcu_w * raw->width / img->width / MOTION_CELL;
+			cx1 = ((mx + 1) * mcu_w * raw->width / img->width + MOTION_CELL - 1) / MOTION_CELL;
+			active = cx1 > raw->cols || cy1 > raw->rows;
+			for (cy = cy0; !active && cy < cy1; cy++)
+				for (cx = cx0; !active && cx < cx1; cx++)
+					active = raw->cells[cy * raw->cols + cx];
+			prof->roi_mask[my * cols + mx] = !active;
+		}
+	}
+
+	return prof->roi_mask;
+}
+
+/* Largest JPEG of an image, 2 bytes per sample and the headers, as libjpeg-turbo's tjBufSize() takes it */
+static size_t jpeg_max_size(int width, int height, int subsampling)
+{
+	size_t pixels = (size_t)((width + 15) & ~15) * ((height + 15) & ~15);
+
+	return pixels * (subsampling == 444 ? 6 : (subsampling == 422 ? 4 : 3)) + 4096;
+}
+
+/* Takes the newest captured frame as the source of the profile's next frame, NULL when the profile
+ * has it already. The front frame is swapped for a new one once no encoder reads it. The returned
+ * image stays valid until source_release(). */
+static struct raw_frame *source_acquire(struct profile *prof, unsigned *seq, const unsigned char **mask)
+{
+	struct raw_frame *raw, *img = NULL;
+
+	mtx_lock(&SOURCE_MUTEX);
+	if (atomic_load(&RAW_READY) & RAW_NEW) {
+		while (SOURCE_USERS)
+			cnd_wait(&SOURCE_COND, &SOURCE_MUTEX);
+		if (atomic_load(&RAW_READY) & RAW_NEW)
+			RAW_FRONT = atomic_exchange(&RAW_READY, RAW_FRONT) & 3;
+	}
+	raw = &RAW[RAW_FRONT];
+	if (!prof->frame || raw->seq != prof->frame_seq) {
+		*seq = raw->seq;
+		img = pyramid_level(raw, prof->level);
+		*mask = roi_mask(prof, raw, img);
+		SOURCE_USERS++;
+	}
+	mtx_unlock(&SOURCE_MUTEX);
+
+	return img;
+}
+
+static void source_release(void)
+{
+	mtx_lock(&SOURCE_MUTEX);
+	if (--SOURCE_USERS == 0)
+		cnd_broadcast(&SOURCE_COND);
+	mtx_unlock(&SOURCE_MUTEX);
 }
 
+/* Encodes the last captured frame into the frame of a profile, called with the profile's encode lock held.
+ * The frame is published under G_MUTEX once done. */
+static int encode_frame(struct profile *prof)
+{
+	http_buffer_t *frame;
+	struct raw_frame *raw;
+	size_t len = 0, size;
+	unsigned seq;
+	int quality, next, rv;
+	const unsigned char *mask = NULL;
+
+	raw = source_acquire(prof, &seq, &mask);
+	if (!raw)
+		return 0;
+
+	/* The frame before the current one is written over when no response holds it anymore */
+	size = jpeg_max_size(raw->width, raw->height, prof->subsampling);
+	frame = prof->spare;
+	prof->spare = NULL;
+	if (frame && (!http_buffer_unique(frame) || http_buffer_capacity(frame) < size)) {
+		http_buffer_release(frame);
+		frame = NULL;
+	}
+	if (!frame)
+		frame = http_buffer_alloc(size);
+	if (!frame) {
+		source_release();
+		fprintf(stderr, "Error: can't encode frame!\n");
+		return -1;
+	}
+
+	quality = prof->bytes_per_frame ? prof->rc_quality : prof->quality;
+	next = quality;
+	rv = save_jpeg(&prof->jpeg, frame, quality, prof->subsampling, mask, raw->data, raw->width, raw->height, raw->bpl, raw->format);
+	len = http_buffer_size(frame);
+	if (!rv && prof->bytes_per_frame) {
+		next = rate_quality(prof, quality, len);
+		/* A scene change blowing the budget is encoded again rather than sent late */
+		if (len > prof->bytes_per_frame * 3 / 2 && next < quality) {
+			rv = save_jpeg(&prof->jpeg, frame, next, prof->subsampling, mask, raw->data, raw->width, raw->height, raw->bpl, raw->format);
+			len = http_buffer_size(frame);
+			quality = next;
+			next = rate_quality(prof, quality, len);
+		}
+	}
+	source_release();
+	if (rv) {
+		fprintf(stderr, "Error: can't encode frame!\n");
+		prof->spare = frame;
+		return -1;
+	}
+
+	LOCK();
+	if (prof->bytes_per_frame)
+		prof->rc_quality = next;
+	prof->last_len = len;
+	prof->spare = prof->frame;
+	prof->frame = frame;
+	prof->frame_seq = seq;
+	UNLOCK();
+
+	return 0;
+}